@@ -2,6 +2,7 @@
 #include <stddef.h>
 #include <lib/cio.h>
 #include <lib/klib.h>
+#include <lib/mutex.h>
 #include <fs/devfs/devfs.h>
 #include <sys/pci.h>
 #include <mm/mm.h>
@@ -78,7 +79,7 @@ static int ide_write48(int disk, uint64_t sector, uint16_t count, uint8_t *buffe
 
 static ide_device ide_devices[DEVICE_COUNT];
 
-static lock_t ide_lock = new_lock;
+static mutex_t ide_lock = new_mutex;
 
 static int find_block(int drive, uint64_t block) {
     for (size_t i = 0; i < MAX_CACHED_BLOCKS; i++)
@@ -131,7 +132,7 @@ notfnd:
 }
 
 static int ide_read(int drive, void *buf, uint64_t loc, size_t count) {
-    spinlock_acquire(&ide_lock);
+    mutex_lock(&ide_lock);
 
     uint64_t progress = 0;
     while (progress < count) {
@@ -141,7 +142,7 @@ static int ide_read(int drive, void *buf, uint64_t loc, size_t count) {
         if (slot == -1) {
             slot = cache_block(drive, block);
             if (slot == -1) {
-                spinlock_release(&ide_lock);
+                mutex_unlock(&ide_lock);
                 return -1;
             }
         }
@@ -155,12 +156,12 @@ static int ide_read(int drive, void *buf, uint64_t loc, size_t count) {
         progress += chunk;
     }
 
-    spinlock_release(&ide_lock);
+    mutex_unlock(&ide_lock);
     return (int)count;
 }
 
 static int ide_write(int drive, const void *buf, uint64_t loc, size_t count) {
-    spinlock_acquire(&ide_lock);
+    mutex_lock(&ide_lock);
 
     uint64_t progress = 0;
     while (progress < count) {
@@ -170,7 +171,7 @@ static int ide_write(int drive, const void *buf, uint64_t loc, size_t count) {
         if (slot == -1) {
             slot = cache_block(drive, block);
             if (slot == -1) {
-                spinlock_release(&ide_lock);
+                mutex_unlock(&ide_lock);
                 return -1;
             }
         }
@@ -185,12 +186,12 @@ static int ide_write(int drive, const void *buf, uint64_t loc, size_t count) {
         progress += chunk;
     }
 
-    spinlock_release(&ide_lock);
+    mutex_unlock(&ide_lock);
     return (int)count;
 }
 
 static int ide_flush(int device) {
-    spinlock_acquire(&ide_lock);
+    mutex_lock(&ide_lock);
 
     for (size_t i = 0; i < MAX_CACHED_BLOCKS; i++) {
         if (ide_devices[device].cache[i].status == CACHE_DIRTY) {
@@ -199,7 +200,7 @@ static int ide_flush(int device) {
             ret = ide_write48(device, ide_devices[device].cache[i].block * SECTORS_PER_BLOCK, SECTORS_PER_BLOCK, ide_devices[device].cache[i].cache);
 
             if (ret == -1) {
-                spinlock_release(&ide_lock);
+                mutex_unlock(&ide_lock);
                 return -1;
             }
 
@@ -207,7 +208,7 @@ static int ide_flush(int device) {
         }
     }
 
-    spinlock_release(&ide_lock);
+    mutex_unlock(&ide_lock);
     return 0;
 }
 
@@ -6,6 +6,7 @@
 #include <lib/cmem.h>
 #include "nvme_private.h"
 #include <lib/klib.h>
+#include <lib/mutex.h>
 #include <devices/dev.h>
 #include <lib/bit.h>
 #include <mm/mm.h>
@@ -49,7 +50,7 @@ typedef struct {
     cached_block_t *cache;
     struct nvme_queue queues[2];
     int max_prps;
-    lock_t nvme_lock;
+    mutex_t nvme_lock;
     size_t overwritten_slot;
     size_t num_lbas;
     size_t cache_block_size;
@@ -58,9 +59,17 @@ typedef struct {
 
 nvme_device_t *nvme_devices;
 
+/* Queues must be page aligned, which small kalloc() objects are not */
+static void *nvme_alloc_queue(size_t size) {
+    char *ptr = pmm_allocz(DIV_ROUNDUP(size, PAGE_SIZE));
+    if (!ptr)
+        return NULL;
+    return ptr + MEM_PHYS_OFFSET;
+}
+
 void nvme_initialize_queue(int device, struct nvme_queue *queue, size_t queue_slots, size_t qid) {
-    queue->submit = kalloc(sizeof(struct nvme_command) * queue_slots);
-    queue->completion = kalloc(sizeof(struct nvme_completion) * queue_slots);
+    queue->submit = nvme_alloc_queue(sizeof(struct nvme_command) * queue_slots);
+    queue->completion = nvme_alloc_queue(sizeof(struct nvme_completion) * queue_slots);
     queue->submit_db = (uint32_t*)((size_t)nvme_devices[device].nvme_base + PAGE_SIZE + (2 * qid * (4 << nvme_devices[device].doorbell_stride)));
     queue->complete_db = (uint32_t*)((size_t)nvme_devices[device].nvme_base + PAGE_SIZE + ((2 * qid + 1) * (4 << nvme_devices[device].doorbell_stride)));
     queue->queue_elements = queue_slots;
@@ -311,7 +320,7 @@ notfnd:
 }
 
 static int nvme_write(int device, const void *buf, uint64_t loc, size_t count) {
-    spinlock_acquire((&nvme_devices[device].nvme_lock));
+    mutex_lock((&nvme_devices[device].nvme_lock));
 
     uint64_t progress = 0;
     while (progress < count) {
@@ -321,7 +330,7 @@ static int nvme_write(int device, const void *buf, uint64_t loc, size_t count) {
         if (slot == -1) {
             slot = cache_block(device, sect);
             if (slot == -1) {
-                spinlock_release((&nvme_devices[device].nvme_lock));
+                mutex_unlock((&nvme_devices[device].nvme_lock));
                 return -1;
             }
         }
@@ -336,12 +345,12 @@ static int nvme_write(int device, const void *buf, uint64_t loc, size_t count) {
         progress += chunk;
     }
 
-    spinlock_release((&nvme_devices[device].nvme_lock));
+    mutex_unlock((&nvme_devices[device].nvme_lock));
     return (int)count;
 }
 
 static int nvme_flush_cache(int device) {
-    spinlock_acquire((&nvme_devices[device].nvme_lock));
+    mutex_lock((&nvme_devices[device].nvme_lock));
     for (size_t i = 0; i < MAX_CACHED_BLOCKS; i++) {
         if (nvme_devices[device].cache[i].status == CACHE_DIRTY) {
             int ret = nvme_rw_lba(device,
@@ -350,7 +359,7 @@ static int nvme_flush_cache(int device) {
                     (nvme_devices[device].cache_block_size / nvme_devices[device].lba_size), 1);
 
             if (ret == -1) {
-                spinlock_release((&nvme_devices[device].nvme_lock));
+                mutex_unlock((&nvme_devices[device].nvme_lock));
                 return -1;
             }
 
@@ -358,12 +367,12 @@ static int nvme_flush_cache(int device) {
         }
     }
 
-    spinlock_release((&nvme_devices[device].nvme_lock));
+    mutex_unlock((&nvme_devices[device].nvme_lock));
     return 0;
 }
 
 static int nvme_read(int device, void *buf, uint64_t loc, size_t count) {
-    spinlock_acquire((&nvme_devices[device].nvme_lock));
+    mutex_lock((&nvme_devices[device].nvme_lock));
 
     uint64_t progress = 0;
     while (progress < count) {
@@ -373,7 +382,7 @@ static int nvme_read(int device, void *buf, uint64_t loc, size_t count) {
         if (slot == -1) {
             slot = cache_block(device, sect);
             if (slot == -1) {
-                spinlock_release((&nvme_devices[device].nvme_lock));
+                mutex_unlock((&nvme_devices[device].nvme_lock));
                 return -1;
             }
         }
@@ -387,13 +396,13 @@ static int nvme_read(int device, void *buf, uint64_t loc, size_t count) {
         progress += chunk;
     }
 
-    spinlock_release(&(nvme_devices[device].nvme_lock));
+    mutex_unlock(&(nvme_devices[device].nvme_lock));
     return (int)count;
 }
 
 int nvme_init_device(struct pci_device_t *ndevice, int num) {
     nvme_device_t device = {0};
-    device.nvme_lock = new_lock;
+    device.nvme_lock = new_mutex;
     struct pci_bar_t bar = {0};
 
     panic_if(pci_read_bar(ndevice, 0, &bar));
@@ -3,6 +3,7 @@
 #include "sata_private.h"
 #include <sys/pci.h>
 #include <lib/klib.h>
+#include <lib/mutex.h>
 #include <fs/devfs/devfs.h>
 #include <lib/errno.h>
 #include <lib/part.h>
@@ -378,7 +379,7 @@ static int ahci_rw(volatile struct hba_port_t *port,
     return ((int)count * 512);
 }
 
-static lock_t ahci_lock = new_lock;
+static mutex_t ahci_lock = new_mutex;
 
 static int find_block(int drive, uint64_t block) {
     for (size_t i = 0; i < MAX_CACHED_BLOCKS; i++)
@@ -435,7 +436,7 @@ notfnd:
 }
 
 static int ahci_read(int drive, void *buf, uint64_t loc, size_t count) {
-    spinlock_acquire(&ahci_lock);
+    mutex_lock(&ahci_lock);
 
     uint64_t progress = 0;
     while (progress < count) {
@@ -445,7 +446,7 @@ static int ahci_read(int drive, void *buf, uint64_t loc, size_t count) {
         if (slot == -1) {
             slot = cache_block(drive, block);
             if (slot == -1) {
-                spinlock_release(&ahci_lock);
+                mutex_unlock(&ahci_lock);
                 return -1;
             }
         }
@@ -459,12 +460,12 @@ static int ahci_read(int drive, void *buf, uint64_t loc, size_t count) {
         progress += chunk;
     }
 
-    spinlock_release(&ahci_lock);
+    mutex_unlock(&ahci_lock);
     return (int)count;
 }
 
 static int ahci_write(int drive, const void *buf, uint64_t loc, size_t count) {
-    spinlock_acquire(&ahci_lock);
+    mutex_lock(&ahci_lock);
 
     uint64_t progress = 0;
     while (progress < count) {
@@ -474,7 +475,7 @@ static int ahci_write(int drive, const void *buf, uint64_t loc, size_t count) {
         if (slot == -1) {
             slot = cache_block(drive, block);
             if (slot == -1) {
-                spinlock_release(&ahci_lock);
+                mutex_unlock(&ahci_lock);
                 return -1;
             }
         }
@@ -489,12 +490,12 @@ static int ahci_write(int drive, const void *buf, uint64_t loc, size_t count) {
         progress += chunk;
     }
 
-    spinlock_release(&ahci_lock);
+    mutex_unlock(&ahci_lock);
     return (int)count;
 }
 
 static int ahci_flush(int device) {
-    spinlock_acquire(&ahci_lock);
+    mutex_lock(&ahci_lock);
 
     for (size_t i = 0; i < MAX_CACHED_BLOCKS; i++) {
         if (ahci_devices[device].cache[i].status == CACHE_DIRTY) {
@@ -505,7 +506,7 @@ static int ahci_flush(int device) {
                 SECTORS_PER_BLOCK, (void *)ahci_devices[device].cache[i].cache, 1);
 
             if (ret == -1) {
-                spinlock_release(&ahci_lock);
+                mutex_unlock(&ahci_lock);
                 return -1;
             }
 
@@ -513,6 +514,6 @@ static int ahci_flush(int device) {
         }
     }
 
-    spinlock_release(&ahci_lock);
+    mutex_unlock(&ahci_lock);
     return 0;
 }
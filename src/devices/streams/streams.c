@@ -2,6 +2,11 @@
 #include <lib/klib.h>
 #include <lib/rand.h>
 #include <lib/cstring.h>
+#include <lib/cmem.h>
+#include <lib/alloc.h>
+#include <lib/lockstat.h>
+#include <lib/errno.h>
+#include <mm/mm.h>
 
 /** /dev/urandom **/
 
@@ -66,6 +71,175 @@ static int zero_read(int unused1, void *buf, uint64_t unused2, size_t count) {
     return (int)count;
 }
 
+/** statistics nodes **/
+
+/* Nodes exposing kernel counters render them as "name value" lines, the
+ * text is produced anew on every read */
+
+#define STATS_TEXT_MAX 512
+
+static size_t stats_line(char *text, size_t i, const char *name, uint64_t val) {
+    char num[21];
+    int j = 20;
+
+    num[j] = 0;
+    do {
+        num[--j] = val % 10 + '0';
+        val /= 10;
+    } while (val);
+
+    size_t len = strlen(name);
+    memcpy(text + i, name, len);
+    i += len;
+    text[i++] = ' ';
+    memcpy(text + i, num + j, 20 - j);
+    i += 20 - j;
+    text[i++] = '\n';
+
+    return i;
+}
+
+/* Copy the part of a rendered text which a read at loc asks for */
+static int stats_copy(void *buf, uint64_t loc, size_t count,
+                      const char *text, size_t len) {
+    if (loc >= len)
+        return 0;
+    if (count > len - loc)
+        count = len - loc;
+
+    memcpy(buf, text + loc, count);
+
+    return (int)count;
+}
+
+/* Parse space separated decimal numbers, returns -1 unless exactly n of
+ * them were given */
+static int stats_parse(const char *str, size_t len, size_t *vals, int n) {
+    const char *end = str + len;
+
+    for (int i = 0; i < n; i++) {
+        while (str < end && *str == ' ')
+            str++;
+        if (str == end || *str < '0' || *str > '9')
+            return -1;
+        for (vals[i] = 0; str < end && *str >= '0' && *str <= '9'; str++)
+            vals[i] = vals[i] * 10 + (*str - '0');
+    }
+
+    while (str < end && (*str == ' ' || *str == '\n'))
+        str++;
+
+    return str == end ? 0 : -1;
+}
+
+/** /dev/zeropool **/
+
+/* Reads return the pre-zeroed page pool counters. Writing "<low> <high>"
+ * sets the pool watermarks. */
+static int zeropool_write(int unused1, const void *buf, uint64_t unused2, size_t count) {
+    (void)unused1;
+    (void)unused2;
+
+    size_t vals[2];
+    if (stats_parse(buf, count, vals, 2)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pmm_set_zero_watermarks(vals[0], vals[1]);
+
+    return (int)count;
+}
+
+static int zeropool_read(int unused1, void *buf, uint64_t loc, size_t count) {
+    (void)unused1;
+
+    struct pmm_zero_stats_t stats;
+    pmm_get_zero_stats(&stats);
+
+    char text[STATS_TEXT_MAX];
+    size_t len = 0;
+    len = stats_line(text, len, "pooled", stats.pooled);
+    len = stats_line(text, len, "low", stats.low);
+    len = stats_line(text, len, "high", stats.high);
+    len = stats_line(text, len, "zeroed_idle", stats.zeroed_idle);
+    len = stats_line(text, len, "hits", stats.hits);
+    len = stats_line(text, len, "misses", stats.misses);
+
+    return stats_copy(buf, loc, count, text, len);
+}
+
+/** /dev/pagecache **/
+
+/* Reads return the per-CPU page cache counters, summed over all CPUs */
+static int pagecache_read(int unused1, void *buf, uint64_t loc, size_t count) {
+    (void)unused1;
+
+    struct pmm_cache_stats_t stats;
+    pmm_get_cache_stats(&stats);
+
+    char text[STATS_TEXT_MAX];
+    size_t len = 0;
+    len = stats_line(text, len, "hits", stats.hits);
+    len = stats_line(text, len, "misses", stats.misses);
+    len = stats_line(text, len, "refills", stats.refills);
+    len = stats_line(text, len, "drains", stats.drains);
+
+    return stats_copy(buf, loc, count, text, len);
+}
+
+/** /dev/tlbshootdown **/
+
+/* Reads return the remote TLB shootdown counters */
+static int tlbshootdown_read(int unused1, void *buf, uint64_t loc, size_t count) {
+    (void)unused1;
+
+    struct tlb_shootdown_stats_t stats;
+    tlb_get_shootdown_stats(&stats);
+
+    char text[STATS_TEXT_MAX];
+    size_t len = 0;
+    len = stats_line(text, len, "ipis", stats.ipis);
+    len = stats_line(text, len, "pages", stats.pages);
+    len = stats_line(text, len, "full_flushes", stats.full_flushes);
+
+    return stats_copy(buf, loc, count, text, len);
+}
+
+#ifdef _LOCKSTAT_
+
+/** /dev/lockstat **/
+
+/* Reads return the lock contention statistics as text, any write resets
+ * them */
+static int lockstat_write(int unused1, const void *unused2, uint64_t unused3, size_t count) {
+    (void)unused1;
+    (void)unused2;
+    (void)unused3;
+
+    lockstat_reset();
+
+    return (int)count;
+}
+
+static int lockstat_read(int unused1, void *buf, uint64_t loc, size_t count) {
+    (void)unused1;
+
+    size_t len = lockstat_render(NULL, 0);
+    char *text = kalloc(len);
+    if (!text)
+        return -1;
+    /* Sites registered in the meantime get cut off */
+    lockstat_render(text, len);
+
+    int ret = stats_copy(buf, loc, count, text, len);
+    kfree(text);
+
+    return ret;
+}
+
+#endif
+
 /** initialise **/
 
 void init_dev_streams(void) {
@@ -87,4 +261,26 @@ void init_dev_streams(void) {
     device.calls.read = urandom_read;
     device.calls.write = urandom_write;
     device_add(&device);
+
+    strcpy(device.name, "zeropool");
+    device.calls.read = zeropool_read;
+    device.calls.write = zeropool_write;
+    device_add(&device);
+
+    strcpy(device.name, "pagecache");
+    device.calls.read = pagecache_read;
+    device.calls.write = default_device_calls.write;
+    device_add(&device);
+
+    strcpy(device.name, "tlbshootdown");
+    device.calls.read = tlbshootdown_read;
+    device.calls.write = default_device_calls.write;
+    device_add(&device);
+
+#ifdef _LOCKSTAT_
+    strcpy(device.name, "lockstat");
+    device.calls.read = lockstat_read;
+    device.calls.write = lockstat_write;
+    device_add(&device);
+#endif
 }
@@ -183,7 +183,7 @@ void init_tty_extended(uint32_t *__fb,
         ttys[i].control_sequence = 0;
         ttys[i].escape = 0;
         ttys[i].tabsize = 8;
-        ttys[i].kbd_event = 0;
+        ttys[i].kbd_event = (event_t){0};
         ttys[i].kbd_lock = new_lock;
         ttys[i].kbd_buf_i = 0;
         ttys[i].big_buf_i = 0;
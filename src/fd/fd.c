@@ -2,7 +2,7 @@
 #include <stddef.h>
 #include <fd/fd.h>
 #include <lib/lock.h>
-#include <sys/pit.h>
+#include <lib/time.h>
 #include <proc/task.h>
 
 void init_fd_vfs(void);
@@ -13,6 +13,9 @@ void init_fd(void) {
 
 dynarray_new(struct file_descriptor_t, file_descriptors);
 
+/* fds have no wait queues, so rescan them at this interval while waiting */
+#define POLL_INTERVAL_NS 1000000
+
 int poll(struct pollfd *fds, size_t nfds, int timeout) {
     if (!timeout) {
         return 0;
@@ -23,12 +26,12 @@ int poll(struct pollfd *fds, size_t nfds, int timeout) {
     if (timeout < 0) {
         timeout_target = 0xffffffffffffffff; // effectively disable a timeout
     } else {
-        timeout_target = (uptime_raw + (timeout * (PIT_FREQUENCY_HZ / 1000))) + 1;
+        timeout_target = get_uptime_ns() + (uint64_t)timeout * 1000000;
     }
 
     int polled_fds = 0;
 
-    while (timeout_target > uptime_raw) {
+    for (;;) {
         for (size_t i = 0; i < nfds; i++) {
             if (fds[i].fd < 0) {
                 fds[i].revents = 0;
@@ -49,7 +52,18 @@ int poll(struct pollfd *fds, size_t nfds, int timeout) {
         if (polled_fds) {
             break;
         }
-        yield();
+
+        uint64_t now = get_uptime_ns();
+        if (now >= timeout_target) {
+            break;
+        }
+        uint64_t wake = now + POLL_INTERVAL_NS;
+        if (wake > timeout_target) {
+            wake = timeout_target;
+        }
+        if (task_sleep_until(wake) == -1) {
+            break;
+        }
     }
 
     return polled_fds;
@@ -63,6 +77,7 @@ int dup(int fd) {
     struct file_descriptor_t *fd_ptr = dynarray_getelem(struct file_descriptor_t, file_descriptors, fd);
     int intern_fd = fd_ptr->intern_fd;
     int new_intern_fd = fd_ptr->fd_handler.dup(intern_fd);
+    struct fd_handler_t fd_handler = fd_ptr->fd_handler;
     dynarray_unref(file_descriptors, fd);
 
     if (new_intern_fd == -1)
@@ -71,7 +86,7 @@ int dup(int fd) {
     struct file_descriptor_t new_fd = {0};
 
     new_fd.intern_fd = new_intern_fd;
-    new_fd.fd_handler = file_descriptors[fd]->data.fd_handler;
+    new_fd.fd_handler = fd_handler;
 
     return fd_create(&new_fd);
 }
@@ -2,6 +2,7 @@
 #include <stddef.h>
 #include <lib/klib.h>
 #include <lib/lock.h>
+#include <lib/alloc.h>
 #include <lib/errno.h>
 #include <proc/task.h>
 #include <fd/fd.h>
@@ -14,6 +15,8 @@ struct pipe_t {
     lock_t lock;
     int flflags;
     void *buffer;
+    /* Size of the buffer, in PIPE_BUFFER_STEP units */
+    size_t steps;
     size_t size;
     event_t event;
     int refcount;
@@ -22,6 +25,43 @@ struct pipe_t {
 
 dynarray_new(struct pipe_t, pipes);
 
+/* Single step buffers, which most pipes never outgrow, come from a cache */
+static struct kmem_cache_t *pipe_buffer_cache = NULL;
+static lock_t pipe_buffer_cache_lock = new_lock;
+
+static void *pipe_buffer_alloc(size_t steps) {
+    if (steps == 1)
+        return kmem_cache_alloc(pipe_buffer_cache);
+    return kalloc(steps * PIPE_BUFFER_STEP);
+}
+
+static void pipe_buffer_free(void *buffer, size_t steps) {
+    if (steps == 1)
+        kmem_cache_free(pipe_buffer_cache, buffer);
+    else
+        kfree(buffer);
+}
+
+/* Move the first `keep` bytes of the buffer to a new one of `steps` steps.
+ * Must be called with the pipe lock held. */
+static int pipe_buffer_resize(struct pipe_t *pipe, size_t steps, size_t keep) {
+    void *buffer = NULL;
+
+    if (steps) {
+        buffer = pipe_buffer_alloc(steps);
+        if (!buffer)
+            return -1;
+        memcpy(buffer, pipe->buffer, keep);
+    }
+
+    if (pipe->steps)
+        pipe_buffer_free(pipe->buffer, pipe->steps);
+
+    pipe->buffer = buffer;
+    pipe->steps = steps;
+    return 0;
+}
+
 static int pipe_getflflags(int fd) {
     struct pipe_t *pipe = dynarray_getelem(struct pipe_t, pipes, fd);
 
@@ -55,8 +95,8 @@ static int pipe_close(int fd) {
         dynarray_unref(pipes, fd);
         return 0;
     }
-    if (pipe->size)
-        kfree(pipe->buffer);
+    if (pipe->steps)
+        pipe_buffer_free(pipe->buffer, pipe->steps);
 
     dynarray_unref(pipes, fd);
     dynarray_remove(pipes, fd);
@@ -88,16 +128,16 @@ static int pipe_read(int fd, void *buf, size_t count) {
         }
     }
 
-    size_t pipe_size_in_steps = (pipe->size + PIPE_BUFFER_STEP - 1) / PIPE_BUFFER_STEP;
     size_t new_pipe_size = pipe->size - count;
     size_t new_pipe_size_in_steps = (new_pipe_size + PIPE_BUFFER_STEP - 1) / PIPE_BUFFER_STEP;
 
     memcpy(buf, pipe->buffer, count);
 
-    memmove(pipe->buffer, pipe->buffer + count, count);
+    memmove(pipe->buffer, pipe->buffer + count, new_pipe_size);
 
-    if (new_pipe_size_in_steps < pipe_size_in_steps)
-        pipe->buffer = krealloc(pipe->buffer, new_pipe_size_in_steps);
+    // keeping the larger buffer is fine if shrinking it fails
+    if (new_pipe_size_in_steps < pipe->steps)
+        pipe_buffer_resize(pipe, new_pipe_size_in_steps, new_pipe_size);
 
     pipe->size = new_pipe_size;
 
@@ -114,12 +154,17 @@ static int pipe_write(int fd, const void *buf, size_t count) {
 
     spinlock_acquire(&pipe->lock);
 
-    size_t pipe_size_in_steps = (pipe->size + PIPE_BUFFER_STEP - 1) / PIPE_BUFFER_STEP;
     size_t new_pipe_size = pipe->size + count;
     size_t new_pipe_size_in_steps = (new_pipe_size + PIPE_BUFFER_STEP - 1) / PIPE_BUFFER_STEP;
 
-    if (new_pipe_size_in_steps > pipe_size_in_steps)
-        pipe->buffer = krealloc(pipe->buffer, new_pipe_size_in_steps);
+    if (new_pipe_size_in_steps > pipe->steps) {
+        if (pipe_buffer_resize(pipe, new_pipe_size_in_steps, pipe->size)) {
+            spinlock_release(&pipe->lock);
+            dynarray_unref(pipes, fd);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
 
     memcpy(pipe->buffer + pipe->size, buf, count);
 
@@ -162,11 +207,11 @@ static int pipe_fstat(int fd, struct stat *st) {
     st->st_size = 0;
     st->st_blksize = 0;
     st->st_blocks = 0;
-    st->st_atim.tv_sec = unix_epoch;
+    st->st_atim.tv_sec = get_realtime_ns() / 1000000000;
     st->st_atim.tv_nsec = 0;
-    st->st_mtim.tv_sec = unix_epoch;
+    st->st_mtim.tv_sec = get_realtime_ns() / 1000000000;
     st->st_mtim.tv_nsec = 0;
-    st->st_ctim.tv_sec = unix_epoch;
+    st->st_ctim.tv_sec = get_realtime_ns() / 1000000000;
     st->st_ctim.tv_nsec = 0;
     st->st_mode = 0;
     st->st_mode |= S_IFIFO;
@@ -174,6 +219,17 @@ static int pipe_fstat(int fd, struct stat *st) {
 }
 
 int pipe(int *pipefd) {
+    if (!locked_read(struct kmem_cache_t *, &pipe_buffer_cache)) {
+        spinlock_acquire(&pipe_buffer_cache_lock);
+        if (!pipe_buffer_cache)
+            pipe_buffer_cache = kmem_cache_create("pipe_buffer", PIPE_BUFFER_STEP);
+        spinlock_release(&pipe_buffer_cache_lock);
+        if (!pipe_buffer_cache) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
     struct pipe_t new_pipe = {0};
     new_pipe.refcount = 2;
     new_pipe.lock = new_lock;
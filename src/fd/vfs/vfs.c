@@ -30,11 +30,11 @@ dynarray_new(struct vfs_handle_t, vfs_handles);
 static struct mnt_t *vfs_get_mountpoint(const char *path, char **local_path) {
     size_t size;
 
-    spinlock_acquire(&mountpoints_lock);
+    rwlock_acquire_read(&mountpoints_lock);
 
     struct mnt_t **mnts = ht_dump(struct mnt_t, mountpoints, &size);
     if (!mnts) {
-        spinlock_release(&mountpoints_lock);
+        rwlock_release_read(&mountpoints_lock);
         return NULL;
     }
 
@@ -69,7 +69,7 @@ static struct mnt_t *vfs_get_mountpoint(const char *path, char **local_path) {
 
     kfree(mnts);
 
-    spinlock_release(&mountpoints_lock);
+    rwlock_release_read(&mountpoints_lock);
 
     if (guess != -1)
         return ret;
@@ -148,27 +148,28 @@ term:
 int vfs_sync(void) {
     size_t size;
 
-    spinlock_acquire(&filesystems_lock);
-
+    rwlock_acquire_read(&filesystems_lock);
     struct fs_t **fs = ht_dump(struct fs_t, filesystems, &size);
-    if (!fs) {
-        spinlock_release(&filesystems_lock);
+    rwlock_release_read(&filesystems_lock);
+
+    if (!fs)
         return 0;
-    }
 
+    /* Filesystems are never uninstalled, no need to hold the lock across
+     * the syncs */
     for (size_t i = 0; i < size; i++)
         fs[i]->sync();
 
     kfree(fs);
 
-    spinlock_release(&filesystems_lock);
-
     return 0;
 }
 
 void vfs_sync_worker(void *arg) {
     (void)arg;
 
+    task_pin_kworker();
+
     for (;;) {
         relaxed_sleep(2000);
         vfs_sync();
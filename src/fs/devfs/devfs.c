@@ -5,11 +5,12 @@
 #include <fd/vfs/vfs.h>
 #include <fs/devfs/devfs.h>
 #include <lib/lock.h>
+#include <lib/mutex.h>
 #include <lib/errno.h>
 #include <sys/panic.h>
 #include <lib/cstring.h>
 
-dynarray_new(struct device_t, devices);
+dynarray_new_keyed(struct device_t, devices);
 
 struct devfs_handle_t {
     struct device_t *device;
@@ -18,13 +19,13 @@ struct devfs_handle_t {
     long ptr;
     long size;
     int refcount;
-    lock_t lock;
+    mutex_t lock;
 };
 
 dynarray_new(struct devfs_handle_t, devfs_handles);
 
 dev_t device_add(struct device_t *device) {
-    return dynarray_add(struct device_t, devices, device);
+    return dynarray_add_keyed(struct device_t, devices, device);
 }
 
 static int devfs_open(const char *path, int flags, int unused) {
@@ -32,7 +33,7 @@ static int devfs_open(const char *path, int flags, int unused) {
     struct devfs_handle_t new_handle = {0};
 
     new_handle.refcount = 1;
-    new_handle.lock = new_lock;
+    new_handle.lock = new_mutex;
 
     if (flags & O_APPEND) {
         errno = EROFS;
@@ -48,7 +49,7 @@ static int devfs_open(const char *path, int flags, int unused) {
         path++;
 
     size_t i;
-    struct device_t *device = dynarray_search(struct device_t, devices, &i, !strcmp(elem->name, path), 0);
+    struct device_t *device = dynarray_search_key(struct device_t, devices, &i, path);
     if (!device) {
         if (flags & O_CREAT)
             errno = EROFS;
@@ -67,6 +68,10 @@ static int devfs_open(const char *path, int flags, int unused) {
 void device_sync_worker(void *arg) {
     (void)arg;
 
+    /* Flushes run in bursts, share the CPU among real time peers only */
+    task_setscheduler(CURRENT_PROCESS, CURRENT_THREAD, SCHED_RR, 10);
+    task_pin_kworker();
+
     for (;;) {
         for (size_t i = 0; i < locked_read(size_t, &devices_i); i++) {
             struct device_t *device = dynarray_getelem(struct device_t, devices, i);
@@ -150,7 +155,7 @@ static int devfs_read(int fd, void *ptr, size_t len) {
         return -1;
     }
 
-    spinlock_acquire(&devfs_handle->lock);
+    mutex_lock(&devfs_handle->lock);
 
     if (devfs_handle->size)
         if (devfs_handle->ptr + len >= devfs_handle->size)
@@ -165,7 +170,7 @@ static int devfs_read(int fd, void *ptr, size_t len) {
     if (ret != -1 && devfs_handle->size)
         devfs_handle->ptr += ret;
 
-    spinlock_release(&devfs_handle->lock);
+    mutex_unlock(&devfs_handle->lock);
     dynarray_unref(devfs_handles, fd);
 
     return ret;
@@ -186,11 +191,11 @@ static int devfs_write(int fd, const void *ptr, size_t len) {
         return -1;
     }
 
-    spinlock_acquire(&devfs_handle->lock);
+    mutex_lock(&devfs_handle->lock);
 
     if (devfs_handle->size) {
         if (devfs_handle->ptr == devfs_handle->size) {
-            spinlock_release(&devfs_handle->lock);
+            mutex_unlock(&devfs_handle->lock);
             errno = ENOSPC;
             return -1;
         }
@@ -207,7 +212,7 @@ static int devfs_write(int fd, const void *ptr, size_t len) {
     if (ret != -1 && devfs_handle->size)
         devfs_handle->ptr += ret;
 
-    spinlock_release(&devfs_handle->lock);
+    mutex_unlock(&devfs_handle->lock);
     dynarray_unref(devfs_handles, fd);
 
     return ret;
@@ -235,11 +240,11 @@ static int devfs_fstat(int fd, struct stat *st) {
     st->st_size = devfs_handle->size;
     st->st_blksize = 512;
     st->st_blocks = (devfs_handle->size + 512 - 1) / 512;
-    st->st_atim.tv_sec = unix_epoch;
+    st->st_atim.tv_sec = get_realtime_ns() / 1000000000;
     st->st_atim.tv_nsec = 0;
-    st->st_mtim.tv_sec = unix_epoch;
+    st->st_mtim.tv_sec = get_realtime_ns() / 1000000000;
     st->st_mtim.tv_nsec = 0;
-    st->st_ctim.tv_sec = unix_epoch;
+    st->st_ctim.tv_sec = get_realtime_ns() / 1000000000;
     st->st_ctim.tv_nsec = 0;
     st->st_mode = 0;
     if (devfs_handle->root)
@@ -276,14 +281,14 @@ static int devfs_close(int fd) {
         return -1;
     }
 
-    spinlock_acquire(&devfs_handle->lock);
+    mutex_lock(&devfs_handle->lock);
 
     if (!(--devfs_handle->refcount)) {
         dynarray_remove(devfs_handles, fd);
         return 0;
     }
 
-    spinlock_release(&devfs_handle->lock);
+    mutex_unlock(&devfs_handle->lock);
     dynarray_unref(devfs_handles, fd);
 
     return 0;
@@ -298,9 +303,9 @@ static int devfs_dup(int fd) {
         return -1;
     }
 
-    spinlock_acquire(&devfs_handle->lock);
+    mutex_lock(&devfs_handle->lock);
     devfs_handle->refcount++;
-    spinlock_release(&devfs_handle->lock);
+    mutex_unlock(&devfs_handle->lock);
 
     dynarray_unref(devfs_handles, fd);
 
@@ -328,7 +333,7 @@ static int devfs_lseek(int fd, off_t offset, int type) {
         return -1;
     }
 
-    spinlock_acquire(&devfs_handle->lock);
+    mutex_lock(&devfs_handle->lock);
 
     switch (type) {
         case SEEK_SET:
@@ -348,14 +353,14 @@ static int devfs_lseek(int fd, off_t offset, int type) {
             break;
         default:
         def:
-            spinlock_release(&devfs_handle->lock);
+            mutex_unlock(&devfs_handle->lock);
             dynarray_unref(devfs_handles, fd);
             errno = EINVAL;
             return -1;
     }
 
     int ret = (int)devfs_handle->ptr;
-    spinlock_release(&devfs_handle->lock);
+    mutex_unlock(&devfs_handle->lock);
     dynarray_unref(devfs_handles, fd);
     return ret;
 }
@@ -375,13 +380,13 @@ static int devfs_readdir(int fd, struct dirent *dir) {
         return -1;
     }
 
-    spinlock_acquire(&devfs_handle->lock);
+    mutex_lock(&devfs_handle->lock);
 
     for (;;) {
         // check if past directory table
         if (devfs_handle->ptr >= locked_read(size_t, &devices_i)) {
             errno = 0;
-            spinlock_release(&devfs_handle->lock);
+            mutex_unlock(&devfs_handle->lock);
             dynarray_unref(devfs_handles, fd);
             return -1;
         }
@@ -401,7 +406,7 @@ static int devfs_readdir(int fd, struct dirent *dir) {
         }
     }
 
-    spinlock_release(&devfs_handle->lock);
+    mutex_unlock(&devfs_handle->lock);
     dynarray_unref(devfs_handles, fd);
     return 0;
 }
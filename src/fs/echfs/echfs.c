@@ -3,6 +3,7 @@
 #include <lib/klib.h>
 #include <fd/vfs/vfs.h>
 #include <lib/lock.h>
+#include <lib/mutex.h>
 #include <lib/errno.h>
 #include <lib/ht.h>
 #include <sys/panic.h>
@@ -69,7 +70,7 @@ struct cached_file_t {
 };
 
 struct mount_t {
-    lock_t lock;
+    mutex_t lock;
     char name[128];
     int device;
     uint64_t blocks;
@@ -311,7 +312,7 @@ static int echfs_read(int handle, void *buf, size_t count) {
 
     struct mount_t *mnt = echfs_handle->mnt;
 
-    spinlock_acquire(&mnt->lock);
+    mutex_lock(&mnt->lock);
 
     struct cached_file_t *cached_file = echfs_handle->cached_file;
     uint64_t progress = 0;
@@ -322,7 +323,7 @@ static int echfs_read(int handle, void *buf, size_t count) {
         if (slot == -1) {
             slot = cache_block(cached_file, block);
             if (slot == -1) {
-                spinlock_release(&mnt->lock);
+                mutex_unlock(&mnt->lock);
                 dynarray_unref(handles, handle);
                 errno = EIO;
                 return -1;
@@ -340,7 +341,7 @@ static int echfs_read(int handle, void *buf, size_t count) {
 
     echfs_handle->ptr += count;
 
-    spinlock_release(&mnt->lock);
+    mutex_unlock(&mnt->lock);
     dynarray_unref(handles, handle);
     return (int)count;
 }
@@ -362,7 +363,7 @@ static int echfs_write(int handle, const void *buf, size_t count) {
 
     struct mount_t *mnt = echfs_handle->mnt;
 
-    spinlock_acquire(&mnt->lock);
+    mutex_lock(&mnt->lock);
 
     if (echfs_handle->flags & O_APPEND)
         echfs_handle->ptr = echfs_handle->end;
@@ -376,7 +377,7 @@ static int echfs_write(int handle, const void *buf, size_t count) {
         if (slot == -1) {
             slot = cache_block(cached_file, block);
             if (slot == -1) {
-                spinlock_release(&mnt->lock);
+                mutex_unlock(&mnt->lock);
                 dynarray_unref(handles, handle);
                 errno = EIO;
                 return -1;
@@ -409,7 +410,7 @@ static int echfs_write(int handle, const void *buf, size_t count) {
         wr_entry(mnt, cached_file->path_res.target_entry, &cached_file->path_res.target);
     }
 
-    spinlock_release(&mnt->lock);
+    mutex_unlock(&mnt->lock);
     dynarray_unref(handles, handle);
     return (int)count;
 }
@@ -440,7 +441,7 @@ static int echfs_unlink(int handle) {
     }
 
     struct mount_t *mnt = echfs_handle->mnt;
-    spinlock_acquire(&mnt->lock);
+    mutex_lock(&mnt->lock);
 
     struct cached_file_t *cached_file = echfs_handle->cached_file;
 
@@ -456,7 +457,7 @@ static int echfs_unlink(int handle) {
     if (!--cached_file->refcount)
         ret = actually_delete_file(cached_file);
 
-    spinlock_release(&mnt->lock);
+    mutex_unlock(&mnt->lock);
     dynarray_unref(handles, handle);
     return ret;
 }
@@ -593,7 +594,7 @@ static int echfs_close(int handle) {
     int ret = 0;
 
     struct mount_t *mnt = echfs_handle->mnt;
-    spinlock_acquire(&mnt->lock);
+    mutex_lock(&mnt->lock);
 
     struct cached_file_t *cached_file = echfs_handle->cached_file;
 
@@ -608,7 +609,7 @@ static int echfs_close(int handle) {
 
 out:
     dynarray_unref(handles, handle);
-    spinlock_release(&mnt->lock);
+    mutex_unlock(&mnt->lock);
     return ret;
 }
 
@@ -668,11 +669,11 @@ static int echfs_mkdir(const char *path, int m) {
     if (!mnt)
         return -1;
 
-    spinlock_acquire(&mnt->lock);
+    mutex_lock(&mnt->lock);
 
     struct cached_file_t *cached_file = cache_file(mnt, path);
     if (!cached_file) {
-        spinlock_release(&mnt->lock);
+        mutex_unlock(&mnt->lock);
         dynarray_unref(mounts, m);
         errno = ENOENT;
         return -1;
@@ -681,14 +682,14 @@ static int echfs_mkdir(const char *path, int m) {
     struct path_result_t *path_result = &cached_file->path_res;
 
     if (path_result->failure) {
-        spinlock_release(&mnt->lock);
+        mutex_unlock(&mnt->lock);
         dynarray_unref(mounts, m);
         errno = ENOTDIR;
         return -1;
     }
 
     if (!path_result->not_found) {
-        spinlock_release(&mnt->lock);
+        mutex_unlock(&mnt->lock);
         dynarray_unref(mounts, m);
         errno = EEXIST;
         return -1;
@@ -719,7 +720,7 @@ static int echfs_mkdir(const char *path, int m) {
     path_result->not_found = 0;
     path_result->type = DIRECTORY_TYPE;
 
-    spinlock_release(&mnt->lock);
+    mutex_unlock(&mnt->lock);
     dynarray_unref(mounts, m);
     return 0;
 }
@@ -729,12 +730,12 @@ static int echfs_open(const char *path, int flags, int m) {
     if (!mnt)
         return -1;
 
-    spinlock_acquire(&mnt->lock);
+    mutex_lock(&mnt->lock);
 
     struct echfs_handle_t new_handle = {0};
     struct cached_file_t *cached_file = cache_file(mnt, path);
     if (!cached_file) {
-        spinlock_release(&mnt->lock);
+        mutex_unlock(&mnt->lock);
         dynarray_unref(mounts, m);
         errno = ENOENT;
         return -1;
@@ -743,7 +744,7 @@ static int echfs_open(const char *path, int flags, int m) {
     struct path_result_t *path_result = &cached_file->path_res;
 
     if (path_result->not_found && !(flags & O_CREAT)) {
-        spinlock_release(&mnt->lock);
+        mutex_unlock(&mnt->lock);
         dynarray_unref(mounts, m);
         errno = ENOENT;
         return -1;
@@ -784,7 +785,7 @@ static int echfs_open(const char *path, int flags, int m) {
         // it's a directory
         if ((flags & O_ACCMODE) == O_WRONLY
          || (flags & O_ACCMODE) == O_RDWR) {
-            spinlock_release(&mnt->lock);
+            mutex_unlock(&mnt->lock);
             dynarray_unref(mounts, m);
             errno = EISDIR;
             return -1;
@@ -806,7 +807,7 @@ static int echfs_open(const char *path, int flags, int m) {
     new_handle.refcount = 1;
 
     int ret = dynarray_add(struct echfs_handle_t, handles, &new_handle);
-    spinlock_release(&mnt->lock);
+    mutex_unlock(&mnt->lock);
     dynarray_unref(mounts, m);
     return ret;
 }
@@ -822,7 +823,7 @@ static int echfs_lseek(int handle, off_t offset, int type) {
 
     struct mount_t *mnt = echfs_handle->mnt;
 
-    spinlock_acquire(&mnt->lock);
+    mutex_lock(&mnt->lock);
 
     int flags = echfs_handle->flags;
     switch (type) {
@@ -864,14 +865,14 @@ static int echfs_lseek(int handle, off_t offset, int type) {
             break;
         default:
         einval:
-            spinlock_release(&mnt->lock);
+            mutex_unlock(&mnt->lock);
             dynarray_unref(handles, handle);
             errno = EINVAL;
             return -1;
     }
 
     long ret = echfs_handle->ptr;
-    spinlock_release(&mnt->lock);
+    mutex_unlock(&mnt->lock);
     dynarray_unref(handles, handle);
     return ret;
 }
@@ -924,7 +925,7 @@ static int echfs_readdir(int handle, struct dirent *dir) {
 
     struct mount_t *mnt = echfs_handle->mnt;
 
-    spinlock_acquire(&mnt->lock);
+    mutex_lock(&mnt->lock);
 
     struct cached_file_t *cached_file = echfs_handle->cached_file;
 
@@ -958,12 +959,12 @@ static int echfs_readdir(int handle, struct dirent *dir) {
         }
     }
 
-    spinlock_release(&mnt->lock);
+    mutex_unlock(&mnt->lock);
     dynarray_unref(handles, handle);
     return 0;
 
 end_of_dir:
-    spinlock_release(&mnt->lock);
+    mutex_unlock(&mnt->lock);
     dynarray_unref(handles, handle);
     errno = 0;
     return -1;
@@ -980,7 +981,7 @@ static int echfs_fstat(int handle, struct stat *st) {
 
     struct mount_t *mnt = echfs_handle->mnt;
 
-    spinlock_acquire(&mnt->lock);
+    mutex_lock(&mnt->lock);
 
     struct path_result_t *path_res = &echfs_handle->cached_file->path_res;
 
@@ -1012,7 +1013,7 @@ static int echfs_fstat(int handle, struct stat *st) {
 
     st->st_mode |= path_res->target.perms;
 
-    spinlock_release(&mnt->lock);
+    mutex_unlock(&mnt->lock);
     dynarray_unref(handles, handle);
     return 0;
 }
@@ -1054,7 +1055,7 @@ static int echfs_mount(const char *source, unsigned long flags, const void *data
     mount.dirstart = mount.fatstart + mount.fatsize;
     mount.datastart = RESERVED_BLOCKS + mount.fatsize + mount.dirsize;
     ht_init(mount.cached_files);
-    mount.lock = new_lock;
+    mount.lock = new_mutex;
 
     int ret = dynarray_add(struct mount_t, mounts, &mount);
 
@@ -1068,7 +1069,7 @@ static int echfs_umount(int magic) {
         errno = ENOENT;
         return -1;
     }
-    spinlock_acquire(&mount->lock);
+    mutex_lock(&mount->lock);
 
     // Check if the filesystem is busy.
     for (size_t i = 0; i < locked_read(size_t, &handles_i); i++) {
@@ -1080,7 +1081,7 @@ static int echfs_umount(int magic) {
         if (handle->mnt == mount) {
             dynarray_unref(handles, i);
             dynarray_unref(mounts, magic);
-            spinlock_release(&mount->lock);
+            mutex_unlock(&mount->lock);
             errno = EBUSY;
             return -1;
         }
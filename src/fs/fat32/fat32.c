@@ -3,6 +3,7 @@
 #include <lib/time.h>
 #include <lib/klib.h>
 #include <lib/lock.h>
+#include <lib/mutex.h>
 #include <lib/ht.h>
 #include <lib/errno.h>
 #include <lib/cstring.h>
@@ -36,7 +37,7 @@ struct info_t {
 
 struct mount_t {
     int    device;
-    lock_t lock;
+    mutex_t lock;
     struct volumeid_t volumeid;
     struct info_t     info;
 };
@@ -189,7 +190,7 @@ static int fat32_mount(const char *source) {
     struct mount_t mount;
 
     mount.device = device;
-    mount.lock   = new_lock;
+    mount.lock   = new_mutex;
 
     // Read info from offsets for the volume ID.
     read_offset(device, 0x0b,  &mount.volumeid.bytes_per_sector, 2);
@@ -221,7 +222,7 @@ static int fat32_open(const char *path, int flags, int mount) {
         return -1;
 
     // Lock mount.
-    spinlock_acquire(&mnt->lock);
+    mutex_lock(&mnt->lock);
 
     // Create the handle.
     struct handle_t handle = {0};
@@ -234,7 +235,7 @@ static int fat32_open(const char *path, int flags, int mount) {
 
     // Add handle to the list, unlock and return the mount to the list.
     int ret = dynarray_add(struct handle_t, handles, &handle);
-    spinlock_release(&mnt->lock);
+    mutex_unlock(&mnt->lock);
     dynarray_unref(mounts, mount);
     return ret;
 }
@@ -250,14 +251,14 @@ static int fat32_close(int handle) {
 
     // Get the mount and lock.
     struct mount_t *mnt = hdl->mount;
-    spinlock_acquire(&mnt->lock);
+    mutex_lock(&mnt->lock);
 
     // Reduce the reference count, if 0, delete it.
     if (!(--hdl->refcount))
         dynarray_remove(handles, handle);
 
     dynarray_unref(handles, handle);
-    spinlock_release(&mnt->lock);
+    mutex_unlock(&mnt->lock);
 
     return 0;
 }
@@ -272,13 +273,13 @@ static int fat32_read(int handle, void *buf, size_t count) {
     }
 
     struct mount_t *mnt = hdl->mount;
-    spinlock_acquire(&mnt->lock);
+    mutex_lock(&mnt->lock);
 
     struct fs_entry_t ent = hdl->entry;
 
     if (hdl->offset >= ent.file_size) {
         dynarray_unref(handles, handle);
-        spinlock_release(&mnt->lock);
+        mutex_unlock(&mnt->lock);
         return 0;
     }
 
@@ -317,7 +318,7 @@ static int fat32_read(int handle, void *buf, size_t count) {
     hdl->offset += read_size;
 
     dynarray_unref(handles, handle);
-    spinlock_release(&mnt->lock);
+    mutex_unlock(&mnt->lock);
 
     return read_size;
 }
@@ -333,12 +334,12 @@ static int fat32_dup(int handle) {
 
     // Get the mount and lock.
     struct mount_t *mnt = hdl->mount;
-    spinlock_acquire(&mnt->lock);
+    mutex_lock(&mnt->lock);
 
     hdl->refcount++;
 
     dynarray_unref(handles, handle);
-    spinlock_release(&mnt->lock);
+    mutex_unlock(&mnt->lock);
 
     return 0;
 }
@@ -354,7 +355,7 @@ static int fat32_fstat(int handle, struct stat *st) {
 
     // Get the mount and lock.
     struct mount_t *mnt = hdl->mount;
-    spinlock_acquire(&mnt->lock);
+    mutex_lock(&mnt->lock);
 
     hdl->refcount++;
 
@@ -379,7 +380,7 @@ static int fat32_fstat(int handle, struct stat *st) {
     st->st_mode |= is_dir ? S_IFDIR : S_IFREG;
 
     dynarray_unref(handles, handle);
-    spinlock_release(&mnt->lock);
+    mutex_unlock(&mnt->lock);
     return 0;
 }
 
@@ -3,6 +3,7 @@
 #include <lib/time.h>
 #include <lib/klib.h>
 #include <lib/lock.h>
+#include <lib/mutex.h>
 #include <lib/errno.h>
 #include <lib/cstring.h>
 #include <lib/cmem.h>
@@ -214,7 +215,7 @@ struct handle_t *handles;
 int mount_i = 0;
 struct mount_t *mounts;
 
-static lock_t iso9660_lock = new_lock;
+static mutex_t iso9660_lock = new_mutex;
 
 static uint8_t rd_byte(int handle, uint64_t location) {
     uint8_t buf[1];
@@ -509,12 +510,12 @@ out:
 }
 
 static int iso9660_open(const char *path, int flags, int mount) {
-    spinlock_acquire(&iso9660_lock);
+    mutex_lock(&iso9660_lock);
 
     struct path_result_t result = resolve_path(&mounts[mount], path);
 
     if (result.failure || result.not_found) {
-        spinlock_release(&iso9660_lock);
+        mutex_unlock(&iso9660_lock);
         return -1;
     }
 
@@ -532,7 +533,7 @@ static int iso9660_open(const char *path, int flags, int mount) {
     handle.refcount = 1;
     handle.free = 0;
     int handle_num = create_handle(handle);
-    spinlock_release(&iso9660_lock);
+    mutex_unlock(&iso9660_lock);
     return handle_num;
 }
 
@@ -540,28 +541,28 @@ static int iso9660_read(int handle, void *buf, size_t count) {
     if (handle < 0)
         return -1;
 
-    spinlock_acquire(&iso9660_lock);
+    mutex_lock(&iso9660_lock);
     struct handle_t *handle_s = &handles[handle];
     struct mount_t *mount = &mounts[handle_s->mount];
 
     if (!buf) {
-        spinlock_release(&iso9660_lock);
+        mutex_unlock(&iso9660_lock);
         return -1;
     }
 
     if (handle >= handle_i) {
-        spinlock_release(&iso9660_lock);
+        mutex_unlock(&iso9660_lock);
         return -1;
     }
     if (handles[handle].free) {
-        spinlock_release(&iso9660_lock);
+        mutex_unlock(&iso9660_lock);
         return -1;
     }
 
     if (((size_t)handle_s->offset + count) >= (size_t)handle_s->end)
         count = (size_t)(handle_s->end - handle_s->offset);
     if (!count) {
-        spinlock_release(&iso9660_lock);
+        mutex_unlock(&iso9660_lock);
         return 0;
     }
 
@@ -571,7 +572,7 @@ static int iso9660_read(int handle, void *buf, size_t count) {
                 / mount->block_size);
         int cache = cache_block(mount, block);
         if (cache == -1) {
-            spinlock_release(&iso9660_lock);
+            mutex_unlock(&iso9660_lock);
             return -1;
         }
 
@@ -585,7 +586,7 @@ static int iso9660_read(int handle, void *buf, size_t count) {
     }
     handle_s->offset += count;
 
-    spinlock_release(&iso9660_lock);
+    mutex_unlock(&iso9660_lock);
     return (int)count;
 }
 
@@ -593,31 +594,31 @@ static int iso9660_seek(int handle, off_t offset, int type) {
     if (handle < 0)
         return -1;
 
-    spinlock_acquire(&iso9660_lock);
+    mutex_lock(&iso9660_lock);
     if (handle >= handle_i) {
-         spinlock_release(&iso9660_lock);
+         mutex_unlock(&iso9660_lock);
         return -1;
     }
     if (handles[handle].free) {
-        spinlock_release(&iso9660_lock);
+        mutex_unlock(&iso9660_lock);
         return -1;
     }
     struct handle_t *handle_s = &handles[handle];
     switch (type) {
         case SEEK_SET:
             handle_s->offset = offset;
-            spinlock_release(&iso9660_lock);
+            mutex_unlock(&iso9660_lock);
             return handle_s->offset;
         case SEEK_CUR:
             handle_s->offset += offset;
-            spinlock_release(&iso9660_lock);
+            mutex_unlock(&iso9660_lock);
             return handle_s->offset;
         case SEEK_END:
             handle_s->offset = handle_s->end;
-            spinlock_release(&iso9660_lock);
+            mutex_unlock(&iso9660_lock);
             return handle_s->offset;
         default:
-            spinlock_release(&iso9660_lock);
+            mutex_unlock(&iso9660_lock);
             return -1;
     }
 }
@@ -626,14 +627,14 @@ static int iso9660_fstat(int handle, struct stat *st) {
     if (handle < 0)
         return -1;
 
-    spinlock_acquire(&iso9660_lock);
+    mutex_lock(&iso9660_lock);
 
     if (handle >= handle_i) {
-        spinlock_release(&iso9660_lock);
+        mutex_unlock(&iso9660_lock);
         return -1;
     }
     if (handles[handle].free) {
-        spinlock_release(&iso9660_lock);
+        mutex_unlock(&iso9660_lock);
         return -1;
     }
     struct handle_t *handle_s = &handles[handle];
@@ -659,18 +660,18 @@ static int iso9660_fstat(int handle, struct stat *st) {
         st->st_ctim.tv_nsec = st->st_ctim.tv_sec * 1000000000;
         kprint(KPRN_WARN, "iso9660: stat() called on a non-rockridge ISO,"
                 "information will be missing!");
-        spinlock_release(&iso9660_lock);
+        mutex_unlock(&iso9660_lock);
         return 0;
     }
 
     char *rr_area = handle_s->path_res.rr_area;
     if (!rr_area) {
-        spinlock_release(&iso9660_lock);
+        mutex_unlock(&iso9660_lock);
         return -1;
     }
     struct rr_px px = load_rr_px(rr_area, rr_length);
     if (px.signature[0] != 'P' || px.signature[1] != 'X') {
-        spinlock_release(&iso9660_lock);
+        mutex_unlock(&iso9660_lock);
         return -1;
     }
     st->st_ino = px.ino.little;
@@ -692,7 +693,7 @@ static int iso9660_fstat(int handle, struct stat *st) {
         /* device/char file - look for PN entry */
         struct rr_pn pn = load_rr_pn(rr_area, rr_length);
         if (pn.signature[0] != 'P' || pn.signature[1] != 'N') {
-            spinlock_release(&iso9660_lock);
+            mutex_unlock(&iso9660_lock);
             return -1;
         }
         st->st_rdev = ((uint64_t)pn.high.little) << 32 |
@@ -701,12 +702,12 @@ static int iso9660_fstat(int handle, struct stat *st) {
 
     char *tf_buf = load_rr_tf(rr_area, rr_length);
     if (!tf_buf) {
-        spinlock_release(&iso9660_lock);
+        mutex_unlock(&iso9660_lock);
         return -1;
     }
     struct rr_tf *tf = (struct rr_tf*) tf_buf;
     if (tf->signature[0] != 'T' || tf->signature[1] != 'F') {
-        spinlock_release(&iso9660_lock);
+        mutex_unlock(&iso9660_lock);
         return -1;
     }
 
@@ -748,7 +749,7 @@ static int iso9660_fstat(int handle, struct stat *st) {
         st->st_ctim.tv_nsec = st->st_ctim.tv_sec * 1000000000;
     }
 
-    spinlock_release(&iso9660_lock);
+    mutex_unlock(&iso9660_lock);
     return 0;
 }
 static int iso9660_mount(const char *source) {
@@ -784,19 +785,19 @@ static int iso9660_close(int handle) {
     if (handle < 0)
         return -1;
 
-    spinlock_acquire(&iso9660_lock);
+    mutex_lock(&iso9660_lock);
 
     if (handle >= handle_i) {
-        spinlock_release(&iso9660_lock);
+        mutex_unlock(&iso9660_lock);
         return -1;
     }
     if (handles[handle].free) {
-        spinlock_release(&iso9660_lock);
+        mutex_unlock(&iso9660_lock);
         return -1;
     }
     if (!(--handles[handle].refcount))
         handles[handle].free = 1;
-    spinlock_release(&iso9660_lock);
+    mutex_unlock(&iso9660_lock);
     return 0;
 }
 
@@ -804,19 +805,19 @@ static int iso9660_dup(int handle) {
     if (handle < 0)
         return -1;
 
-    spinlock_acquire(&iso9660_lock);
+    mutex_lock(&iso9660_lock);
 
     if (handle >= handle_i) {
-        spinlock_release(&iso9660_lock);
+        mutex_unlock(&iso9660_lock);
         return -1;
     }
     if (handles[handle].free) {
-        spinlock_release(&iso9660_lock);
+        mutex_unlock(&iso9660_lock);
         return -1;
     }
 
     handles[handle].refcount++;
-    spinlock_release(&iso9660_lock);
+    mutex_unlock(&iso9660_lock);
     return 0;
 }
 
@@ -828,9 +829,9 @@ static int iso9660_write(int handle, const void *buf, size_t count) {
 }
 
 static int iso9660_readdir(int handle, struct dirent *dir) {
-    spinlock_acquire(&iso9660_lock);
+    mutex_lock(&iso9660_lock);
     if (handle < 0 || handle >= handle_i || handles[handle].free) {
-        spinlock_release(&iso9660_lock);
+        mutex_unlock(&iso9660_lock);
         errno = EBADF;
         return -1;
     }
@@ -865,11 +866,11 @@ static int iso9660_readdir(int handle, struct dirent *dir) {
         dir->d_type = DT_REG;
     handle_s->offset += target->length;
     kfree(name);
-    spinlock_release(&iso9660_lock);
+    mutex_unlock(&iso9660_lock);
     return 0;
 
 end_of_dir:
-    spinlock_release(&iso9660_lock);
+    mutex_unlock(&iso9660_lock);
     errno = 0;
     return -1;
 }
@@ -1,15 +1,268 @@
 #include <stddef.h>
+#include <stdint.h>
 #include <lib/alloc.h>
 #include <lib/klib.h>
+#include <lib/lock.h>
+#include <lib/cio.h>
 #include <mm/mm.h>
 #include <lib/cmem.h>
+#include <sys/cpu.h>
+#include <sys/smp.h>
+
+/* Small objects live in single page slabs. The slab header sits at the start
+ * of the page, so a slab object is never page aligned, while allocations
+ * which are too large for a slab are always page aligned and carry a
+ * metadata page in front of them. kfree() tells the two apart that way.
+ * kalloc() objects are naturally aligned to their size class since some
+ * drivers hand them straight to DMA engines. */
+
+#define SLAB_HEADER_SIZE 64
+#define SLAB_TYPED_ALIGN 64
+
+#define KMEM_CPU_CACHE_SIZE 16
+/* Per-CPU array size of caches whose objects do not fit in a slab */
+#define KMEM_LARGE_CPU_CACHE_SIZE 4
+
+/* Free objects are threaded through their first word */
+struct slab_free_t {
+    struct slab_free_t *next;
+};
+
+struct slab_t {
+    struct kmem_cache_t *cache;
+    struct slab_t *next;
+    struct slab_t *prev;
+    struct slab_free_t *free;
+    size_t inuse;
+};
+
+struct kmem_cpu_cache_t {
+    size_t count;
+    void *objs[KMEM_CPU_CACHE_SIZE];
+};
+
+struct kmem_cache_t {
+    const char *name;
+    size_t size;
+    size_t offset;
+    size_t objs_per_slab;
+    lock_t lock;
+    /* Slabs with at least one free object */
+    struct slab_t *partial;
+    /* A fully free slab kept around to avoid thrashing the PMM */
+    struct slab_t *empty;
+    struct kmem_cpu_cache_t cpu[MAX_CPUS];
+};
 
 typedef struct {
     size_t pages;
     size_t size;
 } alloc_metadata_t;
 
-void *kalloc(size_t size) {
+#define KMALLOC_MIN_SHIFT 4
+#define KMALLOC_MAX_SHIFT 10
+#define KMALLOC_CLASSES (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+static struct kmem_cache_t kmalloc_caches[KMALLOC_CLASSES];
+
+static void *kalloc_large(size_t);
+
+static const char *kmalloc_cache_names[KMALLOC_CLASSES] = {
+    "kalloc-16", "kalloc-32", "kalloc-64", "kalloc-128",
+    "kalloc-256", "kalloc-512", "kalloc-1024"
+};
+
+static void kmem_cache_init(struct kmem_cache_t *cache, const char *name,
+                            size_t size, size_t max_align) {
+    if (size < sizeof(struct slab_free_t))
+        size = sizeof(struct slab_free_t);
+
+    size_t align = 8;
+    while (align < max_align && align < size)
+        align *= 2;
+    size = DIV_ROUNDUP(size, align) * align;
+
+    memset(cache, 0, sizeof(struct kmem_cache_t));
+    cache->name = name;
+    cache->size = size;
+    cache->offset = DIV_ROUNDUP(SLAB_HEADER_SIZE, align) * align;
+    cache->objs_per_slab = (PAGE_SIZE - cache->offset) / size;
+    cache->lock = new_lock;
+}
+
+void init_alloc(void) {
+    for (size_t i = 0; i < KMALLOC_CLASSES; i++)
+        kmem_cache_init(&kmalloc_caches[i], kmalloc_cache_names[i],
+                        (size_t)1 << (i + KMALLOC_MIN_SHIFT),
+                        (size_t)1 << (i + KMALLOC_MIN_SHIFT));
+}
+
+/* Create a typed object cache. Objects too large for a slab get pages of
+ * their own, and only the per-CPU arrays cache them. */
+struct kmem_cache_t *kmem_cache_create(const char *name, size_t size) {
+    struct kmem_cache_t *cache = kalloc(sizeof(struct kmem_cache_t));
+    if (!cache)
+        return NULL;
+
+    kmem_cache_init(cache, name, size, SLAB_TYPED_ALIGN);
+
+    return cache;
+}
+
+static inline void slab_list_remove(struct slab_t **list, struct slab_t *slab) {
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+}
+
+static inline void slab_list_push(struct slab_t **list, struct slab_t *slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list)
+        (*list)->prev = slab;
+    *list = slab;
+}
+
+static struct slab_t *slab_new(struct kmem_cache_t *cache) {
+    void *page = pmm_alloc(1);
+    if (!page)
+        return NULL;
+
+    struct slab_t *slab = (struct slab_t *)((size_t)page + MEM_PHYS_OFFSET);
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->free = NULL;
+
+    for (size_t i = cache->objs_per_slab; i; i--) {
+        struct slab_free_t *obj =
+            (struct slab_free_t *)((size_t)slab + cache->offset + (i - 1) * cache->size);
+        obj->next = slab->free;
+        slab->free = obj;
+    }
+
+    return slab;
+}
+
+/* Must be called with the cache lock held */
+static void *slab_alloc_locked(struct kmem_cache_t *cache) {
+    if (!cache->objs_per_slab)
+        return kalloc_large(cache->size);
+
+    struct slab_t *slab = cache->partial;
+
+    if (!slab) {
+        if (cache->empty) {
+            slab = cache->empty;
+            cache->empty = NULL;
+        } else {
+            slab = slab_new(cache);
+            if (!slab)
+                return NULL;
+        }
+        slab_list_push(&cache->partial, slab);
+    }
+
+    struct slab_free_t *obj = slab->free;
+    slab->free = obj->next;
+    slab->inuse++;
+
+    if (!slab->free)
+        slab_list_remove(&cache->partial, slab);
+
+    return obj;
+}
+
+/* Must be called with the cache lock held */
+static void slab_free_locked(struct kmem_cache_t *cache, void *ptr) {
+    if (!cache->objs_per_slab) {
+        kfree(ptr);
+        return;
+    }
+
+    struct slab_t *slab = (struct slab_t *)((size_t)ptr & ~(PAGE_SIZE - 1));
+    struct slab_free_t *obj = ptr;
+
+    if (!slab->free)
+        slab_list_push(&cache->partial, slab);
+
+    obj->next = slab->free;
+    slab->free = obj;
+    slab->inuse--;
+
+    if (!slab->inuse) {
+        slab_list_remove(&cache->partial, slab);
+        if (cache->empty)
+            pmm_free((void *)((size_t)cache->empty - MEM_PHYS_OFFSET), 1);
+        cache->empty = slab;
+    }
+}
+
+/* Allocate a zeroed object from a cache */
+void *kmem_cache_alloc(struct kmem_cache_t *cache) {
+    void *ptr = NULL;
+
+    if (smp_ready) {
+        uint64_t rflags = save_and_disable_interrupts();
+        struct kmem_cpu_cache_t *cpu = &cache->cpu[current_cpu];
+
+        if (!cpu->count) {
+            /* Refill half of the per-CPU array in one go */
+            size_t refill = cache->objs_per_slab ? KMEM_CPU_CACHE_SIZE / 2 : 1;
+            spinlock_acquire(&cache->lock);
+            while (cpu->count < refill) {
+                void *obj = slab_alloc_locked(cache);
+                if (!obj)
+                    break;
+                cpu->objs[cpu->count++] = obj;
+            }
+            spinlock_release(&cache->lock);
+        }
+
+        if (cpu->count)
+            ptr = cpu->objs[--cpu->count];
+
+        restore_interrupts(rflags);
+    } else {
+        spinlock_acquire(&cache->lock);
+        ptr = slab_alloc_locked(cache);
+        spinlock_release(&cache->lock);
+    }
+
+    if (ptr)
+        memset(ptr, 0, cache->size);
+
+    return ptr;
+}
+
+void kmem_cache_free(struct kmem_cache_t *cache, void *ptr) {
+    if (smp_ready) {
+        uint64_t rflags = save_and_disable_interrupts();
+        struct kmem_cpu_cache_t *cpu = &cache->cpu[current_cpu];
+        size_t max = cache->objs_per_slab ? KMEM_CPU_CACHE_SIZE
+                                          : KMEM_LARGE_CPU_CACHE_SIZE;
+
+        if (cpu->count == max) {
+            /* Flush half of the per-CPU array back to the slabs */
+            spinlock_acquire(&cache->lock);
+            while (cpu->count > max / 2)
+                slab_free_locked(cache, cpu->objs[--cpu->count]);
+            spinlock_release(&cache->lock);
+        }
+
+        cpu->objs[cpu->count++] = ptr;
+
+        restore_interrupts(rflags);
+    } else {
+        spinlock_acquire(&cache->lock);
+        slab_free_locked(cache, ptr);
+        spinlock_release(&cache->lock);
+    }
+}
+
+static void *kalloc_large(size_t size) {
     size_t page_count = size / PAGE_SIZE;
 
     if (size % PAGE_SIZE) page_count++;
@@ -31,7 +284,31 @@ void *kalloc(size_t size) {
     return (void *)ptr;
 }
 
+static inline int is_large_alloc(void *ptr) {
+    return !((size_t)ptr & (PAGE_SIZE - 1));
+}
+
+void *kalloc(size_t size) {
+    if (size > ((size_t)1 << KMALLOC_MAX_SHIFT))
+        return kalloc_large(size);
+
+    size_t class = 0;
+    while (((size_t)1 << (class + KMALLOC_MIN_SHIFT)) < size)
+        class++;
+
+    return kmem_cache_alloc(&kmalloc_caches[class]);
+}
+
 void kfree(void *ptr) {
+    if (!ptr)
+        return;
+
+    if (!is_large_alloc(ptr)) {
+        struct slab_t *slab = (struct slab_t *)((size_t)ptr & ~(PAGE_SIZE - 1));
+        kmem_cache_free(slab->cache, ptr);
+        return;
+    }
+
     alloc_metadata_t *metadata = (alloc_metadata_t *)((size_t)ptr - PAGE_SIZE);
 
     pmm_free((void *)((size_t)metadata - MEM_PHYS_OFFSET), metadata->pages + 1);
@@ -45,13 +322,25 @@ void *krealloc(void *ptr, size_t new) {
         return (void *)0;
     }
 
-    /* Reference metadata page */
-    alloc_metadata_t *metadata = (alloc_metadata_t *)((size_t)ptr - PAGE_SIZE);
+    size_t old;
+
+    if (!is_large_alloc(ptr)) {
+        struct slab_t *slab = (struct slab_t *)((size_t)ptr & ~(PAGE_SIZE - 1));
+        old = slab->cache->size;
+        /* The object is already large enough */
+        if (new <= old)
+            return ptr;
+    } else {
+        /* Reference metadata page */
+        alloc_metadata_t *metadata = (alloc_metadata_t *)((size_t)ptr - PAGE_SIZE);
+
+        if ((metadata->size + PAGE_SIZE - 1) / PAGE_SIZE
+             == (new + PAGE_SIZE - 1) / PAGE_SIZE) {
+            metadata->size = new;
+            return ptr;
+        }
 
-    if ((metadata->size + PAGE_SIZE - 1) / PAGE_SIZE
-         == (new + PAGE_SIZE - 1) / PAGE_SIZE) {
-        metadata->size = new;
-        return ptr;
+        old = metadata->size;
     }
 
     char *new_ptr;
@@ -59,12 +348,12 @@ void *krealloc(void *ptr, size_t new) {
         return (void *)0;
     }
 
-    if (metadata->size > new)
+    if (old > new)
         /* Copy all the data from the old pointer to the new pointer,
          * within the range specified by `size`. */
         memcpy(new_ptr, (char *)ptr, new);
     else
-        memcpy(new_ptr, (char *)ptr, metadata->size);
+        memcpy(new_ptr, (char *)ptr, old);
 
     kfree(ptr);
 
@@ -3,9 +3,15 @@
 
 #include <stddef.h>
 
+struct kmem_cache_t;
+
 void init_alloc(void);
 void *kalloc(size_t);
 void kfree(void *);
 void *krealloc(void *, size_t);
 
+struct kmem_cache_t *kmem_cache_create(const char *, size_t);
+void *kmem_cache_alloc(struct kmem_cache_t *);
+void kmem_cache_free(struct kmem_cache_t *, void *);
+
 #endif
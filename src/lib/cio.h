@@ -88,4 +88,20 @@ static inline void mmio_write64(uint64_t address, uint64_t value) {
 #define disable_interrupts() ({ asm volatile ("cli"); })
 #define enable_interrupts() ({ asm volatile ("sti"); })
 
+#define save_and_disable_interrupts() ({			\
+	uint64_t rflags;							\
+	asm volatile (	"pushfq;"					\
+					"pop %0;"					\
+					"cli;"						\
+					: "=r" (rflags)				\
+					:							\
+					: "memory");				\
+	rflags;										\
+})
+
+#define restore_interrupts(rflags) ({			\
+	if ((rflags) & 0x200)						\
+		asm volatile ("sti" ::: "memory");		\
+})
+
 #endif
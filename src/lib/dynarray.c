@@ -0,0 +1,122 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <lib/dynarray.h>
+#include <lib/lock.h>
+#include <lib/alloc.h>
+#include <lib/bit.h>
+#include <lib/rcu.h>
+
+/* Index of the lowest clear bit in a bitmap of `words` words, -1 if every
+ * bit is set */
+static ssize_t dynarray_first_zero(const uint64_t *bitmap, size_t words) {
+    for (size_t i = 0; i < words; i++) {
+        if (~bitmap[i])
+            return i * 64 + __builtin_ctzll(~bitmap[i]);
+    }
+    return -1;
+}
+
+/* Reserve the lowest free index, adding a chunk if every one is full.
+ * Returns -1 if the array is at DYNARRAY_MAX or out of memory. Must be
+ * called with the array lock held. */
+ssize_t dynarray_claim_index(void ***chunks, size_t *size, uint64_t *free_chunks) {
+    ssize_t chunk = -1;
+
+    for (size_t i = 0; i < DYNARRAY_MAX_CHUNKS / 64; i++) {
+        if (free_chunks[i]) {
+            chunk = i * 64 + __builtin_ctzll(free_chunks[i]);
+            break;
+        }
+    }
+
+    if (chunk == -1) {
+        chunk = *size / DYNARRAY_CHUNK;
+        if (chunk == DYNARRAY_MAX_CHUNKS)
+            return -1;
+        void **new_chunk = kalloc(DYNARRAY_CHUNK_SIZE);
+        if (!new_chunk)
+            return -1;
+        /* Chunks never move nor go away, so lock-free readers can keep
+         * using them. Publish the chunk before the new size. */
+        locked_write(void **, &chunks[chunk], new_chunk);
+        locked_write(size_t, size, *size + DYNARRAY_CHUNK);
+        set_bit(free_chunks, chunk);
+    }
+
+    uint64_t *used = dynarray_chunk_used(chunks[chunk]);
+    size_t slot = dynarray_first_zero(used, DYNARRAY_USED_WORDS);
+    set_bit(used, slot);
+
+    if (dynarray_first_zero(used, DYNARRAY_USED_WORDS) == -1)
+        reset_bit(free_chunks, chunk);
+
+    return chunk * DYNARRAY_CHUNK + slot;
+}
+
+/* Give an index back once its slot got cleared. Must be called with the
+ * array lock held. */
+void dynarray_release_index(void ***chunks, uint64_t *free_chunks, size_t index) {
+    size_t chunk = index / DYNARRAY_CHUNK;
+    reset_bit(dynarray_chunk_used(chunks[chunk]), index % DYNARRAY_CHUNK);
+    set_bit(free_chunks, chunk);
+}
+
+/* Allocate a zeroed element, creating the cache of the array on first use */
+void *dynarray_alloc_cell(struct kmem_cache_t **cache, lock_t *lock,
+                          const char *name, size_t size) {
+    struct kmem_cache_t *c = locked_read(struct kmem_cache_t *, cache);
+
+    if (!c) {
+        spinlock_acquire(lock);
+        if (!(c = *cache)) {
+            c = kmem_cache_create(name, size);
+            if (c)
+                locked_write(struct kmem_cache_t *, cache, c);
+        }
+        spinlock_release(lock);
+        if (!c)
+            return NULL;
+    }
+
+    return kmem_cache_alloc(c);
+}
+
+/* djb2 */
+uint64_t dynarray_hash_key(const char *key) {
+    uint64_t hash = 5381;
+    int c;
+    while ((c = *key++))
+        hash = ((hash << 5) + hash) + c;
+    return hash;
+}
+
+/* Must be called with the array lock held */
+int dynarray_key_add(struct dynarray_key_t **keys, const char *key, size_t index) {
+    struct dynarray_key_t *node = kalloc(sizeof(struct dynarray_key_t));
+    if (!node)
+        return -1;
+
+    node->hash = dynarray_hash_key(key);
+    node->index = index;
+
+    struct dynarray_key_t **bucket = &keys[node->hash % DYNARRAY_KEY_BUCKETS];
+    node->next = *bucket;
+    locked_write(struct dynarray_key_t *, bucket, node);
+
+    return 0;
+}
+
+/* Must be called with the array lock held */
+void dynarray_key_remove(struct dynarray_key_t **keys, const char *key, size_t index) {
+    uint64_t hash = dynarray_hash_key(key);
+
+    for (struct dynarray_key_t **node = &keys[hash % DYNARRAY_KEY_BUCKETS];
+         *node; node = &(*node)->next) {
+        if ((*node)->index == index) {
+            struct dynarray_key_t *victim = *node;
+            locked_write(struct dynarray_key_t *, node, victim->next);
+            rcu_free(victim, &victim->rcu);
+            return;
+        }
+    }
+}
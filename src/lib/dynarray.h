@@ -1,132 +1,272 @@
 #ifndef __DYNARRAY_H__
 #define __DYNARRAY_H__
 
+#include <stdint.h>
 #include <stddef.h>
+#include <lib/types.h>
 #include <lib/lock.h>
 #include <lib/alloc.h>
+#include <lib/cstring.h>
+#include <lib/rcu.h>
+
+/* Lookups are lock-free: they run as RCU readers and only bump the
+ * refcount of the element they return. The lock serialises the writers.
+ * Elements are freed through rcu_free(), so a reader racing with their
+ * removal still reads valid memory.
+ * Slots live in chunks of DYNARRAY_CHUNK, which get allocated as the array
+ * grows and are never moved or freed. Each chunk ends with a bitmap of the
+ * slots in use, and a per array bitmap tracks the chunks with room left, so
+ * adding an element does not scan the array. `name##_i` is the number of
+ * slots in the allocated chunks.
+ * Elements of each array come from a typed cache named after it. */
+
+#define DYNARRAY_CHUNK_SHIFT 8
+#define DYNARRAY_CHUNK (1 << DYNARRAY_CHUNK_SHIFT)
+#define DYNARRAY_MAX_CHUNKS 256
+#define DYNARRAY_MAX (DYNARRAY_CHUNK * DYNARRAY_MAX_CHUNKS)
+
+#define DYNARRAY_USED_WORDS (DYNARRAY_CHUNK / 64)
+#define DYNARRAY_CHUNK_SIZE \
+    (DYNARRAY_CHUNK * sizeof(void *) + DYNARRAY_USED_WORDS * sizeof(uint64_t))
+#define dynarray_chunk_used(chunk) ((uint64_t *)&((void **)(chunk))[DYNARRAY_CHUNK])
+
+#define DYNARRAY_KEY_BUCKETS 64
+
+/* Name index entry, see dynarray_new_keyed() */
+struct dynarray_key_t {
+    uint64_t hash;
+    size_t index;
+    struct dynarray_key_t *next;
+    struct rcu_head_t rcu;
+};
+
+ssize_t dynarray_claim_index(void ***, size_t *, uint64_t *);
+void dynarray_release_index(void ***, uint64_t *, size_t);
+uint64_t dynarray_hash_key(const char *);
+int dynarray_key_add(struct dynarray_key_t **, const char *, size_t);
+void dynarray_key_remove(struct dynarray_key_t **, const char *, size_t);
+void *dynarray_alloc_cell(struct kmem_cache_t **, lock_t *, const char *, size_t);
 
 #define dynarray_new(type, name) \
     static struct { \
         int refcount; \
         int present; \
+        struct rcu_head_t rcu; \
         type data; \
-    } **name; \
+    } **name[DYNARRAY_MAX_CHUNKS]; \
     static size_t name##_i = 0; \
+    static uint64_t name##_free_chunks[DYNARRAY_MAX_CHUNKS / 64]; \
+    static struct kmem_cache_t *name##_cache = NULL; \
     static lock_t name##_lock = new_lock;
 
+/* Same as dynarray_new(), plus an index of the elements by their `name`
+ * member, for dynarray_search_key(). Elements must be added and removed
+ * with the _keyed variants, and must not be renamed while in the array. */
+#define dynarray_new_keyed(type, name) \
+    dynarray_new(type, name) \
+    static struct dynarray_key_t *name##_keys[DYNARRAY_KEY_BUCKETS];
+
 #define public_dynarray_new(type, name) \
-    struct __##name##_struct **name; \
+    struct __##name##_struct **name[DYNARRAY_MAX_CHUNKS]; \
     size_t name##_i = 0; \
+    uint64_t name##_free_chunks[DYNARRAY_MAX_CHUNKS / 64]; \
+    struct kmem_cache_t *name##_cache = NULL; \
     lock_t name##_lock = new_lock;
 
 #define public_dynarray_prototype(type, name) \
     struct __##name##_struct { \
         int refcount; \
         int present; \
+        struct rcu_head_t rcu; \
         type data; \
     }; \
-    extern struct __##name##_struct **name; \
+    extern struct __##name##_struct **name[DYNARRAY_MAX_CHUNKS]; \
     extern size_t name##_i; \
+    extern uint64_t name##_free_chunks[DYNARRAY_MAX_CHUNKS / 64]; \
+    extern struct kmem_cache_t *name##_cache; \
     extern lock_t name##_lock;
 
+/* Take a reference, unless the last one is already gone */
+__attribute__((unused)) static inline int dynarray_ref(int *refcount) {
+    int count = *(volatile int *)refcount;
+    while (count) {
+        int ok;
+        asm volatile (
+            "lock cmpxchg %1, %3;"
+            : "=@ccz" (ok), "+m" (*refcount), "+a" (count)
+            : "r" (count + 1)
+            : "memory"
+        );
+        if (ok)
+            return 1;
+    }
+    return 0;
+}
+
+/* Load the element in a slot, NULL if there is none. Must be called by an
+ * RCU reader or with the lock held. */
+#define dynarray_slot(dynarray, element) ({ \
+    typeof(*dynarray[0]) slot_ret = NULL; \
+    size_t slot_idx = (element); \
+    if (slot_idx < DYNARRAY_MAX) { \
+        typeof(dynarray[0]) slot_chunk = rcu_dereference(dynarray[slot_idx / DYNARRAY_CHUNK]); \
+        if (slot_chunk) \
+            slot_ret = rcu_dereference(slot_chunk[slot_idx % DYNARRAY_CHUNK]); \
+    } \
+    slot_ret; \
+})
+
+/* Clear a slot whose last reference got dropped. Must be called with the
+ * lock held. */
+#define dynarray_clear_slot(dynarray, element, slot) ({ \
+    dynarray[(element) / DYNARRAY_CHUNK][(element) % DYNARRAY_CHUNK] = 0; \
+    dynarray_release_index((void ***)dynarray, dynarray##_free_chunks, element); \
+    rcu_free(slot, &slot->rcu); \
+})
+
 #define dynarray_remove(dynarray, element) ({ \
     __label__ out; \
     int ret; \
     spinlock_acquire(&dynarray##_lock); \
-    if (!dynarray[element]) { \
+    typeof(*dynarray[0]) slot = dynarray_slot(dynarray, element); \
+    if (!slot) { \
         ret = -1; \
         goto out; \
     } \
     ret = 0; \
-    dynarray[element]->present = 0; \
-    if (!locked_dec(&dynarray[element]->refcount)) { \
-        kfree(dynarray[element]); \
-        dynarray[element] = 0; \
-    } \
+    slot->present = 0; \
+    if (!locked_dec(&slot->refcount)) \
+        dynarray_clear_slot(dynarray, element, slot); \
 out: \
     spinlock_release(&dynarray##_lock); \
     ret; \
 })
 
 #define dynarray_unref(dynarray, element) ({ \
-    spinlock_acquire(&dynarray##_lock); \
-    if (dynarray[element] && !locked_dec(&dynarray[element]->refcount)) { \
-        kfree(dynarray[element]); \
-        dynarray[element] = 0; \
+    int rcu_idx = rcu_read_lock(); \
+    typeof(*dynarray[0]) slot = dynarray_slot(dynarray, element); \
+    rcu_read_unlock(rcu_idx); \
+    /* Our reference keeps the element around */ \
+    if (slot && !locked_dec(&slot->refcount)) { \
+        spinlock_acquire(&dynarray##_lock); \
+        dynarray_clear_slot(dynarray, element, slot); \
+        spinlock_release(&dynarray##_lock); \
     } \
-    spinlock_release(&dynarray##_lock); \
 })
 
 #define dynarray_getelem(type, dynarray, element) ({ \
-    spinlock_acquire(&dynarray##_lock); \
     type *ptr = NULL; \
-    if (dynarray[element] && dynarray[element]->present) { \
-        ptr = &dynarray[element]->data; \
-        locked_inc(&dynarray[element]->refcount); \
-    } \
-    spinlock_release(&dynarray##_lock); \
+    int rcu_idx = rcu_read_lock(); \
+    typeof(*dynarray[0]) slot = dynarray_slot(dynarray, element); \
+    if (slot && slot->present && dynarray_ref(&slot->refcount)) \
+        ptr = &slot->data; \
+    rcu_read_unlock(rcu_idx); \
     ptr; \
 })
 
 #define dynarray_add(type, dynarray, element) ({ \
-    __label__ fnd; \
     __label__ out; \
     int ret = -1; \
+    typeof(*dynarray[0]) slot = dynarray_alloc_cell(&dynarray##_cache, \
+                            &dynarray##_lock, #dynarray, sizeof(*slot)); \
+    if (!slot) \
+        goto out; \
+    slot->refcount = 1; \
+    slot->present = 1; \
+    slot->data = *element; \
         \
     spinlock_acquire(&dynarray##_lock); \
+    ssize_t i = dynarray_claim_index((void ***)dynarray, &dynarray##_i, \
+                                     dynarray##_free_chunks); \
+    if (i != -1) \
+        locked_write(void *, &dynarray[i / DYNARRAY_CHUNK][i % DYNARRAY_CHUNK], slot); \
+    spinlock_release(&dynarray##_lock); \
         \
-    size_t i; \
-    for (i = 0; i < dynarray##_i; i++) { \
-        if (!dynarray[i]) \
-            goto fnd; \
-    } \
-        \
-    dynarray##_i += 256; \
-    void *tmp = krealloc(dynarray, dynarray##_i * sizeof(void *)); \
-    if (!tmp) \
-        goto out; \
-    dynarray = tmp; \
-        \
-fnd: \
-    dynarray[i] = kalloc(sizeof(**dynarray)); \
-    if (!dynarray[i]) \
+    if (i == -1) { \
+        kfree(slot); \
         goto out; \
-    dynarray[i]->refcount = 1; \
-    dynarray[i]->present = 1; \
-    dynarray[i]->data = *element; \
-        \
+    } \
     ret = i; \
         \
 out: \
-    spinlock_release(&dynarray##_lock); \
     ret; \
 })
 
+#define dynarray_add_keyed(type, dynarray, element) ({ \
+    int added = dynarray_add(type, dynarray, element); \
+    if (added != -1) { \
+        spinlock_acquire(&dynarray##_lock); \
+        int err = dynarray_key_add(dynarray##_keys, (element)->name, added); \
+        spinlock_release(&dynarray##_lock); \
+        if (err) { \
+            dynarray_remove(dynarray, added); \
+            added = -1; \
+        } \
+    } \
+    added; \
+})
+
+#define dynarray_remove_keyed(dynarray, element) ({ \
+    spinlock_acquire(&dynarray##_lock); \
+    typeof(*dynarray[0]) slot = dynarray_slot(dynarray, element); \
+    if (slot) \
+        dynarray_key_remove(dynarray##_keys, slot->data.name, element); \
+    spinlock_release(&dynarray##_lock); \
+    dynarray_remove(dynarray, element); \
+})
+
 #define dynarray_search(type, dynarray, i_ptr, cond, index) ({ \
-    __label__ fnd; \
-    __label__ out; \
     type *ret = NULL; \
+    int rcu_idx = rcu_read_lock(); \
         \
-    spinlock_acquire(&dynarray##_lock); \
-        \
-    size_t i; \
+    size_t count = rcu_dereference(dynarray##_i); \
+    size_t idx; \
     size_t j = 0; \
-    for (i = 0; i < dynarray##_i; i++) { \
-        if (!dynarray[i] || !dynarray[i]->present) \
+    for (idx = 0; idx < count; idx++) { \
+        typeof(*dynarray[0]) slot = dynarray_slot(dynarray, idx); \
+        if (!slot || !slot->present) \
+            continue; \
+        type *elem = &slot->data; \
+        if (!(cond) || j++ != (index)) \
             continue; \
-        type *elem = &dynarray[i]->data; \
-        if ((cond) && j++ == (index)) \
-            goto fnd; \
+        /* Lost the race with its removal */ \
+        if (!dynarray_ref(&slot->refcount)) { \
+            j--; \
+            continue; \
+        } \
+        ret = elem; \
+        *(i_ptr) = idx; \
+        break; \
     } \
-    goto out; \
         \
-fnd: \
-    ret = &dynarray[i]->data; \
-    locked_inc(&dynarray[i]->refcount); \
-    *(i_ptr) = i; \
+    rcu_read_unlock(rcu_idx); \
+    ret; \
+})
+
+/* Look an element up by its `name` member through the index of a keyed
+ * array */
+#define dynarray_search_key(type, dynarray, i_ptr, key) ({ \
+    type *ret = NULL; \
+    const char *k = (key); \
+    uint64_t hash = dynarray_hash_key(k); \
+    int rcu_idx = rcu_read_lock(); \
         \
-out: \
-    spinlock_release(&dynarray##_lock); \
+    for (struct dynarray_key_t *node = \
+            rcu_dereference(dynarray##_keys[hash % DYNARRAY_KEY_BUCKETS]); \
+         node; node = rcu_dereference(node->next)) { \
+        if (node->hash != hash) \
+            continue; \
+        typeof(*dynarray[0]) slot = dynarray_slot(dynarray, node->index); \
+        if (!slot || !slot->present || strcmp(slot->data.name, k)) \
+            continue; \
+        if (!dynarray_ref(&slot->refcount)) \
+            continue; \
+        ret = &slot->data; \
+        *(i_ptr) = node->index; \
+        break; \
+    } \
+        \
+    rcu_read_unlock(rcu_idx); \
     ret; \
 })
 
@@ -0,0 +1,168 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <lib/event.h>
+#include <lib/lock.h>
+#include <lib/cio.h>
+#include <lib/time.h>
+#include <proc/task.h>
+#include <sys/cpu.h>
+#include <sys/timer.h>
+
+/* Threads waiting on an event are linked into its wait queue through nodes
+ * living on their own stacks. The queues are protected by a small set of
+ * hashed locks, so that a zeroed event_t is a valid, untriggered event. */
+
+#define EVENT_LOCK_BUCKETS 64
+
+struct event_waiter_t {
+    struct thread_t *thread;
+    struct event_waiter_t *next;
+    struct event_waiter_t *prev;
+};
+
+static lock_t event_locks[EVENT_LOCK_BUCKETS] = {
+    [0 ... EVENT_LOCK_BUCKETS - 1] = new_lock
+};
+
+static inline lock_t *event_lock(event_t *event) {
+    return &event_locks[((size_t)event >> 4) % EVENT_LOCK_BUCKETS];
+}
+
+/* Event locks are taken from interrupt handlers, so interrupts must be
+ * disabled while holding one */
+static inline uint64_t event_lock_acquire(event_t *event) {
+    uint64_t rflags = save_and_disable_interrupts();
+    spinlock_acquire(event_lock(event));
+    return rflags;
+}
+
+static inline void event_lock_release(event_t *event, uint64_t rflags) {
+    spinlock_release(event_lock(event));
+    restore_interrupts(rflags);
+}
+
+void event_trigger(event_t *event) {
+    uint64_t rflags = event_lock_acquire(event);
+
+    event->counter++;
+
+    /* Wake everyone, whoever gets to run first consumes the event and the
+     * others go back to sleep */
+    for (struct event_waiter_t *w = event->waiters; w; w = w->next)
+        task_wake(w->thread);
+
+    event_lock_release(event, rflags);
+}
+
+/* Consume every triggered event in the set, returns 1 if there was any */
+static int events_consume(event_t **event, int *out_events, int n) {
+    int ret = 0;
+
+    for (int i = 0; i < n; i++) {
+        uint64_t rflags = event_lock_acquire(event[i]);
+        if (event[i]->counter) {
+            event[i]->counter--;
+            out_events[i] = 1;
+            ret = 1;
+        }
+        event_lock_release(event[i], rflags);
+    }
+
+    return ret;
+}
+
+/* Returns 1 if the event got triggered before we got on its queue */
+static int event_add_waiter(event_t *event, struct event_waiter_t *waiter) {
+    uint64_t rflags = event_lock_acquire(event);
+
+    waiter->prev = NULL;
+    waiter->next = event->waiters;
+    if (event->waiters)
+        event->waiters->prev = waiter;
+    event->waiters = waiter;
+
+    int ret = event->counter != 0;
+
+    event_lock_release(event, rflags);
+
+    return ret;
+}
+
+static void event_remove_waiter(event_t *event, struct event_waiter_t *waiter) {
+    uint64_t rflags = event_lock_acquire(event);
+
+    if (waiter->prev)
+        waiter->prev->next = waiter->next;
+    else
+        event->waiters = waiter->next;
+    if (waiter->next)
+        waiter->next->prev = waiter->prev;
+
+    event_lock_release(event, rflags);
+}
+
+static void event_timer_wake(void *thread) {
+    task_wake(thread);
+}
+
+/* Returns 0 once an event was consumed, 1 if the deadline passed first and
+ * -1 if the wait got aborted. A deadline of 0 means no timeout. */
+static int events_wait(event_t **event, int *out_events, int n, uint64_t deadline) {
+    struct event_waiter_t waiters[n];
+    struct timer_t timer = { .cpu = -1 };
+    struct thread_t *thread;
+
+    sched_lock();
+    thread = task_table[cpu_locals[current_cpu].current_task];
+    sched_unlock();
+
+    for (;;) {
+        if (events_consume(event, out_events, n))
+            return 0;
+        if (locked_read(int, &thread->event_abrt))
+            return -1;
+        if (deadline && deadline <= get_uptime_ns())
+            return 1;
+
+        /* Holding scheduler_lock keeps us from being switched out before
+         * we are on every queue */
+        sched_lock();
+
+        task_block(thread);
+
+        int ready = 0;
+        for (int i = 0; i < n; i++) {
+            waiters[i].thread = thread;
+            if (event_add_waiter(event[i], &waiters[i]))
+                ready = 1;
+        }
+
+        /* task_tkill() and task_tpause() set this before waking us */
+        if (locked_read(int, &thread->event_abrt))
+            ready = 1;
+
+        if (ready) {
+            sched_unlock();
+        } else {
+            if (deadline)
+                timer_arm(&timer, deadline, event_timer_wake, thread);
+            force_resched();
+        }
+
+        /* Woken up, or never went to sleep. Either way, clean up and
+         * check again what happened. */
+        timer_cancel(&timer);
+        task_wake(thread);
+        for (int i = 0; i < n; i++)
+            event_remove_waiter(event[i], &waiters[i]);
+    }
+}
+
+int events_await(event_t **event, int *out_events, int n) {
+    return events_wait(event, out_events, n, 0);
+}
+
+int events_await_timeout(event_t **event, int *out_events, int n, size_t timeout) {
+    /* timeout is in milliseconds */
+    return events_wait(event, out_events, n, get_uptime_ns() + timeout * 1000000);
+}
@@ -22,7 +22,7 @@ static inline uint64_t ht_hash_str(const char *str, uint64_t seed) {
 
 #define ht_new(type, name) \
     type **name; \
-    lock_t name##_lock;
+    rwlock_t name##_lock;
 
 #define ht_dump(type, hashtable, size) ({ \
     void **buf = NULL; \
@@ -63,7 +63,7 @@ __attribute__((unused)) static void **__ht_dump(void **ht, void **buf, size_t *s
         goto out; \
     } \
     hashtable = (void *)hashtable + MEM_PHYS_OFFSET; \
-    hashtable##_lock = new_lock; \
+    hashtable##_lock = new_rwlock; \
     while (!(hashtable[0] = (void *)rand64())); \
 out: \
     ret; \
@@ -73,7 +73,7 @@ out: \
     __label__ out; \
     type *ret; \
         \
-    spinlock_acquire(&hashtable##_lock); \
+    rwlock_acquire_read(&hashtable##_lock); \
     type **ht = hashtable; \
     for (;;) { \
         uint64_t hash = ht_hash_str(nname, (uint64_t)ht[0]); \
@@ -93,7 +93,7 @@ out: \
         } \
     } \
 out: \
-    spinlock_release(&hashtable##_lock); \
+    rwlock_release_read(&hashtable##_lock); \
     ret; \
 })
 
@@ -101,7 +101,7 @@ out: \
     __label__ out; \
     type *ret; \
         \
-    spinlock_acquire(&hashtable##_lock); \
+    rwlock_acquire_write(&hashtable##_lock); \
     type **ht = hashtable; \
     for (;;) { \
         uint64_t hash = ht_hash_str(nname, (uint64_t)ht[0]); \
@@ -122,7 +122,7 @@ out: \
         } \
     } \
 out: \
-    spinlock_release(&hashtable##_lock); \
+    rwlock_release_write(&hashtable##_lock); \
     ret; \
 })
 
@@ -134,7 +134,7 @@ out: \
     __label__ out; \
     int ret = 0; \
         \
-    spinlock_acquire(&hashtable##_lock); \
+    rwlock_acquire_write(&hashtable##_lock); \
     type **ht = hashtable; \
         \
     for (;;) { \
@@ -167,7 +167,7 @@ out: \
     } \
     \
 out: \
-    spinlock_release(&hashtable##_lock); \
+    rwlock_release_write(&hashtable##_lock); \
     ret; \
 })
 
@@ -196,10 +196,12 @@ static void kprn_x(char *kprint_buf, size_t *kprint_buf_i, uint64_t x, int pad)
 }
 
 static void print_timestamp(char *kprint_buf, size_t *kprint_buf_i, int type) {
+    uint64_t uptime_ms = get_uptime_ns() / 1000000;
+
     kputs(kprint_buf, kprint_buf_i, "\e[37m[");
-    kprn_ui(kprint_buf, kprint_buf_i, uptime_sec);
+    kprn_ui(kprint_buf, kprint_buf_i, uptime_ms / 1000);
     kputs(kprint_buf, kprint_buf_i, ".");
-    kprn_ui(kprint_buf, kprint_buf_i, uptime_raw);
+    kprn_ui(kprint_buf, kprint_buf_i, uptime_ms);
     kputs(kprint_buf, kprint_buf_i, "] ");
 
     switch (type) {
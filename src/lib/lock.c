@@ -0,0 +1,80 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <lib/lock.h>
+#include <proc/task.h>
+
+/* Spins before spinlock_acquire_adaptive() gives the CPU away */
+#define SPINLOCK_ADAPTIVE_SPINS 1000
+
+/* Queue up on a contended lock. Like a lock holder, a waiter which gets
+ * preempted while it holds a ticket stalls everyone queued behind it until it
+ * runs again, so locks shared with interrupt handlers still have to be taken
+ * with interrupts disabled. */
+void spinlock_acquire_slow(lock_t *lock) {
+    uint32_t ticket = 1;
+    asm volatile (
+        "lock xadd %1, %0;"
+        : "+r" (ticket), "+m" (lock->next)
+        :
+        : "memory", "cc"
+    );
+
+    while (*(volatile uint32_t *)&lock->owner != ticket)
+        asm volatile ("pause" ::: "memory");
+}
+
+/* Spin for a while, then yield the CPU between attempts. Meant for locks
+ * which may be held across long operations. Only usable from thread context
+ * with interrupts enabled and scheduler_lock not held. Waiters do not queue,
+ * so this gives up the FIFO ordering of spinlock_acquire(). */
+void spinlock_acquire_adaptive(lock_t *lock) {
+    for (;;) {
+        for (int i = 0; i < SPINLOCK_ADAPTIVE_SPINS; i++) {
+            if (spinlock_test_and_acquire(lock))
+                return;
+            asm volatile ("pause" ::: "memory");
+        }
+        yield();
+    }
+}
+
+static inline int rwlock_cmpxchg(uint32_t *state, uint32_t old, uint32_t new) {
+    int ret;
+    asm volatile (
+        "lock cmpxchg %1, %3;"
+        : "=@ccz" (ret), "+m" (*state), "+a" (old)
+        : "r" (new)
+        : "memory"
+    );
+    return ret;
+}
+
+void rwlock_acquire_read(rwlock_t *rwlock) {
+    for (;;) {
+        uint32_t state = *(volatile uint32_t *)&rwlock->state;
+        if (!(state & (RWLOCK_WRITER | RWLOCK_WAITING))
+         && rwlock_cmpxchg(&rwlock->state, state, state + RWLOCK_READER))
+            return;
+        asm volatile ("pause" ::: "memory");
+    }
+}
+
+void rwlock_acquire_write(rwlock_t *rwlock) {
+    for (;;) {
+        uint32_t state = *(volatile uint32_t *)&rwlock->state;
+        if (!(state & ~RWLOCK_WAITING)) {
+            /* Free, this also clears RWLOCK_WAITING. Other waiting writers
+             * set it again. */
+            if (rwlock_cmpxchg(&rwlock->state, state, RWLOCK_WRITER))
+                return;
+        } else if (!(state & RWLOCK_WAITING)) {
+            asm volatile (
+                "lock or %0, %1;"
+                : "+m" (rwlock->state)
+                : "i" (RWLOCK_WAITING)
+                : "memory", "cc"
+            );
+        }
+        asm volatile ("pause" ::: "memory");
+    }
+}
@@ -5,6 +5,12 @@
 #include <stddef.h>
 #include <lib/qemu.h>
 
+/* Ticket locks. An acquirer takes a ticket from `next` and waits for `owner`
+ * to reach it, so the lock is handed out in FIFO order and waiters only read
+ * its cache line until their turn comes. The lock is free when both match.
+ * `owner` sits at offset 0, assembly releases a lock with
+ * `lock inc dword [lock]`. */
+
 #ifdef _DEBUG_
 
 #define DEADLOCK_MAX_ITER 0x4000000
@@ -15,22 +21,58 @@ struct last_acquirer_t {
     int line;
 };
 
+#endif /* _DEBUG_ */
+
+#ifdef _LOCKSTAT_
+
+/* Contention statistics of one spinlock_acquire() or
+ * spinlock_test_and_acquire() call site, times are in TSC cycles. Sites
+ * link themselves into a list the first time they take their lock, see
+ * lib/lockstat.c. */
+struct lockstat_site_t {
+    const char *lockname;
+    const char *file;
+    const char *func;
+    int line;
+    int registered;
+    struct lockstat_site_t *next;
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t spin_cycles;
+    uint64_t max_spin_cycles;
+    uint64_t hold_cycles;
+    uint64_t max_hold_cycles;
+};
+
+#endif /* _LOCKSTAT_ */
+
 typedef struct {
-    int lock;
+    union {
+        struct {
+            uint32_t owner;
+            uint32_t next;
+        };
+        uint64_t tickets;
+    };
+#ifdef _DEBUG_
     struct last_acquirer_t last_acquirer;
+#endif
+#ifdef _LOCKSTAT_
+    /* Site and TSC of the current acquisition */
+    struct lockstat_site_t *lockstat_site;
+    uint64_t lockstat_acquired_at;
+#endif
 } lock_t;
 
-#define new_lock          (lock_t){ 1, { "N/A", "N/A", 0 } }
-#define new_lock_acquired (lock_t){ 0, { "N/A", "N/A", 0 } }
+#ifdef _DEBUG_
 
-#else /* _DEBUG_ */
+#define new_lock          (lock_t){ .owner = 0, .next = 0, .last_acquirer = { "N/A", "N/A", 0 } }
+#define new_lock_acquired (lock_t){ .owner = 0, .next = 1, .last_acquirer = { "N/A", "N/A", 0 } }
 
-typedef struct {
-    int lock;
-} lock_t;
+#else /* _DEBUG_ */
 
-#define new_lock          (lock_t){ 1 }
-#define new_lock_acquired (lock_t){ 0 }
+#define new_lock          (lock_t){ .owner = 0, .next = 0 }
+#define new_lock_acquired (lock_t){ .owner = 0, .next = 1 }
 
 #endif /* _DEBUG_ */
 
@@ -97,6 +139,24 @@ typedef struct {
     qemu_debug_puts_urgent(buf + i); \
 })
 
+/* Take the lock only if nobody holds it or waits for it */
+__attribute__((always_inline)) __attribute__((unused)) static inline int __spinlock_trylock(lock_t *lock) {
+    uint64_t old = *(volatile uint64_t *)&lock->tickets;
+    if ((uint32_t)old != (uint32_t)(old >> 32))
+        return 0;
+    int ret;
+    asm volatile (
+        "lock cmpxchg %1, %3;"
+        : "+a" (old), "+m" (lock->tickets), "=@ccz" (ret)
+        : "r" (old + ((uint64_t)1 << 32))
+        : "memory"
+    );
+    return ret;
+}
+
+void spinlock_acquire_slow(lock_t *);
+void spinlock_acquire_adaptive(lock_t *);
+
 #ifdef _DEBUG_
 
 __attribute__((unused)) static int deadlock_detect_lock = 0;
@@ -130,26 +190,20 @@ __attribute__((noinline)) __attribute__((unused)) static void deadlock_detect(co
     locked_write(int, &deadlock_detect_lock, 0);
 }
 
-#define spinlock_acquire(lock) ({ \
+#define __spinlock_acquire(lock) ({ \
     __label__ retry; \
     __label__ out; \
 retry:; \
     for (size_t i = 0; i < DEADLOCK_MAX_ITER; i++) \
-        if (spinlock_test_and_acquire(lock)) \
+        if (__spinlock_test_and_acquire(lock)) \
             goto out; \
     deadlock_detect(__FILE__, __func__, __LINE__, #lock, lock, DEADLOCK_MAX_ITER); \
     goto retry; \
 out:; \
 })
 
-#define spinlock_test_and_acquire(LOCK) ({ \
-    int ret; \
-    asm volatile ( \
-        "lock btr %0, 0;" \
-        : "+m" ((LOCK)->lock), "=@ccc" (ret) \
-        : \
-        : "memory" \
-    ); \
+#define __spinlock_test_and_acquire(LOCK) ({ \
+    int ret = __spinlock_trylock(LOCK); \
     if (ret) { \
         (LOCK)->last_acquirer.file = __FILE__; \
         (LOCK)->last_acquirer.func = __func__; \
@@ -160,40 +214,147 @@ out:; \
 
 #else /* _DEBUG_ */
 
+#define __spinlock_acquire(LOCK) ({ \
+    if (!__spinlock_trylock(LOCK)) \
+        spinlock_acquire_slow(LOCK); \
+})
+
+#define __spinlock_test_and_acquire(LOCK) __spinlock_trylock(LOCK)
+
+#endif /* _DEBUG_ */
+
+#ifdef _LOCKSTAT_
+
+static inline uint64_t lockstat_tsc(void) {
+    uint32_t eax, edx;
+    asm volatile ("rdtsc" : "=a" (eax), "=d" (edx));
+    return ((uint64_t)edx << 32) | eax;
+}
+
+void lockstat_acquired(struct lockstat_site_t *, lock_t *, uint64_t, int);
+void lockstat_release(lock_t *);
+
+#define lockstat_site_here(LOCK) \
+    static struct lockstat_site_t __lockstat_site = { \
+        .lockname = #LOCK, .file = __FILE__, .func = __func__, .line = __LINE__ \
+    }
+
 #define spinlock_acquire(LOCK) ({ \
-    asm volatile ( \
-        "1: " \
-        "lock btr %0, 0;" \
-        "jc 2f;" \
-        "pause;" \
-        "jmp 1b;" \
-        "2: " \
-        : "+m" ((LOCK)->lock) \
-        : \
-        : "memory", "cc" \
-    ); \
+    lockstat_site_here(LOCK); \
+    uint64_t __lockstat_start = lockstat_tsc(); \
+    int __lockstat_contended = !__spinlock_test_and_acquire(LOCK); \
+    if (__lockstat_contended) \
+        __spinlock_acquire(LOCK); \
+    lockstat_acquired(&__lockstat_site, (LOCK), __lockstat_start, __lockstat_contended); \
 })
 
 #define spinlock_test_and_acquire(LOCK) ({ \
-    int ret; \
-    asm volatile ( \
-        "lock btr %0, 0;" \
-        : "+m" ((LOCK)->lock), "=@ccc" (ret) \
-        : \
-        : "memory" \
-    ); \
-    ret; \
+    lockstat_site_here(LOCK); \
+    int __lockstat_ret = __spinlock_test_and_acquire(LOCK); \
+    if (__lockstat_ret) \
+        lockstat_acquired(&__lockstat_site, (LOCK), lockstat_tsc(), 0); \
+    __lockstat_ret; \
 })
 
-#endif /* _DEBUG_ */
+#else /* _LOCKSTAT_ */
+
+#define spinlock_acquire(LOCK) __spinlock_acquire(LOCK)
+#define spinlock_test_and_acquire(LOCK) __spinlock_test_and_acquire(LOCK)
+
+#endif /* _LOCKSTAT_ */
 
 __attribute__((always_inline)) __attribute__((unused)) static inline void spinlock_release(lock_t *lock) {
+#ifdef _LOCKSTAT_
+    lockstat_release(lock);
+#endif
     asm volatile (
-        "lock bts %0, 0;"
-        : "+m" (lock->lock)
+        "lock inc %0;"
+        : "+m" (lock->owner)
         :
         : "memory", "cc"
     );
 }
 
+/* Reader-writer spinlock for read-mostly data. Readers share the lock,
+ * writers take it exclusively. A waiting writer holds new readers off, so
+ * a steady stream of them cannot starve it, which also means a reader must
+ * not take the lock again while it holds it. A zeroed rwlock_t is free. */
+
+#define RWLOCK_WRITER  1
+#define RWLOCK_WAITING 2
+#define RWLOCK_READER  4
+
+typedef struct {
+    uint32_t state;
+} rwlock_t;
+
+#define new_rwlock (rwlock_t){ .state = 0 }
+
+void rwlock_acquire_read(rwlock_t *);
+void rwlock_acquire_write(rwlock_t *);
+
+__attribute__((always_inline)) __attribute__((unused)) static inline void rwlock_release_read(rwlock_t *rwlock) {
+    asm volatile (
+        "lock sub %0, %1;"
+        : "+m" (rwlock->state)
+        : "i" (RWLOCK_READER)
+        : "memory", "cc"
+    );
+}
+
+__attribute__((always_inline)) __attribute__((unused)) static inline void rwlock_release_write(rwlock_t *rwlock) {
+    asm volatile (
+        "lock and %0, %1;"
+        : "+m" (rwlock->state)
+        : "i" (~RWLOCK_WRITER)
+        : "memory", "cc"
+    );
+}
+
+/* Sequence lock for small pieces of plain data which are read far more
+ * often than written. Writers serialise on the spinlock and make the
+ * sequence odd while they work, readers copy the data out without writing
+ * to shared memory and retry if the sequence moved:
+ *
+ *     do {
+ *         seq = seqlock_read_begin(&lock);
+ *         copy = data;
+ *     } while (seqlock_read_retry(&lock, seq));
+ *
+ * Readers may see torn data before retrying, so they must not follow
+ * pointers out of it. A zeroed seqlock_t is free. */
+
+typedef struct {
+    uint32_t seq;
+    lock_t lock;
+} seqlock_t;
+
+#define new_seqlock (seqlock_t){ .seq = 0 }
+
+__attribute__((unused)) static inline void seqlock_write_begin(seqlock_t *seqlock) {
+    spinlock_acquire(&seqlock->lock);
+    *(volatile uint32_t *)&seqlock->seq = seqlock->seq + 1;
+    asm volatile ("" ::: "memory");
+}
+
+__attribute__((unused)) static inline void seqlock_write_end(seqlock_t *seqlock) {
+    asm volatile ("" ::: "memory");
+    *(volatile uint32_t *)&seqlock->seq = seqlock->seq + 1;
+    spinlock_release(&seqlock->lock);
+}
+
+__attribute__((unused)) static inline uint32_t seqlock_read_begin(seqlock_t *seqlock) {
+    uint32_t seq;
+    while ((seq = *(volatile uint32_t *)&seqlock->seq) & 1)
+        asm volatile ("pause" ::: "memory");
+    asm volatile ("" ::: "memory");
+    return seq;
+}
+
+/* x86 keeps loads in order, a compiler barrier is all readers need */
+__attribute__((unused)) static inline int seqlock_read_retry(seqlock_t *seqlock, uint32_t seq) {
+    asm volatile ("" ::: "memory");
+    return *(volatile uint32_t *)&seqlock->seq != seq;
+}
+
 #endif
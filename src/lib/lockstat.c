@@ -0,0 +1,153 @@
+#ifdef _LOCKSTAT_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <lib/lock.h>
+#include <lib/lockstat.h>
+#include <lib/klib.h>
+
+/* Every spinlock_acquire() and spinlock_test_and_acquire() call site owns a
+ * static struct lockstat_site_t. It gets pushed onto this list the first
+ * time it takes its lock and never leaves it, so readers can walk the list
+ * without a lock. All counters are updated with atomic adds, a lock here
+ * would end up counting itself. */
+static struct lockstat_site_t *lockstat_sites = NULL;
+
+static inline int lockstat_cmpxchg(uint64_t *p, uint64_t old, uint64_t new) {
+    int ret;
+    asm volatile (
+        "lock cmpxchg %1, %3;"
+        : "=@ccz" (ret), "+m" (*p), "+a" (old)
+        : "r" (new)
+        : "memory"
+    );
+    return ret;
+}
+
+static inline void lockstat_max(uint64_t *p, uint64_t x) {
+    uint64_t cur;
+    while ((cur = *(volatile uint64_t *)p) < x) {
+        if (lockstat_cmpxchg(p, cur, x))
+            break;
+    }
+}
+
+static void lockstat_register(struct lockstat_site_t *site) {
+    if (locked_write(int, &site->registered, 1))
+        return;
+
+    struct lockstat_site_t *head;
+    do {
+        head = locked_read(struct lockstat_site_t *, &lockstat_sites);
+        site->next = head;
+    } while (!lockstat_cmpxchg((uint64_t *)&lockstat_sites,
+                               (uint64_t)head, (uint64_t)site));
+}
+
+/* Called by spinlock_acquire() and spinlock_test_and_acquire() with the lock
+ * just taken. start is the TSC read before the first attempt. */
+void lockstat_acquired(struct lockstat_site_t *site, lock_t *lock,
+                       uint64_t start, int contended) {
+    uint64_t now = lockstat_tsc();
+
+    if (!site->registered)
+        lockstat_register(site);
+
+    atomic_add_uint64_relaxed(&site->acquisitions, 1);
+    if (contended) {
+        atomic_add_uint64_relaxed(&site->contended, 1);
+        atomic_add_uint64_relaxed(&site->spin_cycles, now - start);
+        lockstat_max(&site->max_spin_cycles, now - start);
+    }
+
+    lock->lockstat_site = site;
+    lock->lockstat_acquired_at = now;
+}
+
+/* Called by spinlock_release() before the lock is dropped. Locks released
+ * from assembly skip this, their next acquisition overwrites the site. */
+void lockstat_release(lock_t *lock) {
+    struct lockstat_site_t *site = lock->lockstat_site;
+    if (!site)
+        return;
+    lock->lockstat_site = NULL;
+
+    uint64_t held = lockstat_tsc() - lock->lockstat_acquired_at;
+    atomic_add_uint64_relaxed(&site->hold_cycles, held);
+    lockstat_max(&site->max_hold_cycles, held);
+}
+
+static void lockstat_puts(char *buf, size_t len, size_t *i, const char *str) {
+    for (; *str; str++, (*i)++) {
+        if (*i < len)
+            buf[*i] = *str;
+    }
+}
+
+static void lockstat_putu(char *buf, size_t len, size_t *i, uint64_t x) {
+    char num[21];
+    int j = 20;
+
+    num[j] = 0;
+    do {
+        num[--j] = x % 10 + '0';
+        x /= 10;
+    } while (x);
+
+    lockstat_puts(buf, len, i, num + j);
+}
+
+/* Write the statistics of every site out as text, one site per line, into
+ * buf. Returns the length of the whole text, which may exceed len, in which
+ * case only the first len bytes were written. The output is not NUL
+ * terminated. */
+size_t lockstat_render(char *buf, size_t len) {
+    size_t i = 0;
+
+    lockstat_puts(buf, len, &i,
+        "lock function file:line acquisitions contended "
+        "spin_cycles max_spin_cycles hold_cycles max_hold_cycles\n");
+
+    for (struct lockstat_site_t *site =
+            locked_read(struct lockstat_site_t *, &lockstat_sites);
+         site; site = site->next) {
+        lockstat_puts(buf, len, &i, site->lockname);
+        lockstat_puts(buf, len, &i, " ");
+        lockstat_puts(buf, len, &i, site->func);
+        lockstat_puts(buf, len, &i, " ");
+        lockstat_puts(buf, len, &i, site->file);
+        lockstat_puts(buf, len, &i, ":");
+        lockstat_putu(buf, len, &i, site->line);
+        lockstat_puts(buf, len, &i, " ");
+        lockstat_putu(buf, len, &i, site->acquisitions);
+        lockstat_puts(buf, len, &i, " ");
+        lockstat_putu(buf, len, &i, site->contended);
+        lockstat_puts(buf, len, &i, " ");
+        lockstat_putu(buf, len, &i, site->spin_cycles);
+        lockstat_puts(buf, len, &i, " ");
+        lockstat_putu(buf, len, &i, site->max_spin_cycles);
+        lockstat_puts(buf, len, &i, " ");
+        lockstat_putu(buf, len, &i, site->hold_cycles);
+        lockstat_puts(buf, len, &i, " ");
+        lockstat_putu(buf, len, &i, site->max_hold_cycles);
+        lockstat_puts(buf, len, &i, "\n");
+    }
+
+    return i;
+}
+
+/* Zero the counters of every site. Updates racing with this may survive. */
+void lockstat_reset(void) {
+    for (struct lockstat_site_t *site =
+            locked_read(struct lockstat_site_t *, &lockstat_sites);
+         site; site = site->next) {
+        locked_write(uint64_t, &site->acquisitions, 0);
+        locked_write(uint64_t, &site->contended, 0);
+        locked_write(uint64_t, &site->spin_cycles, 0);
+        locked_write(uint64_t, &site->max_spin_cycles, 0);
+        locked_write(uint64_t, &site->hold_cycles, 0);
+        locked_write(uint64_t, &site->max_hold_cycles, 0);
+    }
+}
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef __LOCKSTAT_H__
+#define __LOCKSTAT_H__
+
+#ifdef _LOCKSTAT_
+
+#include <stddef.h>
+
+size_t lockstat_render(char *, size_t);
+void lockstat_reset(void);
+
+#endif
+
+#endif
@@ -0,0 +1,118 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <lib/mutex.h>
+#include <lib/lock.h>
+#include <proc/task.h>
+#include <sys/cpu.h>
+
+/* Attempts mutex_lock() makes before going to sleep */
+#define MUTEX_SPINS 1000
+
+/* Sleeping threads are queued in FIFO order through nodes living on their
+ * own stacks. mutex_unlock() hands the mutex straight over to the first of
+ * them, so `locked` never drops to 0 while anyone is queued and newcomers
+ * cannot barge in ahead of the sleepers. */
+
+struct mutex_waiter_t {
+    struct thread_t *thread;
+    /* Set once the mutex got handed over to us */
+    int woken;
+    struct mutex_waiter_t *next;
+};
+
+/* Returns 1 if the mutex got taken */
+int mutex_trylock(mutex_t *mutex) {
+    return !locked_write(int, &mutex->locked, 1);
+}
+
+/* Checked under the queue lock, so that a handover is either seen here or
+ * comes after the call */
+static int mutex_waiter_woken(mutex_t *mutex, struct mutex_waiter_t *waiter) {
+    spinlock_acquire(&mutex->lock);
+    int woken = waiter->woken;
+    spinlock_release(&mutex->lock);
+    return woken;
+}
+
+static void mutex_lock_slow(mutex_t *mutex) {
+    struct mutex_waiter_t waiter;
+
+    sched_lock();
+    tid_t current_task = CURRENT_TASK;
+    struct thread_t *thread = current_task == -1 ? NULL : task_table[current_task];
+    sched_unlock();
+
+    /* Nothing to put to sleep before the scheduler runs */
+    if (!thread) {
+        while (!mutex_trylock(mutex))
+            asm volatile ("pause" ::: "memory");
+        return;
+    }
+
+    waiter.thread = thread;
+    waiter.woken = 0;
+    waiter.next = NULL;
+
+    spinlock_acquire(&mutex->lock);
+    if (mutex_trylock(mutex)) {
+        spinlock_release(&mutex->lock);
+        return;
+    }
+    if (mutex->tail)
+        mutex->tail->next = &waiter;
+    else
+        mutex->head = &waiter;
+    mutex->tail = &waiter;
+    spinlock_release(&mutex->lock);
+
+    for (;;) {
+        /* Holding scheduler_lock keeps us from being switched out between
+         * blocking and rescheduling */
+        sched_lock();
+
+        task_block(thread);
+
+        /* Unlike events, a mutex wait cannot be aborted. task_tkill() waits
+         * for us to leave the syscall anyway. */
+        if (mutex_waiter_woken(mutex, &waiter)) {
+            sched_unlock();
+            task_wake(thread);
+            return;
+        }
+
+        force_resched();
+
+        task_wake(thread);
+    }
+}
+
+void mutex_lock(mutex_t *mutex) {
+    for (int i = 0; i < MUTEX_SPINS; i++) {
+        if (!*(volatile int *)&mutex->locked && mutex_trylock(mutex))
+            return;
+        asm volatile ("pause" ::: "memory");
+    }
+
+    mutex_lock_slow(mutex);
+}
+
+void mutex_unlock(mutex_t *mutex) {
+    spinlock_acquire(&mutex->lock);
+
+    struct mutex_waiter_t *waiter = mutex->head;
+    if (!waiter) {
+        locked_write(int, &mutex->locked, 0);
+        spinlock_release(&mutex->lock);
+        return;
+    }
+
+    mutex->head = waiter->next;
+    if (!mutex->head)
+        mutex->tail = NULL;
+
+    /* The mutex stays locked, it now belongs to the waiter */
+    task_wake(waiter->thread);
+    waiter->woken = 1;
+
+    spinlock_release(&mutex->lock);
+}
@@ -0,0 +1,28 @@
+#ifndef __MUTEX_H__
+#define __MUTEX_H__
+
+#include <stddef.h>
+#include <lib/lock.h>
+
+struct mutex_waiter_t;
+
+/* Sleeping lock for critical sections which can take long, such as ones
+ * doing device I/O. Contenders spin for a short while, then sleep until the
+ * holder hands the mutex over to them. Not usable from interrupt context or
+ * with scheduler_lock held. */
+typedef struct {
+    int locked;
+    /* Protects the wait queue */
+    lock_t lock;
+    struct mutex_waiter_t *head;
+    struct mutex_waiter_t *tail;
+} mutex_t;
+
+/* A zeroed lock_t is free, which keeps this usable as a static initialiser */
+#define new_mutex (mutex_t){ .locked = 0, .head = NULL, .tail = NULL }
+
+int mutex_trylock(mutex_t *);
+void mutex_lock(mutex_t *);
+void mutex_unlock(mutex_t *);
+
+#endif
@@ -1,10 +1,14 @@
 #ifndef __RB_TREE_H__
 #define __RB_TREE_H__
 
-#include <lib/alloc.h>
 #include <stddef.h>
 #include <stdint.h>
 
+/* Intrusive red-black tree. Nodes are embedded in the objects they order and
+ * are never allocated, copied or freed by the tree, so a node keeps its
+ * identity for as long as it is linked. Use rb_entry() to get back to the
+ * containing object. */
+
 enum rb_color { RB_COLOR_BLACK, RB_COLOR_RED };
 
 struct rb_node {
@@ -13,13 +17,17 @@ struct rb_node {
     enum rb_color color;
 };
 
+/* Returns -1, 0 or 1 if the first node orders before, equal to or after the
+ * second one */
 typedef int (*rb_comp)(struct rb_node *, struct rb_node *, void *);
 
 struct rb_root {
     struct rb_node *root;
-    size_t node_size;
 };
 
+#define rb_entry(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
 static inline struct rb_node *rb_get_par(struct rb_node *node) {
     if (node == NULL) {
         return NULL;
@@ -44,14 +52,10 @@ static inline void rb_set_desc(struct rb_node *node, int pos,
                                struct rb_node *desc) {
     if (node != NULL) {
         node->desc[pos] = desc;
-        rb_set_par(rb_get_desc(node, pos), node);
+        rb_set_par(desc, node);
     }
 }
 
-static inline struct rb_node *rb_get_gpar(struct rb_node *node) {
-    return rb_get_par(rb_get_par(node));
-}
-
 static inline enum rb_color rb_get_color(struct rb_node *node) {
     if (node == NULL) {
         return RB_COLOR_BLACK;
@@ -69,219 +73,214 @@ static inline int rb_get_pos(struct rb_node *node) {
     return rb_get_desc(rb_get_par(node), 1) == node;
 }
 
-static inline struct rb_node *rb_get_sib(struct rb_node *node) {
-    return rb_get_desc(rb_get_par(node), 1 - rb_get_pos(node));
-}
-
-static inline struct rb_node *rb_get_unc(struct rb_node *node) {
-    return rb_get_sib(rb_get_par(node));
+/* Put `new` where `old` hangs from its parent, or at the root */
+static inline void rb_replace_child(struct rb_root *tree, struct rb_node *old,
+                                    struct rb_node *new) {
+    struct rb_node *par = rb_get_par(old);
+    if (par == NULL) {
+        tree->root = new;
+        rb_set_par(new, NULL);
+    } else {
+        rb_set_desc(par, par->desc[1] == old, new);
+    }
 }
 
-static inline void *rb_rotate(struct rb_node *root, int direction,
-                              struct rb_root *tree) {
-    int root_pos = rb_get_pos(root);
-    struct rb_node *root_parent = rb_get_par(root);
+/* Rotate `root` down in `direction`, its child on the other side takes its
+ * place */
+static inline void rb_rotate(struct rb_node *root, int direction,
+                             struct rb_root *tree) {
     struct rb_node *new_root = rb_get_desc(root, 1 - direction);
     struct rb_node *middle = rb_get_desc(new_root, direction);
+    rb_replace_child(tree, root, new_root);
     rb_set_desc(root, 1 - direction, middle);
     rb_set_desc(new_root, direction, root);
-    if (root_parent != NULL) {
-        rb_set_desc(root_parent, root_pos, new_root);
-    } else {
-        tree->root = new_root;
-        rb_set_color(new_root, RB_COLOR_BLACK);
-        rb_set_par(new_root, NULL);
-    }
 }
 
-static inline void rb_fix_insertion(struct rb_node *node,
-                                    struct rb_root *root) {
-    if (node == NULL) {
-        return;
-    }
-    if (rb_get_color(rb_get_par(node)) == RB_COLOR_BLACK) {
-        return;
-    }
-    struct rb_node *uncle = rb_get_unc(node);
-    struct rb_node *par = rb_get_par(node);
-    struct rb_node *gpar = rb_get_par(par);
-    int node_pos = rb_get_pos(node);
-    if (rb_get_color(uncle) == RB_COLOR_BLACK) {
-        // black uncle
-        if (rb_get_pos(par) == node_pos) {
-            // line
-            rb_rotate(gpar, 1 - node_pos, root);
-            rb_set_color(gpar, RB_COLOR_RED);
+static inline void rb_fix_insertion(struct rb_root *tree,
+                                    struct rb_node *node) {
+    for (;;) {
+        struct rb_node *par = rb_get_par(node);
+        if (rb_get_color(par) == RB_COLOR_BLACK) {
+            break;
+        }
+        /* A red parent is never the root, so the grandparent exists */
+        struct rb_node *gpar = rb_get_par(par);
+        int par_pos = rb_get_pos(par);
+        struct rb_node *uncle = rb_get_desc(gpar, 1 - par_pos);
+        if (rb_get_color(uncle) == RB_COLOR_RED) {
+            // red uncle, push the blackness down and go up
             rb_set_color(par, RB_COLOR_BLACK);
-        } else {
-            // triangle
-            rb_rotate(par, 1 - node_pos, root);
-            rb_rotate(gpar, node_pos, root);
+            rb_set_color(uncle, RB_COLOR_BLACK);
             rb_set_color(gpar, RB_COLOR_RED);
-            rb_set_color(node, RB_COLOR_BLACK);
+            node = gpar;
+            continue;
         }
-    } else {
-        // red uncle
+        if (rb_get_pos(node) != par_pos) {
+            // triangle, turn it into a line
+            rb_rotate(par, par_pos, tree);
+            node = par;
+            par = rb_get_par(node);
+        }
+        // line
+        rb_rotate(gpar, 1 - par_pos, tree);
         rb_set_color(par, RB_COLOR_BLACK);
-        rb_set_color(uncle, RB_COLOR_BLACK);
         rb_set_color(gpar, RB_COLOR_RED);
-        rb_fix_insertion(gpar, root);
+        break;
     }
+    rb_set_color(tree->root, RB_COLOR_BLACK);
 }
 
-// 0 - node is added already, 1 - new node added
-static inline int rb_insert(struct rb_root *root, rb_comp comp,
+// 0 - an equal node is in the tree already, 1 - new node added
+static inline int rb_insert(struct rb_root *tree, rb_comp comp,
                             void *comp_arg, struct rb_node *node) {
-    rb_set_desc(node, 0, NULL);
-    rb_set_desc(node, 1, NULL);
-    if (root->root == NULL) {
-        root->root = node;
-        rb_set_color(root->root, RB_COLOR_BLACK);
-        return 1;
-    }
-    struct rb_node *cur = root->root;
+    struct rb_node *par = NULL;
+    struct rb_node *cur = tree->root;
+    int pos = 0;
     while (cur != NULL) {
         int cmp = comp(node, cur, comp_arg);
         if (cmp == 0) {
             return 0;
         }
-        int pos = cmp == 1;
-        struct rb_node *next = rb_get_desc(cur, pos);
-        if (next == NULL) {
-            rb_set_desc(cur, pos, node);
-            rb_set_color(node, RB_COLOR_RED);
-            break;
-        }
-        cur = next;
+        pos = cmp == 1;
+        par = cur;
+        cur = rb_get_desc(cur, pos);
     }
-    rb_fix_insertion(node, root);
-    rb_set_color(root->root, RB_COLOR_BLACK);
-    return 1;
-}
-
-static inline struct rb_node *rb_find_replacement(struct rb_node *node) {
-    node = rb_get_desc(node, 0);
-    struct rb_node *prev = node;
-    while (node != NULL) {
-        prev = node;
-        node = rb_get_desc(node, 1);
-    }
-    return prev;
-}
-
-static inline void rb_memswap(char *p1, char *p2, size_t size) {
-    if (size % 8 == 0) {
-        uint64_t *pl1 = (uint64_t *)p1;
-        uint64_t *pl2 = (uint64_t *)p2;
-        size_t count = size / 8;
-        for (size_t i = 0; i < count; ++i) {
-            uint64_t tmp = *pl1;
-            *pl1 = *pl2;
-            *pl2 = tmp;
-        }
+    node->desc[0] = NULL;
+    node->desc[1] = NULL;
+    node->color = RB_COLOR_RED;
+    if (par == NULL) {
+        tree->root = node;
+        node->anc = NULL;
     } else {
-        for (size_t i = 0; i < size; ++i) {
-            char tmp = *p1;
-            *p1 = *p2;
-            *p2 = tmp;
-        }
-    }
-}
-
-static inline void rb_swap_nodes_content(struct rb_node *node1,
-                                         struct rb_node *node2,
-                                         struct rb_root *root) {
-    char *content1 = (char *)(node1 + 1);
-    char *content2 = (char *)(node2 + 1);
-    size_t size = root->node_size - sizeof(struct rb_node);
-    rb_memswap(content1, content2, size);
-}
-
-static struct rb_node *rb_remove_internal_nodes(struct rb_root *root,
-                                                struct rb_node *node) {
-    if (rb_get_desc(node, 0) != NULL && rb_get_desc(node, 1) != NULL) {
-        struct rb_node *next = rb_find_replacement(node);
-        rb_swap_nodes_content(next, node, root);
-        return next;
+        rb_set_desc(par, pos, node);
     }
-    return node;
+    rb_fix_insertion(tree, node);
+    return 1;
 }
 
-static void rb_fix_double_black(struct rb_root *root, struct rb_node *node) {
-    if (rb_get_par(node) == NULL) {
-        return;
-    }
-    // red subling case
-    struct rb_node *par = rb_get_par(node);
-    struct rb_node *sib = rb_get_sib(node);
-    if (rb_get_color(sib) == RB_COLOR_RED) {
-        rb_rotate(par, rb_get_pos(node), root);
-        rb_set_color(sib, RB_COLOR_BLACK);
-        rb_set_color(par, RB_COLOR_RED);
-        sib = rb_get_sib(node);
-        // now the sibling will be black
-    }
-    // black sibling case
-    // if sibling's child are all black
-    if (rb_get_color(rb_get_desc(sib, 0)) == RB_COLOR_BLACK &&
-        rb_get_color(rb_get_desc(sib, 1)) == RB_COLOR_BLACK) {
-        if (rb_get_color(par) == RB_COLOR_RED) {
-            rb_set_color(par, RB_COLOR_BLACK);
+/* `node` is a black leaf which is about to lose one black from its path,
+ * rebalance around it */
+static inline void rb_fix_double_black(struct rb_root *tree,
+                                       struct rb_node *node) {
+    while (rb_get_par(node) != NULL) {
+        struct rb_node *par = rb_get_par(node);
+        int pos = rb_get_pos(node);
+        struct rb_node *sib = rb_get_desc(par, 1 - pos);
+        // red sibling case, make it black
+        if (rb_get_color(sib) == RB_COLOR_RED) {
+            rb_rotate(par, pos, tree);
+            rb_set_color(sib, RB_COLOR_BLACK);
+            rb_set_color(par, RB_COLOR_RED);
+            sib = rb_get_desc(par, 1 - pos);
+        }
+        // black sibling with black children
+        if (rb_get_color(rb_get_desc(sib, 0)) == RB_COLOR_BLACK &&
+            rb_get_color(rb_get_desc(sib, 1)) == RB_COLOR_BLACK) {
             rb_set_color(sib, RB_COLOR_RED);
-        } else {
+            if (rb_get_color(par) == RB_COLOR_RED) {
+                rb_set_color(par, RB_COLOR_BLACK);
+                return;
+            }
+            node = par;
+            continue;
+        }
+        // black sibling with a red child, make sure the far one is red
+        if (rb_get_color(rb_get_desc(sib, 1 - pos)) == RB_COLOR_BLACK) {
+            rb_set_color(rb_get_desc(sib, pos), RB_COLOR_BLACK);
             rb_set_color(sib, RB_COLOR_RED);
-            rb_fix_double_black(root, par);
+            rb_rotate(sib, 1 - pos, tree);
+            sib = rb_get_desc(par, 1 - pos);
         }
+        rb_set_color(sib, rb_get_color(par));
+        rb_set_color(par, RB_COLOR_BLACK);
+        rb_set_color(rb_get_desc(sib, 1 - pos), RB_COLOR_BLACK);
+        rb_rotate(par, pos, tree);
         return;
     }
-    // visualizer preferred 1 instead of 0, so I used
-    // it to remain consistent
-    struct rb_node *red_nephew = rb_get_desc(sib, 1);
-    if (rb_get_color(red_nephew) == RB_COLOR_BLACK) {
-        red_nephew = rb_get_desc(sib, 0);
+}
+
+/* Swap the tree positions of a node with two children and its in-order
+ * predecessor, so that the node can be unlinked from there */
+static inline void rb_swap_with_predecessor(struct rb_root *tree,
+                                            struct rb_node *node) {
+    struct rb_node *pred = node->desc[0];
+    while (pred->desc[1] != NULL) {
+        pred = pred->desc[1];
     }
-    if (rb_get_pos(node) == rb_get_pos(red_nephew)) {
-        rb_rotate(sib, 1 - rb_get_pos(node), root);
-        rb_rotate(par, rb_get_pos(node), root);
-        rb_set_color(red_nephew, RB_COLOR_BLACK);
+
+    enum rb_color color = node->color;
+    node->color = pred->color;
+    pred->color = color;
+
+    struct rb_node *node_right = node->desc[1];
+    struct rb_node *pred_left = pred->desc[0];
+
+    if (pred == node->desc[0]) {
+        rb_replace_child(tree, node, pred);
+        rb_set_desc(pred, 0, node);
     } else {
-        rb_rotate(par, rb_get_pos(node), root);
-        rb_set_color(red_nephew, RB_COLOR_BLACK);
+        struct rb_node *pred_par = pred->anc;
+        rb_replace_child(tree, node, pred);
+        rb_set_desc(pred, 0, node->desc[0]);
+        rb_set_desc(pred_par, 1, node);
     }
+    rb_set_desc(pred, 1, node_right);
+    rb_set_desc(node, 0, pred_left);
+    node->desc[1] = NULL;
 }
 
-// 0 - there is no such node, 1 - node deleted
-static inline void rb_delete(struct rb_root *root, struct rb_node *node) {
+static inline void rb_delete(struct rb_root *tree, struct rb_node *node) {
     // handle case with internal node
-    node = rb_remove_internal_nodes(root, node);
+    if (node->desc[0] != NULL && node->desc[1] != NULL) {
+        rb_swap_with_predecessor(tree, node);
+    }
     // get node's child
-    struct rb_node *chld = rb_get_desc(node, 0);
+    struct rb_node *chld = node->desc[0];
     if (chld == NULL) {
-        chld = rb_get_desc(node, 1);
+        chld = node->desc[1];
     }
     // if it is a single-child parent, it must be black
     if (chld != NULL) {
-        rb_set_desc(rb_get_par(node), rb_get_pos(node), chld);
+        rb_replace_child(tree, node, chld);
         rb_set_color(chld, RB_COLOR_BLACK);
-        kfree(node);
         return;
     }
-    // if node to be deleted is a red leaf, remove leaf, done
-    if (chld == NULL && rb_get_color(node) == RB_COLOR_RED) {
-        rb_set_desc(rb_get_par(node), rb_get_pos(node), NULL);
-        kfree(node);
-        return;
+    // a black leaf leaves its path one black short
+    if (node->color == RB_COLOR_BLACK) {
+        rb_fix_double_black(tree, node);
+    }
+    rb_replace_child(tree, node, NULL);
+}
+
+static inline struct rb_node *rb_first(struct rb_root *tree) {
+    struct rb_node *node = tree->root;
+    if (node == NULL) {
+        return NULL;
     }
-    // now node is nothing but black leaf
-    rb_fix_double_black(root, node);
-    rb_set_desc(rb_get_par(node), rb_get_pos(node), NULL);
-    kfree(node);
+    while (node->desc[0] != NULL) {
+        node = node->desc[0];
+    }
+    return node;
+}
+
+static inline struct rb_node *rb_next(struct rb_node *node) {
+    if (node->desc[1] != NULL) {
+        node = node->desc[1];
+        while (node->desc[0] != NULL) {
+            node = node->desc[0];
+        }
+        return node;
+    }
+    while (rb_get_par(node) != NULL && rb_get_pos(node) == 1) {
+        node = node->anc;
+    }
+    return node->anc;
 }
 
-static inline struct rb_node *rb_query(struct rb_root *root,
+static inline struct rb_node *rb_query(struct rb_root *tree,
                                        struct rb_node *node, rb_comp comp,
                                        void *comp_arg) {
-    struct rb_node *current = root->root;
+    struct rb_node *current = tree->root;
     while (current != NULL) {
         int cmp = comp(node, current, comp_arg);
         int pos = cmp == 1;
@@ -294,4 +293,4 @@ static inline struct rb_node *rb_query(struct rb_root *root,
     return NULL;
 }
 
-#endif
\ No newline at end of file
+#endif
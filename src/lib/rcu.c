@@ -0,0 +1,96 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <lib/rcu.h>
+#include <lib/lock.h>
+#include <lib/mutex.h>
+#include <lib/alloc.h>
+#include <proc/task.h>
+#include <sys/cpu.h>
+#include <sys/smp.h>
+
+/* How often rcu_reclaim_worker() frees what rcu_free() got, in ms */
+#define RCU_RECLAIM_INTERVAL 100
+
+int rcu_epoch = 0;
+
+/* Serialises grace periods */
+static mutex_t rcu_gp_mutex = new_mutex;
+
+static lock_t rcu_free_lock = new_lock;
+static struct rcu_head_t *rcu_free_list = NULL;
+
+/* Whether every reader which picked idx has left its section. Exits are
+ * summed before entries, so a reader entering on one CPU and leaving on
+ * another cannot make the sums match early. */
+static int rcu_readers_gone(int idx) {
+    int cpus = smp_ready ? smp_cpu_count : 1;
+    uint64_t unlocks = 0;
+    uint64_t locks = 0;
+
+    for (int i = 0; i < cpus; i++)
+        unlocks += *(volatile uint64_t *)&cpu_locals[i].rcu_unlocks[idx];
+
+    asm volatile ("mfence" ::: "memory");
+
+    for (int i = 0; i < cpus; i++)
+        locks += *(volatile uint64_t *)&cpu_locals[i].rcu_locks[idx];
+
+    return locks == unlocks;
+}
+
+/* Wait for every read side section running at the time of the call to end.
+ * Readers which come in later may have picked the old index, but they can
+ * only see what got published since, so they are of no concern. Flipping
+ * twice catches readers that are still in a section using the other index,
+ * which they picked before the previous grace period. */
+void rcu_synchronize(void) {
+    mutex_lock(&rcu_gp_mutex);
+
+    for (int i = 0; i < 2; i++) {
+        int idx = locked_read(int, &rcu_epoch) & 1;
+        locked_inc(&rcu_epoch);
+        while (!rcu_readers_gone(idx))
+            yield();
+    }
+
+    mutex_unlock(&rcu_gp_mutex);
+}
+
+/* kfree() ptr once no reader can see it anymore. The caller must have
+ * unpublished it already. head is the rcu_head_t embedded in it. Never
+ * blocks, so it is fine to call with spinlocks held. */
+void rcu_free(void *ptr, struct rcu_head_t *head) {
+    head->ptr = ptr;
+
+    spinlock_acquire(&rcu_free_lock);
+    head->next = rcu_free_list;
+    rcu_free_list = head;
+    spinlock_release(&rcu_free_lock);
+}
+
+void rcu_reclaim_worker(void *arg) {
+    (void)arg;
+
+    task_pin_kworker();
+
+    for (;;) {
+        relaxed_sleep(RCU_RECLAIM_INTERVAL);
+
+        spinlock_acquire(&rcu_free_lock);
+        struct rcu_head_t *list = rcu_free_list;
+        rcu_free_list = NULL;
+        spinlock_release(&rcu_free_lock);
+
+        if (!list)
+            continue;
+
+        rcu_synchronize();
+
+        /* The heads live in what gets freed */
+        while (list) {
+            struct rcu_head_t *next = list->next;
+            kfree(list->ptr);
+            list = next;
+        }
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef __RCU_H__
+#define __RCU_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <lib/lock.h>
+#include <sys/cpu.h>
+#include <sys/smp.h>
+
+/* Read-copy-update. Readers walk shared data without taking any lock and
+ * writers defer freeing what they unpublished until every reader which may
+ * still see it is gone.
+ * Readers are counted per CPU in two sets of counters, the index of the set
+ * to use flips on every grace period. A reader may get migrated in the
+ * middle of its section, so it bumps separate counters on the way in and
+ * out, and only their sums over all CPUs are meaningful. Sections must not
+ * sleep or wait for a grace period themselves. */
+
+extern int rcu_epoch;
+
+static inline int rcu_read_lock(void) {
+    int idx = *(volatile int *)&rcu_epoch & 1;
+    /* Locked, so that none of the section's loads happen before this */
+    locked_inc(&cpu_locals[smp_ready ? current_cpu : 0].rcu_locks[idx]);
+    return idx;
+}
+
+static inline void rcu_read_unlock(int idx) {
+    locked_inc(&cpu_locals[smp_ready ? current_cpu : 0].rcu_unlocks[idx]);
+}
+
+/* Load a pointer readers are allowed to follow */
+#define rcu_dereference(p) (*(volatile typeof(p) *)&(p))
+
+/* Entry of the queue rcu_free() adds to. It is embedded in the object to
+ * free, so queueing never allocates. Readers must not touch it. */
+struct rcu_head_t {
+    void *ptr;
+    struct rcu_head_t *next;
+};
+
+void rcu_synchronize(void);
+void rcu_free(void *, struct rcu_head_t *);
+void rcu_reclaim_worker(void *);
+
+#endif
@@ -4,6 +4,7 @@
 #include <lib/cmem.h>
 #include <lib/dynarray.h>
 #include <lib/klib.h>
+#include <lib/mutex.h>
 #include <lib/part.h>
 #include <lib/scsi.h>
 
@@ -20,7 +21,7 @@ struct cached_block_t {
     int status;
 };
 
-lock_t scsi_lock;
+mutex_t scsi_lock;
 struct scsi_dev_t {
     int intern_fd;
     int (*send_cmd)(int, char *, size_t, char *, size_t, int);
@@ -120,7 +121,7 @@ static int scsi_read(int drive, void *buf, uint64_t loc, size_t count) {
     uint64_t progress = 0;
     struct scsi_dev_t *device =
         dynarray_getelem(struct scsi_dev_t, devices, drive);
-    spinlock_acquire(&scsi_lock);
+    mutex_lock(&scsi_lock);
 
     while (progress < count) {
         // cache the block
@@ -129,7 +130,7 @@ static int scsi_read(int drive, void *buf, uint64_t loc, size_t count) {
         if (slot == -1) {
             slot = cache_block(device, sect);
             if (slot == -1) {
-                spinlock_release(&scsi_lock);
+                mutex_unlock(&scsi_lock);
                 return -1;
             }
         }
@@ -142,7 +143,7 @@ static int scsi_read(int drive, void *buf, uint64_t loc, size_t count) {
         memcpy(buf + progress, (&device->cache[slot].cache[offset]), chunk);
         progress += chunk;
     }
-    spinlock_release(&scsi_lock);
+    mutex_unlock(&scsi_lock);
 
     return (int)count;
 }
@@ -151,7 +152,7 @@ static int scsi_write(int drive, const void *buf, uint64_t loc, size_t count) {
     uint64_t progress = 0;
     struct scsi_dev_t *device =
         dynarray_getelem(struct scsi_dev_t, devices, drive);
-    spinlock_acquire(&scsi_lock);
+    mutex_lock(&scsi_lock);
 
     while (progress < count) {
         // cache the block
@@ -160,7 +161,7 @@ static int scsi_write(int drive, const void *buf, uint64_t loc, size_t count) {
         if (slot == -1) {
             slot = cache_block(device, sect);
             if (slot == -1) {
-                spinlock_release(&scsi_lock);
+                mutex_unlock(&scsi_lock);
                 return -1;
             }
         }
@@ -174,7 +175,7 @@ static int scsi_write(int drive, const void *buf, uint64_t loc, size_t count) {
         device->cache[slot].status = CACHE_DIRTY;
         progress += chunk;
     }
-    spinlock_release(&scsi_lock);
+    mutex_unlock(&scsi_lock);
 
     return (int)count;
 }
@@ -182,7 +183,7 @@ static int scsi_write(int drive, const void *buf, uint64_t loc, size_t count) {
 static int scsi_flush_cache(int drive) {
     struct scsi_dev_t *device =
         dynarray_getelem(struct scsi_dev_t, devices, drive);
-    spinlock_acquire(&scsi_lock);
+    mutex_lock(&scsi_lock);
 
     for (size_t i = 0; i < MAX_CACHED_BLOCKS; i++) {
         if (device->cache[i].status == CACHE_DIRTY) {
@@ -190,14 +191,14 @@ static int scsi_flush_cache(int drive) {
                 scsi_internal_write(device, device->cache[i].cache,
                                     device->cache[i].block, CACHE_BLOCK_SIZE);
             if (ret == -1) {
-                spinlock_release(&scsi_lock);
+                mutex_unlock(&scsi_lock);
                 return -1;
             }
 
             device->cache[i].status = CACHE_READY;
         }
     }
-    spinlock_release(&scsi_lock);
+    mutex_unlock(&scsi_lock);
 
     return 0;
 }
@@ -208,7 +209,7 @@ int scsi_register(int intern_fd, char *name,
     device.intern_fd = intern_fd;
     device.send_cmd = send_cmd;
     device.lock = new_lock;
-    scsi_lock = new_lock;
+    scsi_lock = new_mutex;
 
     kprint(KPRN_INFO, "SCSI INIT");
     /* read in block size */
@@ -2,26 +2,34 @@
 #include <stddef.h>
 #include <lib/time.h>
 #include <sys/pit.h>
+#include <sys/hpet.h>
 
+/* PIT ticks, only counted if there is no HPET */
 volatile uint64_t uptime_raw = 0;
-volatile uint64_t uptime_sec = 0;
-volatile uint64_t unix_epoch = 0;
+/* Unix time at boot, the realtime clock runs off the uptime clock */
+uint64_t boot_epoch = 0;
 
 void tick_handler(void) {
-    if (!(++uptime_raw % PIT_FREQUENCY_HZ)) {
-        uptime_sec++;
-        unix_epoch++;
-    }
+    uptime_raw++;
+}
+
+/* Nanoseconds since boot, at PIT tick granularity if there is no HPET */
+uint64_t get_uptime_ns(void) {
+    if (hpet_ready)
+        return hpet_get_ns();
+    return uptime_raw * (1000000000 / PIT_FREQUENCY_HZ);
+}
+
+uint64_t get_realtime_ns(void) {
+    return boot_epoch * 1000000000 + get_uptime_ns();
 }
 
 void ksleep(uint64_t time) {
     /* implements sleep in milliseconds */
 
-    uint64_t final_time = uptime_raw + (time * (PIT_FREQUENCY_HZ / 1000));
-
-    final_time++;
+    uint64_t final_time = get_uptime_ns() + time * 1000000;
 
-    while (uptime_raw < final_time);
+    while (get_uptime_ns() < final_time);
 }
 
 uint64_t get_jdn(int days, int months, int years) {
@@ -55,3 +63,12 @@ void add_usage(struct rusage_t *usage, struct rusage_t *to_add) {
     add_timeval(&usage->ru_stime, &to_add->ru_stime);
     add_timeval(&usage->ru_utime, &to_add->ru_utime);
 }
+
+/* Add user and system times given in nanoseconds */
+void add_usage_ns(struct rusage_t *usage, uint64_t utime, uint64_t stime) {
+    struct rusage_t to_add = {
+        .ru_utime = { utime / 1000000000, (utime % 1000000000) / 1000 },
+        .ru_stime = { stime / 1000000000, (stime % 1000000000) / 1000 }
+    };
+    add_usage(usage, &to_add);
+}
@@ -16,6 +16,8 @@ typedef int64_t clockid_t;
 #define CLOCK_MONOTONIC_COARSE 6
 #define CLOCK_BOOTTIME 7
 
+#define TIMER_ABSTIME 1
+
 struct timespec {
     time_t tv_sec;
     long tv_nsec;
@@ -29,19 +31,25 @@ struct timeval {
 #define RUSAGE_SELF 1
 #define RUSAGE_CHILDREN 2
 
+#define PRIO_PROCESS 0
+#define PRIO_PGRP 1
+#define PRIO_USER 2
+
 struct rusage_t {
     struct timeval ru_utime; /* user CPU time used */
     struct timeval ru_stime; /* system CPU time used */
 };
 
 extern volatile uint64_t uptime_raw;
-extern volatile uint64_t uptime_sec;
-extern volatile uint64_t unix_epoch;
+extern uint64_t boot_epoch;
 
+uint64_t get_uptime_ns(void);
+uint64_t get_realtime_ns(void);
 void ksleep(uint64_t);
 uint64_t get_jdn(int, int, int);
 uint64_t get_unix_epoch(int, int, int, int, int, int);
 void add_timeval(struct timeval *, struct timeval *);
 void add_usage(struct rusage_t *, struct rusage_t *);
+void add_usage_ns(struct rusage_t *, uint64_t, uint64_t);
 
 #endif
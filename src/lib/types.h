@@ -19,6 +19,11 @@ typedef int32_t tid_t;
 typedef int32_t uid_t;
 typedef int32_t gid_t;
 
-typedef int event_t;
+struct event_waiter_t;
+
+typedef struct {
+    int counter;
+    struct event_waiter_t *waiters;
+} event_t;
 
 #endif
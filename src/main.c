@@ -5,12 +5,15 @@
 #include <devices/display/vbe/vbe.h>
 #include <devices/term/tty/tty.h>
 #include <mm/mm.h>
+#include <lib/alloc.h>
 #include <sys/gdt.h>
 #include <sys/idt.h>
 #include <sys/pic.h>
 #include <acpi/acpi.h>
 #include <lib/cmdline.h>
 #include <sys/pit.h>
+#include <sys/hpet.h>
+#include <sys/apic.h>
 #include <sys/smp.h>
 #include <proc/task.h>
 #include <devices/dev.h>
@@ -24,6 +27,7 @@
 #include <devices/dev.h>
 #include <lib/rand.h>
 #include <sys/urm.h>
+#include <lib/rcu.h>
 #include <lib/cstring.h>
 #include <net/hostname.h>
 #include <startup/stivale.h>
@@ -34,6 +38,9 @@ void kmain_thread(void *arg) {
     /* Launch the urm */
     task_tcreate(0, tcreate_fn_call, tcreate_fn_call_data(0, userspace_request_monitor, 0));
 
+    /* Free what lock-free readers may have still been looking at */
+    task_tcreate(0, tcreate_fn_call, tcreate_fn_call_data(0, rcu_reclaim_worker, 0));
+
     /* Initialise file descriptor handlers */
     init_fd();
 
@@ -123,6 +130,7 @@ void kmain(struct stivale_struct_t *stivale) {
 
     /* Memory-related stuff */
     init_pmm(&(stivale->memmap));
+    init_alloc();
     init_rand();
     init_vmm(&(stivale->memmap));
 
@@ -132,16 +140,21 @@ void kmain(struct stivale_struct_t *stivale) {
     init_acpi();
     init_pic();
 
-    unix_epoch = stivale->epoch;
+    boot_epoch = stivale->epoch;
+
+    /* High resolution clock source for timers */
+    init_hpet();
 
-    /* Init the PIT */
-    init_pit();
+    /* Only keep time with the PIT if there is no HPET to read */
+    if (!hpet_ready)
+        init_pit();
 
     /* Initialise PCI */
     init_pci();
 
     /* Init Symmetric Multiprocessing */
     asm volatile ("sti":::"memory");
+    init_lapic_timer();
     init_smp();
     asm volatile ("cli":::"memory");
 
@@ -149,7 +162,7 @@ void kmain(struct stivale_struct_t *stivale) {
     init_sched();
 
     /* Unlock the scheduler for the first time */
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     /* Start a main kernel thread which will take over when the scheduler is running */
     task_tcreate(0, tcreate_fn_call, tcreate_fn_call_data(0, kmain_thread, 0));
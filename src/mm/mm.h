@@ -4,9 +4,12 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <lib/ht.h>
+#include <sys/cpu.h>
 #include <startup/stivale.h>
 
 #define PAGE_SIZE ((size_t)4096)
+#define PAGE_SIZE_2M ((size_t)0x200000)
+#define PAGE_SIZE_1G ((size_t)0x40000000)
 
 #define PAGE_TABLE_ENTRIES 512
 #define KERNEL_PHYS_OFFSET ((size_t)0xffffffff80000000)
@@ -27,25 +30,40 @@ struct pagemap_t {
     ht_new(struct page_attributes_t, page_attributes);
     pt_entry_t *pml4;
     lock_t lock;
+    /* PCID last assigned to this address space on each CPU, 0 if none */
+    uint16_t pcid[MAX_CPUS];
+    /* Bumped by every shootdown, CPUs holding a stale PCID flush it */
+    uint64_t tlb_gen;
 };
 
 extern struct pagemap_t *kernel_pagemap;
 
-void pmm_change_allocation_method(void);
-
-extern void *(*pmm_alloc)(size_t);
+void *pmm_alloc(size_t);
 void *pmm_allocz(size_t);
+void *pmm_try_alloc(size_t);
 void pmm_free(void *, size_t);
 void init_pmm(struct stivale_memmap_t *);
+void pmm_add_high_memory(struct stivale_memmap_t *);
+void pmm_ref_page(void *, size_t);
+void pmm_unref_page(void *, size_t);
+int pmm_page_shared(void *, size_t);
+void pmm_split_page(void *, size_t);
 
 int map_page(struct pagemap_t *, size_t, size_t, size_t);
+int map_huge_page(struct pagemap_t *, size_t, size_t, size_t, size_t);
+int map_range(struct pagemap_t *, size_t, size_t, size_t, size_t);
 int unmap_page(struct pagemap_t *, size_t);
+int unmap_range(struct pagemap_t *, size_t, size_t);
 int remap_page(struct pagemap_t *, size_t, size_t);
+int protect_range(struct pagemap_t *, size_t, size_t, size_t);
 void init_vmm(struct stivale_memmap_t *);
 
 struct pagemap_t *new_address_space(void);
 struct pagemap_t *fork_address_space(struct pagemap_t *);
 void free_address_space(struct pagemap_t *);
+int vmm_handle_cow_fault(struct pagemap_t *, size_t);
+int map_lazy_range(struct pagemap_t *, size_t, size_t, size_t);
+int vmm_handle_lazy_fault(struct pagemap_t *, size_t);
 
 struct memstats {
     size_t total;
@@ -54,4 +72,45 @@ struct memstats {
 
 int getmemstats(struct memstats *);
 
+struct pmm_cache_stats_t {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t refills;
+    uint64_t drains;
+};
+
+void pmm_get_cache_stats(struct pmm_cache_stats_t *);
+
+struct pmm_zero_stats_t {
+    /* Pages zeroed by idle CPUs, off the allocation path */
+    uint64_t zeroed_idle;
+    /* pmm_allocz(1) calls served from / missing the pool */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t pooled;
+    /* Current watermarks, see pmm_set_zero_watermarks() */
+    uint64_t low;
+    uint64_t high;
+};
+
+int pmm_zero_pool_refill(void);
+void pmm_set_zero_watermarks(size_t, size_t);
+void pmm_get_zero_stats(struct pmm_zero_stats_t *);
+
+/* Flush the whole address space instead of single pages */
+#define TLB_FLUSH_ALL ((size_t)-1)
+
+struct tlb_shootdown_stats_t {
+    /* Shootdown IPIs sent to other CPUs */
+    uint64_t ipis;
+    /* Pages invalidated remotely, and remote full flushes */
+    uint64_t pages;
+    uint64_t full_flushes;
+};
+
+size_t vmm_get_cr3(struct pagemap_t *);
+void tlb_shootdown(struct pagemap_t *, size_t, size_t);
+void tlb_shootdown_handler(void);
+void tlb_get_shootdown_stats(struct tlb_shootdown_stats_t *);
+
 #endif
@@ -3,204 +3,559 @@
 #include <mm/mm.h>
 #include <lib/klib.h>
 #include <lib/lock.h>
-#include <lib/bit.h>
+#include <lib/cio.h>
 #include <startup/stivale.h>
 #include <sys/panic.h>
+#include <sys/cpu.h>
+#include <sys/smp.h>
 
 #define MEMORY_BASE 0x1000000
-#define BITMAP_BASE (MEMORY_BASE / PAGE_SIZE)
 
-#define BMREALLOC_STEP 1
-
-static volatile uint32_t *mem_bitmap;
-static volatile uint32_t initial_bitmap[] = { 0xffffff7f };
-static volatile uint32_t *tmp_bitmap;
+/* Memory above this limit is not guaranteed to be mapped by the bootloader,
+ * so it is only handed to the allocator once the VMM has mapped it. */
+#define EARLY_MEMORY_LIMIT ((size_t)0x100000000)
+
+/* Blocks range from 1 page (order 0) to 2^(PMM_MAX_ORDER-1) pages */
+#define PMM_MAX_ORDER 20
+
+#define PAGE_NONE ((uint32_t)-1)
+
+#define PAGE_FREE (1 << 0)
+/* The frames of a huge page carry their own refcount */
+#define PAGE_SPLIT (1 << 1)
+
+/* Per physical page metadata. Only the first page of a free block is
+ * linked into a free list, and it records the order of the block.
+ * refcount counts the extra mappings of a page shared copy-on-write, huge
+ * pages are counted on their first page until some of their frames get
+ * mapped on their own. */
+struct page_t {
+    uint32_t next;
+    uint32_t prev;
+    uint8_t order;
+    uint8_t flags;
+    int refcount;
+};
+
+static struct page_t *page_frames;
+static size_t page_count = 0;
+
+static uint32_t free_lists[PMM_MAX_ORDER];
+
+static size_t total_pages = 0;
+static size_t free_pages = 0;
+
+/* A core wishing to modify the free lists must first acquire this lock,
+ * to ensure other cores cannot simultaneously modify them. It is always
+ * taken with interrupts disabled: the per-CPU caches take it from an
+ * interrupts-off section, and a thread preempted while holding it would
+ * leave such a section on the same CPU spinning forever. */
+static lock_t pmm_lock = new_lock;
 
-/* 32 entries because initial_bitmap is a single dword */
-static size_t bitmap_entries = 32;
+/* Single pages are served from a per-CPU cache which is refilled from and
+ * drained to the free lists PMM_CACHE_BATCH pages at a time, so that most
+ * order 0 allocations and frees never touch pmm_lock. */
+#define PMM_CACHE_BATCH 32
+#define PMM_CACHE_HIGH  128
+
+struct pmm_cache_t {
+    size_t count;
+    uint32_t pfns[PMM_CACHE_HIGH];
+    struct pmm_cache_stats_t stats;
+};
+
+static struct pmm_cache_t pmm_caches[MAX_CPUS];
+
+/* Idle CPUs keep a pool of pre-zeroed single pages for pmm_allocz().
+ * Zeroing starts once the pool drops below the low watermark and goes on
+ * until it reaches the high one. Pool pages are chained through their
+ * page_t next field. */
+#define PMM_ZERO_POOL_LOW  256
+#define PMM_ZERO_POOL_HIGH 2048
+
+static size_t zero_pool_low = PMM_ZERO_POOL_LOW;
+static size_t zero_pool_high = PMM_ZERO_POOL_HIGH;
+static int zero_pool_refilling = 1;
+
+static uint32_t zero_pool = PAGE_NONE;
+static size_t zero_pool_count = 0;
+static struct pmm_zero_stats_t zero_pool_stats = {0};
+
+/* Lock order: pmm_lock before zero_pool_lock. Like pmm_lock, it is always
+ * taken with interrupts disabled. */
+static lock_t zero_pool_lock = new_lock;
+
+static inline void free_list_push(size_t pfn, int order) {
+    struct page_t *page = &page_frames[pfn];
+
+    page->order = order;
+    page->flags |= PAGE_FREE;
+    page->prev = PAGE_NONE;
+    page->next = free_lists[order];
+    if (free_lists[order] != PAGE_NONE)
+        page_frames[free_lists[order]].prev = pfn;
+    free_lists[order] = pfn;
+}
 
-static size_t total_pages = 1;
-static size_t free_pages = 1;
+static inline void free_list_remove(size_t pfn, int order) {
+    struct page_t *page = &page_frames[pfn];
 
-static size_t cur_ptr = BITMAP_BASE;
+    if (page->prev != PAGE_NONE)
+        page_frames[page->prev].next = page->next;
+    else
+        free_lists[order] = page->next;
+    if (page->next != PAGE_NONE)
+        page_frames[page->next].prev = page->prev;
+    page->flags &= ~PAGE_FREE;
+}
 
-/* A core wishing to modify the PMM bitmap must first acquire this lock,
- * to ensure other cores cannot simultaneously modify the bitmap */
-static lock_t pmm_lock = new_lock;
+/* Return a block to the free lists, merging it with its buddy for as long
+ * as the buddy is itself a free block of the same order. */
+static void free_block(size_t pfn, int order) {
+    free_pages += (size_t)1 << order;
+
+    while (order < PMM_MAX_ORDER - 1) {
+        size_t buddy = pfn ^ ((size_t)1 << order);
+        if (buddy >= page_count
+         || !(page_frames[buddy].flags & PAGE_FREE)
+         || page_frames[buddy].order != order)
+            break;
+        free_list_remove(buddy, order);
+        if (buddy < pfn)
+            pfn = buddy;
+        order++;
+    }
 
-__attribute__((always_inline)) static inline int read_bitmap(size_t i) {
-    i -= BITMAP_BASE;
+    free_list_push(pfn, order);
+}
 
-    return test_bit(mem_bitmap, i);
+/* Free an arbitrary run of pages as a sequence of maximal aligned blocks */
+static void free_range(size_t pfn, size_t count) {
+    while (count) {
+        int order = 0;
+        while (order < PMM_MAX_ORDER - 1
+            && !(pfn & ((size_t)1 << order))
+            && ((size_t)2 << order) <= count)
+            order++;
+        free_block(pfn, order);
+        pfn += (size_t)1 << order;
+        count -= (size_t)1 << order;
+    }
 }
 
-__attribute__((always_inline)) static inline void set_bitmap(size_t i, size_t count) {
-    i -= BITMAP_BASE;
+static void add_memory(struct stivale_memmap_t *memmap, size_t low, size_t high) {
+    for (size_t i = 0; i < memmap->entries; i++) {
+        struct stivale_memmap_entry_t *entry = &memmap->address[i];
 
-    free_pages -= count;
+        if (entry->type != USABLE)
+            continue;
 
-    size_t f = i + count;
-    for (size_t j = i; j < f; j++)
-        set_bit(mem_bitmap, j);
-}
+        size_t base = DIV_ROUNDUP(entry->base, PAGE_SIZE) * PAGE_SIZE;
+        size_t top = ((entry->base + entry->size) / PAGE_SIZE) * PAGE_SIZE;
 
-__attribute__((always_inline)) static inline void unset_bitmap(size_t i, size_t count) {
-    i -= BITMAP_BASE;
+        if (base < low)
+            base = low;
+        if (top > high)
+            top = high;
+        if (base >= top)
+            continue;
 
-    free_pages += count;
+        total_pages += (top - base) / PAGE_SIZE;
+        free_range(base / PAGE_SIZE, (top - base) / PAGE_SIZE);
+    }
+}
 
-    size_t f = i + count;
-    for (size_t j = i; j < f; j++)
-        reset_bit(mem_bitmap, j);
+/* Order of the free block headed by pfn, -1 if it heads none */
+static int block_order(size_t pfn) {
+    if (!(page_frames[pfn].flags & PAGE_FREE))
+        return -1;
+    return page_frames[pfn].order;
 }
 
-/* Populate bitmap using e820 data. */
-void init_pmm(struct stivale_memmap_t *memmap) {
-    mem_bitmap = initial_bitmap;
-    if (!(tmp_bitmap = pmm_allocz(BMREALLOC_STEP))) {
-        panic(NULL, 0, "pmm_alloc failure in init_pmm()");
+/* Whether pfn lies in a free block of at least the given order */
+static int in_free_block(size_t pfn, int order) {
+    for (; order < PMM_MAX_ORDER; order++) {
+        size_t head = pfn & ~(((size_t)1 << order) - 1);
+        if (block_order(head) == order)
+            return 1;
     }
+    return 0;
+}
 
-    tmp_bitmap = (uint32_t *)((size_t)tmp_bitmap + MEM_PHYS_OFFSET);
+/* Split a block, then merge it back, and check the free lists at each
+ * step. Runs before the other CPUs are up, so nothing else touches the
+ * lists meanwhile. */
+static void pmm_selftest(void) {
+    size_t free_before = free_pages;
+
+    int order = 2;
+    while (order < PMM_MAX_ORDER && free_lists[order] == PAGE_NONE)
+        order++;
+    if (order == PMM_MAX_ORDER) {
+        kprint(KPRN_WARN, "pmm: Self-test skipped, no block of 4 pages");
+        return;
+    }
+    size_t head = free_lists[order];
+
+    /* 3 pages take the smallest block of 4 pages or more, split it down to
+     * 4 pages and give the tail page back */
+    size_t pfn = (size_t)pmm_alloc(3) / PAGE_SIZE;
+    if (pfn != head)
+        panic(NULL, 0, "pmm: Self-test: smallest block not used");
+    for (int i = 2; i < order; i++) {
+        if (block_order(head + ((size_t)1 << i)) != i)
+            panic(NULL, 0, "pmm: Self-test: bad split");
+    }
+    for (size_t i = 0; i < 3; i++) {
+        if (page_frames[pfn + i].flags & PAGE_FREE)
+            panic(NULL, 0, "pmm: Self-test: allocated page still free");
+    }
+    if (block_order(pfn + 3) != 0 || free_pages != free_before - 3)
+        panic(NULL, 0, "pmm: Self-test: tail page not given back");
 
-    for (size_t i = 0; i < (BMREALLOC_STEP * PAGE_SIZE) / sizeof(uint32_t); i++)
-        tmp_bitmap[i] = 0xffffffff;
+    /* The tail page now heads the order 0 list */
+    if ((size_t)pmm_alloc(1) / PAGE_SIZE != pfn + 3)
+        panic(NULL, 0, "pmm: Self-test: tail page not reused");
 
-    mem_bitmap = tmp_bitmap;
+    /* Freeing everything merges the pieces back into the original block */
+    pmm_free((void *)(pfn * PAGE_SIZE), 3);
+    pmm_free((void *)((pfn + 3) * PAGE_SIZE), 1);
+    if (free_pages != free_before || !in_free_block(head, order))
+        panic(NULL, 0, "pmm: Self-test: bad merge");
 
-    bitmap_entries = ((PAGE_SIZE / sizeof(uint32_t)) * 32) * BMREALLOC_STEP;
+    kprint(KPRN_INFO, "pmm: Buddy allocator self-test passed");
+}
 
+/* Build the page metadata array and the free lists using e820 data. */
+void init_pmm(struct stivale_memmap_t *memmap) {
     kprint(KPRN_INFO, "pmm: Mapping memory");
 
-    /* For each region specified by the memmap, iterate over each page which
-       fits in that region and if the region type indicates the area itself
-       is usable, write that page as free in the bitmap. Otherwise, mark the page as used. */
+    size_t memory_top = 0;
     for (size_t i = 0; i < memmap->entries; i++) {
-        size_t aligned_base;
-        struct stivale_memmap_entry_t *entry = &(memmap->address[i]);
-
-        if (entry->base % PAGE_SIZE)
-            aligned_base = entry->base + (PAGE_SIZE - (entry->base % PAGE_SIZE));
-        else
-            aligned_base = entry->base;
-
-        size_t aligned_length = (entry->size / PAGE_SIZE) * PAGE_SIZE;
-
-        if ((entry->base % PAGE_SIZE) && aligned_length)
-            aligned_length -= PAGE_SIZE;
-
-        for (size_t j = 0; j * PAGE_SIZE < aligned_length; j++) {
-            size_t addr = aligned_base + j * PAGE_SIZE;
-
-            size_t page = addr / PAGE_SIZE;
-
-            if (addr < (MEMORY_BASE + PAGE_SIZE /* bitmap */))
-                continue;
-
-            if (addr >= (MEMORY_BASE + bitmap_entries * PAGE_SIZE)) {
-                /* Reallocate bitmap */
-                size_t cur_bitmap_size_in_pages = ((bitmap_entries / 32) * sizeof(uint32_t)) / PAGE_SIZE;
-                size_t new_bitmap_size_in_pages = cur_bitmap_size_in_pages + BMREALLOC_STEP;
-                if (!(tmp_bitmap = pmm_allocz(new_bitmap_size_in_pages))) {
-                    kprint(KPRN_ERR, "pmm_alloc failure in init_pmm(). Halted.");
-                    for (;;);
-                }
-                tmp_bitmap = (uint32_t *)((size_t)tmp_bitmap + MEM_PHYS_OFFSET);
-                /* Copy over previous bitmap */
-                for (size_t i = 0;
-                     i < (cur_bitmap_size_in_pages * PAGE_SIZE) / sizeof(uint32_t);
-                     i++)
-                    tmp_bitmap[i] = mem_bitmap[i];
-                /* Fill in the rest */
-                for (size_t i = (cur_bitmap_size_in_pages * PAGE_SIZE) / sizeof(uint32_t);
-                     i < (new_bitmap_size_in_pages * PAGE_SIZE) / sizeof(uint32_t);
-                     i++)
-                    tmp_bitmap[i] = 0xffffffff;
-                bitmap_entries += ((PAGE_SIZE / sizeof(uint32_t)) * 32) * BMREALLOC_STEP;
-                uint32_t *old_bitmap = (uint32_t *)((size_t)mem_bitmap - MEM_PHYS_OFFSET);
-                mem_bitmap = tmp_bitmap;
-                pmm_free(old_bitmap, cur_bitmap_size_in_pages);
-            }
+        struct stivale_memmap_entry_t *entry = &memmap->address[i];
+        if (entry->type != USABLE)
+            continue;
+        if (entry->base + entry->size > memory_top)
+            memory_top = entry->base + entry->size;
+    }
 
-            if (entry->type == USABLE) {
-                total_pages++;
-                unset_bitmap(page, 1);
-            }
+    page_count = memory_top / PAGE_SIZE;
+    size_t array_size = DIV_ROUNDUP(page_count * sizeof(struct page_t), PAGE_SIZE) * PAGE_SIZE;
+
+    /* Carve the metadata array out of the first usable region that fits it */
+    size_t array_base = 0;
+    for (size_t i = 0; i < memmap->entries; i++) {
+        struct stivale_memmap_entry_t *entry = &memmap->address[i];
+        if (entry->type != USABLE)
+            continue;
+
+        size_t base = DIV_ROUNDUP(entry->base, PAGE_SIZE) * PAGE_SIZE;
+        size_t top = entry->base + entry->size;
+        if (base < MEMORY_BASE)
+            base = MEMORY_BASE;
+        if (top > EARLY_MEMORY_LIMIT)
+            top = EARLY_MEMORY_LIMIT;
+        if (base < top && top - base >= array_size) {
+            array_base = base;
+            break;
         }
     }
+    if (!array_base)
+        panic(NULL, 0, "pmm: Unable to place page metadata array");
+
+    page_frames = (struct page_t *)(array_base + MEM_PHYS_OFFSET);
+    for (size_t i = 0; i < page_count; i++) {
+        page_frames[i].next = PAGE_NONE;
+        page_frames[i].prev = PAGE_NONE;
+        page_frames[i].order = 0;
+        page_frames[i].flags = 0;
+        page_frames[i].refcount = 0;
+    }
+
+    for (size_t i = 0; i < PMM_MAX_ORDER; i++)
+        free_lists[i] = PAGE_NONE;
+
+    /* Hand out everything above the metadata array that the bootloader has
+     * mapped for us; the rest follows in pmm_add_high_memory(). */
+    add_memory(memmap, array_base + array_size, EARLY_MEMORY_LIMIT);
+    add_memory(memmap, MEMORY_BASE, array_base);
+
+    kprint(KPRN_INFO, "pmm: %U pages of page metadata at %X",
+           array_size / PAGE_SIZE, array_base);
+
+    pmm_selftest();
 }
 
-/* Allocate physical memory without optimisation for early boot */
-static void *pmm_alloc_slow(size_t pg_count) {
+/* Called once the VMM has mapped all of physical memory */
+void pmm_add_high_memory(struct stivale_memmap_t *memmap) {
+    uint64_t rflags = save_and_disable_interrupts();
     spinlock_acquire(&pmm_lock);
+    add_memory(memmap, EARLY_MEMORY_LIMIT, page_count * PAGE_SIZE);
+    spinlock_release(&pmm_lock);
+    restore_interrupts(rflags);
+}
+
+/* Must be called with pmm_lock held. Returns the number of pages freed. */
+static size_t zero_pool_drain_locked(void) {
+    spinlock_acquire(&zero_pool_lock);
+
+    size_t count = zero_pool_count;
+    while (zero_pool != PAGE_NONE) {
+        size_t pfn = zero_pool;
+        zero_pool = page_frames[pfn].next;
+        free_block(pfn, 0);
+    }
+    zero_pool_count = 0;
 
-    size_t pg_cnt = pg_count;
+    spinlock_release(&zero_pool_lock);
 
-    size_t i;
-    for (i = BITMAP_BASE; i < BITMAP_BASE + bitmap_entries; ) {
-        if (!read_bitmap(i++)) {
-            if (!--pg_cnt)
-                goto found;
-        } else {
-            pg_cnt = pg_count;
+    return count;
+}
+
+static void *pmm_cache_alloc(void) {
+    uint64_t rflags = save_and_disable_interrupts();
+
+    struct pmm_cache_t *cache = &pmm_caches[current_cpu];
+
+    if (cache->count) {
+        cache->stats.hits++;
+    } else {
+        cache->stats.misses++;
+        cache->stats.refills++;
+
+        spinlock_acquire(&pmm_lock);
+refill:
+        while (cache->count < PMM_CACHE_BATCH) {
+            int order;
+            for (order = 0; order < PMM_MAX_ORDER; order++) {
+                if (free_lists[order] != PAGE_NONE)
+                    break;
+            }
+            if (order == PMM_MAX_ORDER)
+                break;
+
+            size_t pfn = free_lists[order];
+            free_list_remove(pfn, order);
+            free_pages -= (size_t)1 << order;
+
+            /* Take as much of the block as fits in the cache */
+            size_t take = (size_t)1 << order;
+            if (take > PMM_CACHE_BATCH - cache->count)
+                take = PMM_CACHE_BATCH - cache->count;
+            for (size_t i = 0; i < take; i++)
+                cache->pfns[cache->count++] = pfn + i;
+            if (((size_t)1 << order) > take)
+                free_range(pfn + take, ((size_t)1 << order) - take);
+        }
+        if (!cache->count && zero_pool_drain_locked())
+            goto refill;
+        spinlock_release(&pmm_lock);
+
+        if (!cache->count) {
+            restore_interrupts(rflags);
+            panic(NULL, 1, "Kernel ran out of memory.");
         }
     }
 
+    size_t pfn = cache->pfns[--cache->count];
+
+    restore_interrupts(rflags);
+
+    return (void *)(pfn * PAGE_SIZE);
+}
+
+static void pmm_cache_free(size_t pfn) {
+    uint64_t rflags = save_and_disable_interrupts();
+
+    struct pmm_cache_t *cache = &pmm_caches[current_cpu];
+
+    if (cache->count == PMM_CACHE_HIGH) {
+        cache->stats.drains++;
+
+        spinlock_acquire(&pmm_lock);
+        for (size_t i = 0; i < PMM_CACHE_BATCH; i++)
+            free_block(cache->pfns[--cache->count], 0);
+        spinlock_release(&pmm_lock);
+    }
+
+    cache->pfns[cache->count++] = pfn;
+
+    restore_interrupts(rflags);
+}
+
+/* Take pg_count contiguous pages from the buddy lists, NULL if no block
+ * is large enough */
+static void *buddy_alloc(size_t pg_count) {
+    int wanted = 0;
+    while (((size_t)1 << wanted) < pg_count)
+        wanted++;
+
+    uint64_t rflags = save_and_disable_interrupts();
+    spinlock_acquire(&pmm_lock);
+
+    int order;
+retry:
+    for (order = wanted; order < PMM_MAX_ORDER; order++) {
+        if (free_lists[order] != PAGE_NONE)
+            goto found;
+    }
+
+    /* Last resort: give the pre-zeroed pool back to the free lists */
+    if (zero_pool_drain_locked())
+        goto retry;
+
     spinlock_release(&pmm_lock);
+    restore_interrupts(rflags);
 
-    panic(NULL, 1, "Kernel ran out of memory.");
+    return NULL;
 
 found:;
-    size_t start = i - pg_count;
-    set_bitmap(start, pg_count);
+    size_t pfn = free_lists[order];
+    free_list_remove(pfn, order);
+    free_pages -= (size_t)1 << order;
+
+    /* Split the block down to the order we need */
+    while (order > wanted) {
+        order--;
+        free_block(pfn + ((size_t)1 << order), order);
+    }
+
+    /* Give back the tail of the block we are not going to use */
+    if (((size_t)1 << wanted) > pg_count)
+        free_range(pfn + pg_count, ((size_t)1 << wanted) - pg_count);
 
     spinlock_release(&pmm_lock);
+    restore_interrupts(rflags);
 
     // Return the physical address that represents the start of this physical page(s).
-    return (void *)(start * PAGE_SIZE);
+    return (void *)(pfn * PAGE_SIZE);
 }
 
-/* Allocate physical memory with O(1)-like optimisation */
-static void *pmm_alloc_fast(size_t pg_count) {
+/* Allocate physical memory. */
+void *pmm_alloc(size_t pg_count) {
+    if (!pg_count)
+        return NULL;
+
+    if (pg_count == 1 && smp_ready)
+        return pmm_cache_alloc();
+
+    void *ptr = buddy_alloc(pg_count);
+    if (!ptr)
+        panic(NULL, 1, "Kernel ran out of memory.");
+
+    return ptr;
+}
+
+/* Like pmm_alloc(), but returns NULL instead of giving up on the kernel.
+ * For allocations which have a fallback, such as huge pages. */
+void *pmm_try_alloc(size_t pg_count) {
+    if (!pg_count)
+        return NULL;
+
+    return buddy_alloc(pg_count);
+}
+
+/* Zero one page for the pool. Called by idle CPUs with interrupts enabled;
+ * the page is handled with interrupts off since an idle context is never
+ * resumed once it is rescheduled. Returns 0 if there was nothing to do. */
+int pmm_zero_pool_refill(void) {
+    if (!zero_pool_refilling) {
+        if (locked_read(size_t, &zero_pool_count) >= zero_pool_low)
+            return 0;
+        zero_pool_refilling = 1;
+    }
+
+    uint64_t rflags = save_and_disable_interrupts();
+
     spinlock_acquire(&pmm_lock);
 
-    size_t pg_cnt = pg_count;
+    if (zero_pool_count >= zero_pool_high) {
+        zero_pool_refilling = 0;
+        spinlock_release(&pmm_lock);
+        restore_interrupts(rflags);
+        return 0;
+    }
 
-    for (size_t i = 0; i < bitmap_entries; i++) {
-        if (cur_ptr == BITMAP_BASE + bitmap_entries) {
-            cur_ptr = BITMAP_BASE;
-            pg_cnt = pg_count;
-        }
-        if (!read_bitmap(cur_ptr++)) {
-            if (!--pg_cnt)
-                goto found;
-        } else {
-            pg_cnt = pg_count;
-        }
+    int order;
+    for (order = 0; order < PMM_MAX_ORDER; order++) {
+        if (free_lists[order] != PAGE_NONE)
+            break;
+    }
+    if (order == PMM_MAX_ORDER) {
+        zero_pool_refilling = 0;
+        spinlock_release(&pmm_lock);
+        restore_interrupts(rflags);
+        return 0;
+    }
+
+    size_t pfn = free_lists[order];
+    free_list_remove(pfn, order);
+    free_pages -= (size_t)1 << order;
+    while (order > 0) {
+        order--;
+        free_block(pfn + ((size_t)1 << order), order);
     }
 
     spinlock_release(&pmm_lock);
 
-    panic(NULL, 1, "Kernel ran out of memory.");
+    uint64_t *page = (uint64_t *)(pfn * PAGE_SIZE + MEM_PHYS_OFFSET);
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++)
+        page[i] = 0;
 
-found:;
-    size_t start = cur_ptr - pg_count;
-    set_bitmap(start, pg_count);
+    spinlock_acquire(&zero_pool_lock);
+    page_frames[pfn].next = zero_pool;
+    zero_pool = pfn;
+    zero_pool_count++;
+    zero_pool_stats.zeroed_idle++;
+    spinlock_release(&zero_pool_lock);
 
-    spinlock_release(&pmm_lock);
+    restore_interrupts(rflags);
 
-    // Return the physical address that represents the start of this physical page(s).
-    return (void *)(start * PAGE_SIZE);
+    return 1;
 }
 
-void *(*pmm_alloc)(size_t) = pmm_alloc_slow;
+/* Set the pool sizes at which idle CPUs start and stop zeroing pages */
+void pmm_set_zero_watermarks(size_t low, size_t high) {
+    if (low > high)
+        low = high;
+    uint64_t rflags = save_and_disable_interrupts();
+    spinlock_acquire(&zero_pool_lock);
+    zero_pool_low = low;
+    zero_pool_high = high;
+    spinlock_release(&zero_pool_lock);
+    restore_interrupts(rflags);
+}
 
-void pmm_change_allocation_method(void) {
-    pmm_alloc = pmm_alloc_fast;
+void pmm_get_zero_stats(struct pmm_zero_stats_t *stats) {
+    uint64_t rflags = save_and_disable_interrupts();
+    spinlock_acquire(&zero_pool_lock);
+    *stats = zero_pool_stats;
+    stats->pooled = zero_pool_count;
+    stats->low = zero_pool_low;
+    stats->high = zero_pool_high;
+    spinlock_release(&zero_pool_lock);
+    restore_interrupts(rflags);
 }
 
 /* Allocate physical memory and zero it out. */
 void *pmm_allocz(size_t pg_count) {
+    if (pg_count == 1) {
+        uint64_t rflags = save_and_disable_interrupts();
+        spinlock_acquire(&zero_pool_lock);
+        if (zero_pool != PAGE_NONE) {
+            size_t pfn = zero_pool;
+            zero_pool = page_frames[pfn].next;
+            zero_pool_count--;
+            zero_pool_stats.hits++;
+            spinlock_release(&zero_pool_lock);
+            restore_interrupts(rflags);
+            return (void *)(pfn * PAGE_SIZE);
+        }
+        zero_pool_stats.misses++;
+        spinlock_release(&zero_pool_lock);
+        restore_interrupts(rflags);
+    }
+
     void *ptr = pmm_alloc(pg_count);
     if (!ptr)
         return NULL;
@@ -215,18 +570,145 @@ void *pmm_allocz(size_t pg_count) {
 
 /* Release physical memory. */
 void pmm_free(void *ptr, size_t pg_count) {
+    if (pg_count == 1 && smp_ready) {
+        pmm_cache_free((size_t)ptr / PAGE_SIZE);
+        return;
+    }
+
+    uint64_t rflags = save_and_disable_interrupts();
+    spinlock_acquire(&pmm_lock);
+
+    free_range((size_t)ptr / PAGE_SIZE, pg_count);
+
+    spinlock_release(&pmm_lock);
+    restore_interrupts(rflags);
+}
+
+/* Add a mapping to a page shared copy-on-write */
+void pmm_ref_page(void *ptr, size_t pg_count) {
+    struct page_t *page = &page_frames[(size_t)ptr / PAGE_SIZE];
+
+    if (pg_count == 1) {
+        locked_inc(&page->refcount);
+        return;
+    }
+
+    uint64_t rflags = save_and_disable_interrupts();
+    spinlock_acquire(&pmm_lock);
+
+    size_t frames = (page->flags & PAGE_SPLIT) ? pg_count : 1;
+    for (size_t i = 0; i < frames; i++)
+        locked_inc(&page[i].refcount);
+
+    spinlock_release(&pmm_lock);
+    restore_interrupts(rflags);
+}
+
+/* Drop a mapping of a single frame, returns non-zero if it was the last */
+static int unref_frame(size_t pfn) {
+    struct page_t *page = &page_frames[pfn];
+
+    int refcount;
+    atomic_fetch_add_int(&page->refcount, &refcount, -1);
+    if (refcount)
+        return 0;
+
+    page->refcount = 0;
+    page->flags &= ~PAGE_SPLIT;
+    return 1;
+}
+
+/* Drop a mapping of a page, freeing the page along with its last mapping */
+void pmm_unref_page(void *ptr, size_t pg_count) {
+    size_t pfn = (size_t)ptr / PAGE_SIZE;
+
+    if (pg_count == 1) {
+        if (unref_frame(pfn))
+            pmm_free(ptr, 1);
+        return;
+    }
+
+    uint64_t rflags = save_and_disable_interrupts();
+    spinlock_acquire(&pmm_lock);
+
+    if (page_frames[pfn].flags & PAGE_SPLIT) {
+        /* Some frames may still be mapped on their own */
+        for (size_t i = 0; i < pg_count; i++) {
+            if (unref_frame(pfn + i))
+                free_range(pfn + i, 1);
+        }
+    } else if (unref_frame(pfn)) {
+        free_range(pfn, pg_count);
+    }
+
+    spinlock_release(&pmm_lock);
+    restore_interrupts(rflags);
+}
+
+/* Returns non-zero if more than one mapping refers to the page, or to any
+ * frame of it */
+int pmm_page_shared(void *ptr, size_t pg_count) {
+    struct page_t *page = &page_frames[(size_t)ptr / PAGE_SIZE];
+
+    if (pg_count == 1)
+        return locked_read(int, &page->refcount) > 0;
+
+    uint64_t rflags = save_and_disable_interrupts();
     spinlock_acquire(&pmm_lock);
 
-    size_t start = (size_t)ptr / PAGE_SIZE;
+    int shared = 0;
+    size_t frames = (page->flags & PAGE_SPLIT) ? pg_count : 1;
+    for (size_t i = 0; i < frames && !shared; i++)
+        shared = locked_read(int, &page[i].refcount) > 0;
+
+    spinlock_release(&pmm_lock);
+    restore_interrupts(rflags);
+
+    return shared;
+}
 
-    unset_bitmap(start, pg_count);
+/* Give each frame of a huge page the refcount of the whole page, so that
+ * the frames can be mapped and unmapped on their own from now on */
+void pmm_split_page(void *ptr, size_t pg_count) {
+    struct page_t *page = &page_frames[(size_t)ptr / PAGE_SIZE];
+
+    uint64_t rflags = save_and_disable_interrupts();
+    spinlock_acquire(&pmm_lock);
+
+    if (!(page->flags & PAGE_SPLIT)) {
+        for (size_t i = 1; i < pg_count; i++)
+            page[i].refcount = page->refcount;
+        page->flags |= PAGE_SPLIT;
+    }
 
     spinlock_release(&pmm_lock);
+    restore_interrupts(rflags);
+}
+
+/* Sum up the per-CPU page cache counters */
+void pmm_get_cache_stats(struct pmm_cache_stats_t *stats) {
+    stats->hits = 0;
+    stats->misses = 0;
+    stats->refills = 0;
+    stats->drains = 0;
+
+    for (int i = 0; i < smp_cpu_count; i++) {
+        stats->hits += pmm_caches[i].stats.hits;
+        stats->misses += pmm_caches[i].stats.misses;
+        stats->refills += pmm_caches[i].stats.refills;
+        stats->drains += pmm_caches[i].stats.drains;
+    }
 }
 
 int getmemstats(struct memstats *memstats) {
+    /* Pages sitting in the per-CPU caches or in the zeroed pool are free
+     * as far as users care */
+    size_t cached_pages = zero_pool_count;
+    for (int i = 0; i < smp_cpu_count; i++)
+        cached_pages += pmm_caches[i].count;
+
     memstats->total = total_pages * PAGE_SIZE;
-    memstats->used  = total_pages * PAGE_SIZE - free_pages * PAGE_SIZE;
+    memstats->used  = total_pages * PAGE_SIZE - (free_pages + cached_pages) * PAGE_SIZE;
 
     return 0;
 }
@@ -7,11 +7,224 @@
 #include <sys/panic.h>
 #include <lib/cmem.h>
 #include <sys/cpu.h>
+#include <sys/smp.h>
+#include <sys/apic.h>
+#include <sys/ipi.h>
+#include <lib/cio.h>
 #include <startup/stivale.h>
 
+/* Available bit 9 marks writable user pages shared copy-on-write after a fork */
+#define PAGE_COW (1 << 9)
+
+/* Non-present entries with bit 10 set are reserved anonymous memory. The
+ * rest of the entry holds the flags to map the page with on first touch. */
+#define PAGE_LAZY (1 << 10)
+
+/* PS bit, the entry maps a 2 MiB or 1 GiB page instead of a table. Lazy
+ * entries with it set reserve a whole 2 MiB page. */
+#define PAGE_HUGE (1 << 7)
+
+#define ENTRY_ADDR_MASK ((size_t)0x000ffffffffff000)
+
+/* Pages populated around a faulting lazy page, within the same page table.
+ * Set to 1 to populate strictly on demand. */
+#define FAULT_AROUND_PAGES 4
+
 static struct pagemap_t __kp;
 struct pagemap_t *kernel_pagemap = &__kp;
 
+static int huge_1g_supported = 0;
+
+static int map_range_locked(struct pagemap_t *, size_t, size_t, size_t, size_t,
+                            size_t, int *);
+
+/* Remote invalidations of up to this many pages are done page by page,
+ * anything bigger flushes the whole TLB of the target CPUs */
+#define TLB_SHOOTDOWN_MAX_PAGES 32
+
+/* Only one shootdown is in flight at a time. The initiator owns the
+ * request until every target CPU cleared its pending flag. */
+static lock_t tlb_shootdown_lock = new_lock;
+static size_t tlb_request_addr;
+/* 0 requests a full flush */
+static size_t tlb_request_pages;
+static int tlb_pending[MAX_CPUS];
+static struct tlb_shootdown_stats_t tlb_stats;
+
+/* PCIDs 1 to PCID_COUNT are handed out to user address spaces on each CPU,
+ * PCID 0 belongs to the kernel pagemap */
+#define PCID_COUNT 63
+#define CR3_NOFLUSH ((size_t)1 << 63)
+
+struct pcid_cpu_t {
+    struct pagemap_t *owner[PCID_COUNT + 1];
+    /* tlb_gen of the owner the last time the PCID was flushed */
+    uint64_t gen[PCID_COUNT + 1];
+    size_t next_victim;
+};
+
+static struct pcid_cpu_t pcid_cpus[MAX_CPUS];
+
+/* Returns the value to load in cr3 to switch to pagemap on this CPU. The
+ * PCID of the pagemap is kept, along with its TLB entries, as long as no
+ * shootdown happened since it was last loaded here. Must be called with
+ * interrupts disabled, after current_pagemap was updated. */
+size_t vmm_get_cr3(struct pagemap_t *pagemap) {
+    size_t cr3 = (size_t)pagemap->pml4 - MEM_PHYS_OFFSET;
+
+    if (!cpu_pcid_enabled)
+        return cr3;
+
+    /* Kernel pagemap changes flush every PCID */
+    if (pagemap == kernel_pagemap)
+        return cr3 | CR3_NOFLUSH;
+
+    int cpu = current_cpu;
+    struct pcid_cpu_t *pcid_cpu = &pcid_cpus[cpu];
+    uint64_t gen = locked_read(uint64_t, &pagemap->tlb_gen);
+    size_t pcid = pagemap->pcid[cpu];
+
+    if (pcid && pcid_cpu->owner[pcid] == pagemap) {
+        if (pcid_cpu->gen[pcid] == gen)
+            return cr3 | pcid | CR3_NOFLUSH;
+        /* Missed a shootdown while switched away */
+        pcid_cpu->gen[pcid] = gen;
+        return cr3 | pcid;
+    }
+
+    /* Prefer a retired PCID, else evict round robin */
+    for (pcid = 1; pcid <= PCID_COUNT; pcid++) {
+        if (!pcid_cpu->owner[pcid])
+            break;
+    }
+    if (pcid > PCID_COUNT) {
+        pcid = pcid_cpu->next_victim + 1;
+        pcid_cpu->next_victim = (pcid_cpu->next_victim + 1) % PCID_COUNT;
+    }
+
+    pcid_cpu->owner[pcid] = pagemap;
+    pcid_cpu->gen[pcid] = gen;
+    pagemap->pcid[cpu] = pcid;
+
+    /* Loading without CR3_NOFLUSH drops what the previous owner left */
+    return cr3 | pcid;
+}
+
+static void tlb_flush_local(size_t virt_addr, size_t page_count) {
+    if (page_count) {
+        for (size_t i = 0; i < page_count; i++)
+            invlpg(virt_addr + i * PAGE_SIZE);
+        return;
+    }
+
+    size_t cr4 = read_cr("4");
+    if (cr4 & (1 << 7)) {
+        /* Toggling PGE flushes global entries and all PCIDs too */
+        write_cr("4", cr4 & ~(size_t)(1 << 7));
+        write_cr("4", cr4);
+    } else {
+        write_cr("3", read_cr("3"));
+    }
+}
+
+static void tlb_shootdown_poll(int cpu) {
+    if (locked_read(int, &tlb_pending[cpu])) {
+        tlb_flush_local(tlb_request_addr, tlb_request_pages);
+        locked_write(int, &tlb_pending[cpu], 0);
+    }
+}
+
+void tlb_shootdown_handler(void) {
+    tlb_shootdown_poll(current_cpu);
+}
+
+/* Invalidate page_count pages at virt_addr (or TLB_FLUSH_ALL) on every CPU
+ * which has the pagemap loaded. Page table changes must be visible before
+ * calling this. Must not be called with the pagemap lock held, as targets
+ * may be spinning on it with interrupts disabled. */
+void tlb_shootdown(struct pagemap_t *pagemap, size_t virt_addr, size_t page_count) {
+    if (page_count > TLB_SHOOTDOWN_MAX_PAGES)
+        page_count = 0;
+
+    /* The kernel half is shared by every address space */
+    int all_cpus = pagemap == kernel_pagemap;
+
+    /* invlpg only reaches the current PCID, kernel entries may be cached
+     * under any of them */
+    if (all_cpus && cpu_pcid_enabled)
+        page_count = 0;
+
+    /* CPUs which switched away keep the entries under their PCID,
+     * they flush it when switching back */
+    if (!all_cpus)
+        locked_inc(&pagemap->tlb_gen);
+
+    uint64_t rflags = save_and_disable_interrupts();
+
+    if (all_cpus || (size_t)pagemap->pml4 - MEM_PHYS_OFFSET == (read_cr("3") & ~(size_t)0xfff))
+        tlb_flush_local(virt_addr, page_count);
+
+    if (!smp_ready) {
+        restore_interrupts(rflags);
+        return;
+    }
+
+    int cpu = current_cpu;
+
+    /* Keep serving requests aimed at us while waiting, or two CPUs
+     * shooting down at each other with interrupts off would deadlock */
+    while (!spinlock_test_and_acquire(&tlb_shootdown_lock))
+        tlb_shootdown_poll(cpu);
+
+    tlb_request_addr = virt_addr;
+    tlb_request_pages = page_count;
+
+    size_t ipis = 0;
+    for (int i = 0; i < smp_cpu_count; i++) {
+        if (i == cpu)
+            continue;
+        /* The locked read orders it after the page table updates */
+        if (!all_cpus
+         && locked_read(struct pagemap_t *, &cpu_locals[i].current_pagemap) != pagemap)
+            continue;
+        locked_write(int, &tlb_pending[i], 1);
+        lapic_send_ipi(i, IPI_TLB_SHOOTDOWN);
+        ipis++;
+    }
+
+    for (int i = 0; i < smp_cpu_count; i++) {
+        while (locked_read(int, &tlb_pending[i]))
+            asm volatile ("pause");
+    }
+
+    tlb_stats.ipis += ipis;
+    if (page_count)
+        tlb_stats.pages += ipis * page_count;
+    else
+        tlb_stats.full_flushes += ipis;
+
+    spinlock_release(&tlb_shootdown_lock);
+
+    restore_interrupts(rflags);
+}
+
+void tlb_get_shootdown_stats(struct tlb_shootdown_stats_t *stats) {
+    /* Initiators spin on the lock with interrupts disabled */
+    uint64_t rflags = save_and_disable_interrupts();
+    spinlock_acquire(&tlb_shootdown_lock);
+    *stats = tlb_stats;
+    spinlock_release(&tlb_shootdown_lock);
+    restore_interrupts(rflags);
+}
+
+static int table_empty(pt_entry_t *table) {
+    for (size_t i = 0; i < PAGE_TABLE_ENTRIES; i++) {
+        if (table[i])
+            return 0;
+    }
+    return 1;
+}
+
 static inline size_t entries_to_virt_addr(size_t pml4_entry,
                                    size_t pdpt_entry,
                                    size_t pd_entry,
@@ -37,6 +250,8 @@ struct pagemap_t *new_address_space(void) {
     }
     new_pagemap->pml4 = (void *)((size_t)new_pagemap->pml4 + MEM_PHYS_OFFSET);
     new_pagemap->lock = new_lock;
+    memset(new_pagemap->pcid, 0, sizeof(new_pagemap->pcid));
+    new_pagemap->tlb_gen = 0;
     return new_pagemap;
 }
 
@@ -51,14 +266,18 @@ void free_address_space(struct pagemap_t *pagemap) {
         if (pagemap->pml4[i] & 1) {
             pdpt = (pt_entry_t *)((pagemap->pml4[i] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
             for (size_t j = 0; j < PAGE_TABLE_ENTRIES; j++) {
-                if (pdpt[j] & 1) {
+                if ((pdpt[j] & (PAGE_HUGE | 1)) == (PAGE_HUGE | 1)) {
+                    pmm_unref_page((void *)(pdpt[j] & ENTRY_ADDR_MASK), PAGE_SIZE_1G / PAGE_SIZE);
+                } else if (pdpt[j] & 1) {
                     pd = (pt_entry_t *)((pdpt[j] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
                     for (size_t k = 0; k < PAGE_TABLE_ENTRIES; k++) {
-                        if (pd[k] & 1) {
+                        if ((pd[k] & (PAGE_HUGE | 1)) == (PAGE_HUGE | 1)) {
+                            pmm_unref_page((void *)(pd[k] & ENTRY_ADDR_MASK), PAGE_SIZE_2M / PAGE_SIZE);
+                        } else if (pd[k] & 1) {
                             pt = (pt_entry_t *)((pd[k] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
                             for (size_t l = 0; l < PAGE_TABLE_ENTRIES; l++) {
                                 if (pt[l] & 1)
-                                    pmm_free((void *)(pt[l] & 0xfffffffffffff000), 1);
+                                    pmm_unref_page((void *)(pt[l] & 0xfffffffffffff000), 1);
                             }
                             pmm_free((void *)(pd[k] & 0xfffffffffffff000), 1);
                         }
@@ -70,59 +289,93 @@ void free_address_space(struct pagemap_t *pagemap) {
         }
     }
 
+    /* Retire the PCIDs of the address space, the TLB entries tagged with
+     * them are flushed when they get reassigned */
+    for (int i = 0; i < smp_cpu_count; i++) {
+        /* A CPU may still have it loaded, as when exec() frees the old
+         * address space, make sure it switches away for real */
+        if (cpu_locals[i].current_pagemap == pagemap)
+            locked_write(struct pagemap_t *, &cpu_locals[i].current_pagemap, NULL);
+        size_t pcid = pagemap->pcid[i];
+        if (pcid && pcid_cpus[i].owner[pcid] == pagemap)
+            locked_write(struct pagemap_t *, &pcid_cpus[i].owner[pcid], NULL);
+    }
+
     pmm_free((void *)pagemap->pml4 - MEM_PHYS_OFFSET, 1);
     kfree(pagemap);
 }
 
+/* Allocate an empty page table level, returns NULL on failure */
+static pt_entry_t *new_table(void) {
+    pt_entry_t *table = pmm_allocz(1);
+    if (!table)
+        return NULL;
+    return (pt_entry_t *)((size_t)table + MEM_PHYS_OFFSET);
+}
+
+/* Share a present leaf entry mapping page_size bytes between parent and
+ * child, returns the entry for the child */
+static pt_entry_t share_entry(pt_entry_t *entry, size_t page_size) {
+    if (*entry & 0x02)
+        *entry = (*entry & ~(pt_entry_t)0x02) | PAGE_COW;
+    pmm_ref_page((void *)(*entry & ENTRY_ADDR_MASK), page_size / PAGE_SIZE);
+    return *entry;
+}
+
+/* Only the page tables are copied, the pages themselves are shared between
+ * parent and child. Writable pages are made read-only on both sides and
+ * marked copy-on-write, to be copied by vmm_handle_cow_fault() once either
+ * side writes to them. */
 struct pagemap_t *fork_address_space(struct pagemap_t *old_pagemap) {
     /* Allocate the new pagemap */
     struct pagemap_t *new_pagemap = new_address_space();
+    if (!new_pagemap)
+        return NULL;
 
-    pt_entry_t *pdpt;
-    pt_entry_t *pd;
-    pt_entry_t *pt;
-
-    struct {
-        uint8_t data[PAGE_SIZE];
-    } *pool;
+    pt_entry_t *pdpt, *new_pdpt;
+    pt_entry_t *pd, *new_pd;
+    pt_entry_t *pt, *new_pt;
 
-    size_t pool_size = 4096;
-    pool = pmm_alloc(pool_size);
-    size_t pool_ptr = 0;
+    spinlock_acquire(&old_pagemap->lock);
 
-    /* Map and copy all used pages */
     for (size_t i = 0; i < PAGE_TABLE_ENTRIES / 2; i++) {
-        if (old_pagemap->pml4[i] & 1) {
-            pdpt = (pt_entry_t *)((old_pagemap->pml4[i] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-            for (size_t j = 0; j < PAGE_TABLE_ENTRIES; j++) {
-                if (pdpt[j] & 1) {
-                    pd = (pt_entry_t *)((pdpt[j] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-                    for (size_t k = 0; k < PAGE_TABLE_ENTRIES; k++) {
-                        if (pd[k] & 1) {
-                            pt = (pt_entry_t *)((pd[k] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-                            for (size_t l = 0; l < PAGE_TABLE_ENTRIES; l++) {
-                                if (pt[l] & 1) {
-                                    /* FIXME find a way to expand the pool instead of dying */
-                                    if (pool_ptr == pool_size)
-                                        panic(NULL, 1, "Fork memory pool exhausted");
-                                    size_t new_page = (size_t)&pool[pool_ptr++];
-                                    memcpy64((char *)(new_page + MEM_PHYS_OFFSET),
-                                            (char *)((pt[l] & 0xfffffffffffff000) + MEM_PHYS_OFFSET),
-                                            PAGE_SIZE);
-                                    map_page(new_pagemap,
-                                             new_page,
-                                             entries_to_virt_addr(i, j, k, l),
-                                             (pt[l] & 0xfff));
-                                }
-                            }
-                        }
-                    }
+        if (!(old_pagemap->pml4[i] & 1))
+            continue;
+        pdpt = (pt_entry_t *)((old_pagemap->pml4[i] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+        if (!(new_pdpt = new_table()))
+            goto fail;
+        new_pagemap->pml4[i] = ((size_t)new_pdpt - MEM_PHYS_OFFSET) | (old_pagemap->pml4[i] & 0xfff);
+        for (size_t j = 0; j < PAGE_TABLE_ENTRIES; j++) {
+            if (!(pdpt[j] & 1) || (pdpt[j] & PAGE_HUGE)) {
+                /* Huge pages and lazy reservations are leaves */
+                new_pdpt[j] = (pdpt[j] & 1) ? share_entry(&pdpt[j], PAGE_SIZE_1G) : pdpt[j];
+                continue;
+            }
+            pd = (pt_entry_t *)((pdpt[j] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+            if (!(new_pd = new_table()))
+                goto fail;
+            new_pdpt[j] = ((size_t)new_pd - MEM_PHYS_OFFSET) | (pdpt[j] & 0xfff);
+            for (size_t k = 0; k < PAGE_TABLE_ENTRIES; k++) {
+                if (!(pd[k] & 1) || (pd[k] & PAGE_HUGE)) {
+                    new_pd[k] = (pd[k] & 1) ? share_entry(&pd[k], PAGE_SIZE_2M) : pd[k];
+                    continue;
+                }
+                pt = (pt_entry_t *)((pd[k] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+                if (!(new_pt = new_table()))
+                    goto fail;
+                new_pd[k] = ((size_t)new_pt - MEM_PHYS_OFFSET) | (pd[k] & 0xfff);
+                for (size_t l = 0; l < PAGE_TABLE_ENTRIES; l++) {
+                    /* Carry over lazy reservations */
+                    new_pt[l] = (pt[l] & 1) ? share_entry(&pt[l], PAGE_SIZE) : pt[l];
                 }
             }
         }
     }
 
-    pmm_free(pool + pool_ptr, pool_size - pool_ptr);
+    spinlock_release(&old_pagemap->lock);
+
+    /* The parent lost write access to its pages, drop the stale entries */
+    tlb_shootdown(old_pagemap, 0, TLB_FLUSH_ALL);
 
     /* Map kernel into higher half */
     for (size_t i = PAGE_TABLE_ENTRIES / 2; i < PAGE_TABLE_ENTRIES; i++) {
@@ -130,14 +383,20 @@ struct pagemap_t *fork_address_space(struct pagemap_t *old_pagemap) {
     }
 
     return new_pagemap;
-}
 
-/* map physaddr -> virtaddr using pml4 pointer */
-/* Returns 0 on success, -1 on failure */
-int map_page(struct pagemap_t *pagemap, size_t phys_addr, size_t virt_addr, size_t flags) {
-    spinlock_acquire(&pagemap->lock);
+fail:
+    spinlock_release(&old_pagemap->lock);
+    tlb_shootdown(old_pagemap, 0, TLB_FLUSH_ALL);
+    free_address_space(new_pagemap);
+    return NULL;
+}
 
-    /* Calculate the indices in the various tables using the virtual address */
+/* Returns the leaf entry mapping virt_addr, or NULL if one of the tables
+ * on the way is not present. page_size is set to the size the entry maps,
+ * or to the size the missing table would map. Huge entries are leaves
+ * whether present or lazy. Must be called with the lock held. */
+static pt_entry_t *get_pt_entry(struct pagemap_t *pagemap, size_t virt_addr,
+                                size_t *page_size) {
     size_t pml4_entry = (virt_addr & ((size_t)0x1ff << 39)) >> 39;
     size_t pdpt_entry = (virt_addr & ((size_t)0x1ff << 30)) >> 30;
     size_t pd_entry = (virt_addr & ((size_t)0x1ff << 21)) >> 21;
@@ -145,254 +404,598 @@ int map_page(struct pagemap_t *pagemap, size_t phys_addr, size_t virt_addr, size
 
     pt_entry_t *pdpt, *pd, *pt;
 
-    /* Check present flag */
-    if (pagemap->pml4[pml4_entry] & 0x1) {
-        /* Reference pdpt */
-        pdpt = (pt_entry_t *)((pagemap->pml4[pml4_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
-        /* Allocate a page for the pdpt. */
-        pdpt = (pt_entry_t *)((size_t)pmm_allocz(1) + MEM_PHYS_OFFSET);
-        /* Catch allocation failure */
-        if ((size_t)pdpt == MEM_PHYS_OFFSET)
-            goto fail1;
-        /* Present + writable + user (0b111) */
-        pagemap->pml4[pml4_entry] = (pt_entry_t)((size_t)pdpt - MEM_PHYS_OFFSET) | 0b111;
-    }
+    *page_size = (size_t)1 << 39;
+    if (!(pagemap->pml4[pml4_entry] & 0x1))
+        return NULL;
+    pdpt = (pt_entry_t *)((pagemap->pml4[pml4_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
 
-    /* Rinse and repeat */
-    if (pdpt[pdpt_entry] & 0x1) {
-        pd = (pt_entry_t *)((pdpt[pdpt_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
-        /* Allocate a page for the pd. */
-        pd = (pt_entry_t *)((size_t)pmm_allocz(1) + MEM_PHYS_OFFSET);
-        /* Catch allocation failure */
-        if ((size_t)pd == MEM_PHYS_OFFSET)
-            goto fail2;
-        /* Present + writable + user (0b111) */
-        pdpt[pdpt_entry] = (pt_entry_t)((size_t)pd - MEM_PHYS_OFFSET) | 0b111;
-    }
+    *page_size = PAGE_SIZE_1G;
+    if (pdpt[pdpt_entry] & PAGE_HUGE)
+        return &pdpt[pdpt_entry];
+    if (!(pdpt[pdpt_entry] & 0x1))
+        return NULL;
+    pd = (pt_entry_t *)((pdpt[pdpt_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
 
-    /* Once more */
-    if (pd[pd_entry] & 0x1) {
-        pt = (pt_entry_t *)((pd[pd_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
-        /* Allocate a page for the pt. */
-        pt = (pt_entry_t *)((size_t)pmm_allocz(1) + MEM_PHYS_OFFSET);
-        /* Catch allocation failure */
-        if ((size_t)pt == MEM_PHYS_OFFSET)
-            goto fail3;
-        /* Present + writable + user (0b111) */
-        pd[pd_entry] = (pt_entry_t)((size_t)pt - MEM_PHYS_OFFSET) | 0b111;
-    }
+    *page_size = PAGE_SIZE_2M;
+    if (pd[pd_entry] & PAGE_HUGE)
+        return &pd[pd_entry];
+    if (!(pd[pd_entry] & 0x1))
+        return NULL;
+    pt = (pt_entry_t *)((pd[pd_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
 
-    /* Set the entry as present and point it to the passed physical address */
-    /* Also set the specified flags */
-    pt[pt_entry] = (pt_entry_t)(phys_addr | flags);
+    *page_size = PAGE_SIZE;
+    return &pt[pt_entry];
+}
 
-    if ((size_t)pagemap->pml4 == read_cr("3")) {
-        // TODO: TLB shootdown
-        invlpg(virt_addr);
-    }
+/* Replace a shared 2 MiB copy-on-write entry by a table of small entries
+ * mapping the same frames, returns the table or NULL on failure. Must be
+ * called with the lock held. */
+static pt_entry_t *split_cow_entry(pt_entry_t *pte) {
+    pt_entry_t *pt = new_table();
+    if (!pt)
+        return NULL;
 
-    spinlock_release(&pagemap->lock);
-    return 0;
+    size_t page = *pte & ENTRY_ADDR_MASK;
+    pmm_split_page((void *)page, PAGE_SIZE_2M / PAGE_SIZE);
 
-    /* Free previous levels if empty */
-fail3:
-    for (size_t i = 0; ; i++) {
-        if (i == PAGE_TABLE_ENTRIES) {
-            /* We reached the end, table is free */
-            pmm_free((void *)pd - MEM_PHYS_OFFSET, 1);
-            break;
-        }
-        if (pd[i] & 0x1) {
-            /* Table is not free */
-            goto fail1;
+    for (size_t i = 0; i < PAGE_TABLE_ENTRIES; i++)
+        pt[i] = (page + i * PAGE_SIZE) | (*pte & 0xfff & ~(pt_entry_t)PAGE_HUGE);
+    *pte = ((size_t)pt - MEM_PHYS_OFFSET) | 0b111;
+    return pt;
+}
+
+/* Resolve a write fault on a copy-on-write page. The last mapping of a
+ * shared page simply takes it over, everybody else gets a private copy.
+ * Returns 0 if the fault was resolved, -1 if it was a genuine fault. */
+int vmm_handle_cow_fault(struct pagemap_t *pagemap, size_t virt_addr) {
+    spinlock_acquire(&pagemap->lock);
+
+    size_t page_size;
+    pt_entry_t *pte = get_pt_entry(pagemap, virt_addr, &page_size);
+    if (!pte)
+        goto fail;
+
+    pt_entry_t entry = *pte;
+
+    if (!(entry & 0x1))
+        goto fail;
+
+    /* Another thread already broke the sharing, the TLB entry was stale */
+    if (entry & 0x2)
+        goto out;
+
+    if (!(entry & PAGE_COW))
+        goto fail;
+
+    size_t page = entry & ENTRY_ADDR_MASK;
+    size_t flags = (entry & 0xfff & ~PAGE_COW) | 0x2;
+
+    if (page_size != PAGE_SIZE && pmm_page_shared((void *)page, page_size / PAGE_SIZE)) {
+        size_t new_page = (size_t)pmm_try_alloc(page_size / PAGE_SIZE);
+        if (new_page) {
+            memcpy64((char *)(new_page + MEM_PHYS_OFFSET),
+                     (char *)(page + MEM_PHYS_OFFSET),
+                     page_size);
+            *pte = new_page | flags;
+            goto shootdown;
         }
+
+        /* No contiguous memory left, split the huge page and only copy
+         * the faulting page */
+        pt_entry_t *pt;
+        if (page_size != PAGE_SIZE_2M || !(pt = split_cow_entry(pte)))
+            goto fail;
+        pte = &pt[(virt_addr & ((size_t)0x1ff << 12)) >> 12];
+        page = *pte & ENTRY_ADDR_MASK;
+        flags &= ~(size_t)PAGE_HUGE;
+        page_size = PAGE_SIZE;
     }
 
-fail2:
-    for (size_t i = 0; ; i++) {
-        if (i == PAGE_TABLE_ENTRIES) {
-            /* We reached the end, table is free */
-            pmm_free((void *)pdpt - MEM_PHYS_OFFSET, 1);
-            break;
-        }
-        if (pdpt[i] & 0x1) {
-            /* Table is not free */
-            goto fail1;
-        }
+    if (page_size == PAGE_SIZE && pmm_page_shared((void *)page, 1)) {
+        size_t new_page = (size_t)pmm_alloc(1);
+        if (!new_page)
+            goto fail;
+        memcpy64((char *)(new_page + MEM_PHYS_OFFSET),
+                 (char *)(page + MEM_PHYS_OFFSET),
+                 PAGE_SIZE);
+        *pte = new_page | flags;
+        goto shootdown;
     }
 
-fail1:
+    /* Stale read-only entries elsewhere only cause a spurious fault */
+    *pte = page | flags;
+    invlpg(virt_addr);
+
+out:
+    spinlock_release(&pagemap->lock);
+    return 0;
+
+shootdown:
+    spinlock_release(&pagemap->lock);
+    /* Other threads may still read the old page through their TLBs,
+     * invlpg of any address in a huge page drops all of it */
+    tlb_shootdown(pagemap, virt_addr, 1);
+    pmm_unref_page((void *)page, page_size / PAGE_SIZE);
+    return 0;
+
+fail:
     spinlock_release(&pagemap->lock);
     return -1;
 }
 
-int unmap_page(struct pagemap_t *pagemap, size_t virt_addr) {
+/* Reserve page_count pages of zeroed anonymous memory at virt_addr.
+ * Physical pages are only allocated when the range is first touched, aligned
+ * 2 MiB chunks get backed by a huge page if possible.
+ * Returns 0 on success, -1 on failure */
+int map_lazy_range(struct pagemap_t *pagemap, size_t virt_addr,
+                   size_t page_count, size_t flags) {
+    int flush = 0;
+
     spinlock_acquire(&pagemap->lock);
+    int ret = map_range_locked(pagemap, 0, virt_addr, page_count * PAGE_SIZE,
+                               PAGE_LAZY | (flags & ~(size_t)0x1), PAGE_SIZE_2M, &flush);
+    spinlock_release(&pagemap->lock);
 
-    /* Calculate the indices in the various tables using the virtual address */
-    size_t pml4_entry = (virt_addr & ((size_t)0x1ff << 39)) >> 39;
-    size_t pdpt_entry = (virt_addr & ((size_t)0x1ff << 30)) >> 30;
-    size_t pd_entry = (virt_addr & ((size_t)0x1ff << 21)) >> 21;
-    size_t pt_entry = (virt_addr & ((size_t)0x1ff << 12)) >> 12;
+    if (flush)
+        tlb_shootdown(pagemap, virt_addr, page_count);
 
-    pt_entry_t *pdpt, *pd, *pt;
+    return ret;
+}
 
-    /* Get reference to the various tables in sequence. Return -1 if one of the tables is not present,
-     * since we cannot unmap a virtual address if we don't know what it's mapped to in the first place */
-    if (pagemap->pml4[pml4_entry] & 0x1) {
-        pdpt = (pt_entry_t *)((pagemap->pml4[pml4_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
+/* Populate a lazy page on first access, and its lazy neighbours in the
+ * surrounding FAULT_AROUND_PAGES window which do not cross a page table.
+ * Returns 0 if the fault was resolved, -1 if it was a genuine fault. */
+int vmm_handle_lazy_fault(struct pagemap_t *pagemap, size_t virt_addr) {
+    void *huge_page = NULL;
+    int huge_tried = 0;
+
+retry:
+    spinlock_acquire(&pagemap->lock);
+
+    size_t page_size;
+    pt_entry_t *pte = get_pt_entry(pagemap, virt_addr, &page_size);
+    if (!pte)
         goto fail;
-    }
 
-    if (pdpt[pdpt_entry] & 0x1) {
-        pd = (pt_entry_t *)((pdpt[pdpt_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
+    /* Another thread already populated the page */
+    if (*pte & 0x1)
+        goto out;
+
+    if (!(*pte & PAGE_LAZY))
         goto fail;
-    }
 
-    if (pd[pd_entry] & 0x1) {
-        pt = (pt_entry_t *)((pd[pd_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
+    if (page_size == PAGE_SIZE_2M) {
+        if (!huge_tried) {
+            /* Zeroing 2 MiB takes a while, do it without the lock held and
+             * look at the entry again afterwards */
+            spinlock_release(&pagemap->lock);
+            huge_page = pmm_try_alloc(PAGE_SIZE_2M / PAGE_SIZE);
+            if (huge_page)
+                memset64((void *)((size_t)huge_page + MEM_PHYS_OFFSET), 0,
+                         PAGE_SIZE_2M / sizeof(uint64_t));
+            huge_tried = 1;
+            goto retry;
+        }
+
+        if (huge_page) {
+            *pte = (size_t)huge_page | (*pte & 0xfff & ~PAGE_LAZY) | 0x1;
+            huge_page = NULL;
+            goto out;
+        }
+
+        /* No contiguous memory left, split the reservation into small pages */
+        pt_entry_t *pt = new_table();
+        if (!pt)
+            goto fail;
+        for (size_t i = 0; i < PAGE_TABLE_ENTRIES; i++)
+            pt[i] = *pte & 0xfff & ~(pt_entry_t)PAGE_HUGE;
+        *pte = ((size_t)pt - MEM_PHYS_OFFSET) | 0b111;
+        pte = &pt[(virt_addr & ((size_t)0x1ff << 12)) >> 12];
+    } else if (page_size != PAGE_SIZE) {
         goto fail;
     }
 
-    /* Unmap entry */
-    pt[pt_entry] = 0;
+    size_t window = FAULT_AROUND_PAGES * PAGE_SIZE;
+    size_t start = virt_addr & ~(window - 1);
+    pte -= (virt_addr - start) / PAGE_SIZE;
+
+    for (size_t i = 0; i < FAULT_AROUND_PAGES; i++) {
+        size_t addr = start + i * PAGE_SIZE;
+        if (!(pte[i] & PAGE_LAZY) || (pte[i] & 0x1))
+            continue;
+
+        void *page = pmm_allocz(1);
+        if (!page) {
+            /* Only the faulting page itself is mandatory */
+            if (addr == (virt_addr & ~(size_t)(PAGE_SIZE - 1)))
+                goto fail;
+            continue;
+        }
 
-    if ((size_t)pagemap->pml4 == read_cr("3")) {
-        // TODO: TLB shootdown
-        invlpg(virt_addr);
+        pte[i] = (size_t)page | (pte[i] & 0xfff & ~PAGE_LAZY) | 0x1;
     }
 
-    /* Free previous levels if empty */
-    for (size_t i = 0; ; i++) {
-        if (i == PAGE_TABLE_ENTRIES) {
-            /* We reached the end, table is free */
-            pmm_free((void *)pt - MEM_PHYS_OFFSET, 1);
-            break;
+out:
+    spinlock_release(&pagemap->lock);
+    /* The reservation changed while the huge page was being zeroed */
+    if (huge_page)
+        pmm_free(huge_page, PAGE_SIZE_2M / PAGE_SIZE);
+    return 0;
+
+fail:
+    spinlock_release(&pagemap->lock);
+    if (huge_page)
+        pmm_free(huge_page, PAGE_SIZE_2M / PAGE_SIZE);
+    return -1;
+}
+
+/* Walk down to the entry which maps page_size bytes at virt_addr, creating
+ * the missing tables on the way. Returns NULL if a huge page is in the way
+ * of a smaller one, or a table is in the way of a huge page. Must be called
+ * with the lock held. */
+static pt_entry_t *walk_create_locked(struct pagemap_t *pagemap, size_t virt_addr,
+                                      size_t page_size) {
+    size_t indices[] = {
+        (virt_addr & ((size_t)0x1ff << 39)) >> 39,
+        (virt_addr & ((size_t)0x1ff << 30)) >> 30,
+        (virt_addr & ((size_t)0x1ff << 21)) >> 21,
+        (virt_addr & ((size_t)0x1ff << 12)) >> 12
+    };
+    size_t level_sizes[] = { 0, PAGE_SIZE_1G, PAGE_SIZE_2M, PAGE_SIZE };
+
+    pt_entry_t *table = pagemap->pml4;
+
+    for (size_t level = 0; ; level++) {
+        pt_entry_t *entry = &table[indices[level]];
+
+        if (level_sizes[level] == page_size) {
+            /* Don't replace a table with a huge page */
+            if (page_size != PAGE_SIZE && (*entry & 0x1) && !(*entry & PAGE_HUGE))
+                return NULL;
+            return entry;
         }
-        if (pt[i] & 0x1) {
-            /* Table is not free */
-            goto out;
+
+        /* A huge page is in the way */
+        if (level && (*entry & PAGE_HUGE))
+            return NULL;
+
+        if (!(*entry & 0x1)) {
+            pt_entry_t *new = new_table();
+            if (!new)
+                return NULL;
+            /* Present + writable + user (0b111) */
+            *entry = (pt_entry_t)((size_t)new - MEM_PHYS_OFFSET) | 0b111;
         }
+
+        table = (pt_entry_t *)((*entry & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
     }
+}
 
-    for (size_t i = 0; ; i++) {
-        if (i == PAGE_TABLE_ENTRIES) {
-            /* We reached the end, table is free */
-            pmm_free((void *)pd - MEM_PHYS_OFFSET, 1);
-            break;
-        }
-        if (pd[i] & 0x1) {
-            /* Table is not free */
-            goto out;
+/* Fill the entries for length bytes at virt_addr in a single walk, using
+ * pages up to max_page_size where the alignment allows. With PAGE_LAZY in
+ * flags the entries are reservations and phys_addr is ignored. flush is set
+ * if present entries were replaced. Must be called with the lock held. */
+static int map_range_locked(struct pagemap_t *pagemap, size_t phys_addr,
+                            size_t virt_addr, size_t length, size_t flags,
+                            size_t max_page_size, int *flush) {
+    static const size_t huge_sizes[] = { PAGE_SIZE_1G, PAGE_SIZE_2M };
+    int lazy = !!(flags & PAGE_LAZY);
+
+    for (size_t offset = 0; offset < length; ) {
+        size_t phys = lazy ? 0 : phys_addr + offset;
+        size_t virt = virt_addr + offset;
+        size_t left = length - offset;
+        pt_entry_t *entry;
+
+        size_t page_size = PAGE_SIZE;
+        for (size_t i = 0; i < sizeof(huge_sizes) / sizeof(size_t); i++) {
+            size_t size = huge_sizes[i];
+            if (size > max_page_size || (size == PAGE_SIZE_1G && !huge_1g_supported))
+                continue;
+            if (left < size || ((phys | virt) & (size - 1)))
+                continue;
+            if ((entry = walk_create_locked(pagemap, virt, size))) {
+                page_size = size;
+                break;
+            }
         }
-    }
 
-    for (size_t i = 0; ; i++) {
-        if (i == PAGE_TABLE_ENTRIES) {
-            /* We reached the end, table is free */
-            pmm_free((void *)pdpt - MEM_PHYS_OFFSET, 1);
-            break;
+        if (page_size != PAGE_SIZE) {
+            if (*entry & 0x1)
+                *flush = 1;
+            *entry = (pt_entry_t)(phys | flags | PAGE_HUGE);
+            offset += page_size;
+            continue;
         }
-        if (pdpt[i] & 0x1) {
-            /* Table is not free */
-            goto out;
+
+        entry = walk_create_locked(pagemap, virt, PAGE_SIZE);
+        if (!entry)
+            return -1;
+
+        /* Fill the rest of the page table in one go */
+        size_t count = PAGE_TABLE_ENTRIES - ((virt & ((size_t)0x1ff << 12)) >> 12);
+        if (count > left / PAGE_SIZE)
+            count = left / PAGE_SIZE;
+
+        for (size_t i = 0; i < count; i++) {
+            if (entry[i] & 0x1)
+                *flush = 1;
+            entry[i] = (pt_entry_t)((lazy ? 0 : phys + i * PAGE_SIZE) | flags);
         }
+
+        offset += count * PAGE_SIZE;
     }
 
-out:
-    spinlock_release(&pagemap->lock);
     return 0;
+}
 
-fail:
+/* Map length bytes of physical memory at virt_addr, using the largest pages
+ * the alignment of both addresses allows, and falling back to smaller pages
+ * where tables are already in the way */
+/* Returns 0 on success, -1 on failure */
+int map_range(struct pagemap_t *pagemap, size_t phys_addr, size_t virt_addr,
+              size_t length, size_t flags) {
+    int flush = 0;
+
+    length = DIV_ROUNDUP(length, PAGE_SIZE) * PAGE_SIZE;
+
+    spinlock_acquire(&pagemap->lock);
+    int ret = map_range_locked(pagemap, phys_addr, virt_addr, length, flags,
+                               PAGE_SIZE_1G, &flush);
     spinlock_release(&pagemap->lock);
-    return -1;
+
+    /* Only present entries can be cached */
+    if (flush)
+        tlb_shootdown(pagemap, virt_addr, length / PAGE_SIZE);
+
+    return ret;
 }
 
-/* Update flags for a mapping */
-int remap_page(struct pagemap_t *pagemap, size_t virt_addr, size_t flags) {
+/* map physaddr -> virtaddr using pml4 pointer */
+/* Returns 0 on success, -1 on failure */
+int map_page(struct pagemap_t *pagemap, size_t phys_addr, size_t virt_addr, size_t flags) {
+    int flush = 0;
+
     spinlock_acquire(&pagemap->lock);
+    int ret = map_range_locked(pagemap, phys_addr, virt_addr, PAGE_SIZE, flags,
+                               PAGE_SIZE, &flush);
+    spinlock_release(&pagemap->lock);
 
-    /* Calculate the indices in the various tables using the virtual address */
-    size_t pml4_entry = (virt_addr & ((size_t)0x1ff << 39)) >> 39;
-    size_t pdpt_entry = (virt_addr & ((size_t)0x1ff << 30)) >> 30;
-    size_t pd_entry = (virt_addr & ((size_t)0x1ff << 21)) >> 21;
-    size_t pt_entry = (virt_addr & ((size_t)0x1ff << 12)) >> 12;
+    if (flush)
+        tlb_shootdown(pagemap, virt_addr, 1);
 
-    pt_entry_t *pdpt, *pd, *pt;
+    return ret;
+}
 
-    /* Get reference to the various tables in sequence. Return -1 if one of the tables is not present,
-     * since we cannot unmap a virtual address if we don't know what it's mapped to in the first place */
-    if (pagemap->pml4[pml4_entry] & 0x1) {
-        pdpt = (pt_entry_t *)((pagemap->pml4[pml4_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
-        goto fail;
-    }
+/* Map a single 2 MiB or 1 GiB page, both addresses must be aligned to it */
+/* Returns 0 on success, -1 on failure */
+int map_huge_page(struct pagemap_t *pagemap, size_t phys_addr, size_t virt_addr,
+                  size_t flags, size_t page_size) {
+    if (page_size != PAGE_SIZE_2M
+     && !(page_size == PAGE_SIZE_1G && huge_1g_supported))
+        return -1;
 
-    if (pdpt[pdpt_entry] & 0x1) {
-        pd = (pt_entry_t *)((pdpt[pdpt_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
-        goto fail;
+    if ((phys_addr | virt_addr) & (page_size - 1))
+        return -1;
+
+    spinlock_acquire(&pagemap->lock);
+
+    pt_entry_t *entry = walk_create_locked(pagemap, virt_addr, page_size);
+    if (!entry) {
+        spinlock_release(&pagemap->lock);
+        return -1;
     }
 
-    if (pd[pd_entry] & 0x1) {
-        pt = (pt_entry_t *)((pd[pd_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
-        goto fail;
+    pt_entry_t old_entry = *entry;
+    *entry = (pt_entry_t)(phys_addr | flags | PAGE_HUGE);
+
+    spinlock_release(&pagemap->lock);
+
+    /* invlpg of any address in a huge page drops all of it */
+    if (old_entry & 0x1)
+        tlb_shootdown(pagemap, virt_addr, 1);
+
+    return 0;
+}
+
+/* Remove the mappings and reservations for length bytes at virt_addr. A
+ * huge page is unmapped as a whole if the range touches it. Page tables
+ * left empty are freed once, after the TLBs were flushed. */
+/* Returns 0 on success, -1 if nothing was mapped in the range */
+int unmap_range(struct pagemap_t *pagemap, size_t virt_addr, size_t length) {
+    size_t end = virt_addr + DIV_ROUNDUP(length, PAGE_SIZE) * PAGE_SIZE;
+    int flush = 0, found = 0;
+
+    spinlock_acquire(&pagemap->lock);
+
+    for (size_t virt = virt_addr; virt < end; ) {
+        size_t span;
+        pt_entry_t *entry = get_pt_entry(pagemap, virt, &span);
+
+        if (!entry || span != PAGE_SIZE) {
+            if (entry && *entry) {
+                found = 1;
+                if (*entry & 0x1)
+                    flush = 1;
+                *entry = 0;
+            }
+            virt = (virt & ~(span - 1)) + span;
+            continue;
+        }
+
+        size_t count = PAGE_TABLE_ENTRIES - ((virt & ((size_t)0x1ff << 12)) >> 12);
+        if (count > (end - virt) / PAGE_SIZE)
+            count = (end - virt) / PAGE_SIZE;
+
+        for (size_t i = 0; i < count; i++) {
+            if (entry[i])
+                found = 1;
+            if (entry[i] & 0x1)
+                flush = 1;
+            entry[i] = 0;
+        }
+
+        virt += count * PAGE_SIZE;
     }
 
-    /* Update flags */
-    pt[pt_entry] = (pt[pt_entry] & 0xfffffffffffff000) | flags;
+    /* Unlink the tables left empty, bottom up. They are chained through
+     * their first entry, which stays non-present as the link is page
+     * aligned, so a CPU still walking them sees nothing until the flush.
+     * The kernel half pdpts are shared by all address spaces and are
+     * never freed. */
+    pt_entry_t *free_list = NULL;
+    static const size_t table_spans[] = { PAGE_SIZE_2M, PAGE_SIZE_1G, (size_t)1 << 39 };
+
+    for (size_t level = 0; level < 3; level++) {
+        size_t span = table_spans[level];
+        for (size_t virt = virt_addr & ~(span - 1); virt < end; virt += span) {
+            size_t pml4_entry = (virt & ((size_t)0x1ff << 39)) >> 39;
+            size_t pdpt_entry = (virt & ((size_t)0x1ff << 30)) >> 30;
+            size_t pd_entry = (virt & ((size_t)0x1ff << 21)) >> 21;
+
+            if (level == 2 && pml4_entry >= PAGE_TABLE_ENTRIES / 2)
+                break;
+
+            /* Find the entry pointing to the table covering this span */
+            pt_entry_t *parent = &pagemap->pml4[pml4_entry];
+            if (level < 2) {
+                if (!(*parent & 0x1))
+                    continue;
+                parent = (pt_entry_t *)((*parent & 0xfffffffffffff000) + MEM_PHYS_OFFSET) + pdpt_entry;
+            }
+            if (level < 1) {
+                if (!(*parent & 0x1) || (*parent & PAGE_HUGE))
+                    continue;
+                parent = (pt_entry_t *)((*parent & 0xfffffffffffff000) + MEM_PHYS_OFFSET) + pd_entry;
+            }
+            if (!(*parent & 0x1) || (*parent & PAGE_HUGE))
+                continue;
 
-    if ((size_t)pagemap->pml4 == read_cr("3")) {
-        // TODO: TLB shootdown
-        invlpg(virt_addr);
+            pt_entry_t *table = (pt_entry_t *)((*parent & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+            if (!table_empty(table))
+                continue;
+
+            *parent = 0;
+            table[0] = (pt_entry_t)free_list;
+            free_list = table;
+        }
     }
 
     spinlock_release(&pagemap->lock);
-    return 0;
 
-fail:
+    if (flush || free_list)
+        tlb_shootdown(pagemap, virt_addr, (end - virt_addr) / PAGE_SIZE);
+
+    while (free_list) {
+        pt_entry_t *next = (pt_entry_t *)free_list[0];
+        pmm_free((void *)free_list - MEM_PHYS_OFFSET, 1);
+        free_list = next;
+    }
+
+    return found ? 0 : -1;
+}
+
+int unmap_page(struct pagemap_t *pagemap, size_t virt_addr) {
+    return unmap_range(pagemap, virt_addr, PAGE_SIZE);
+}
+
+/* Change the flags of the mappings and reservations for length bytes at
+ * virt_addr. Huge pages keep their size. Pages shared copy-on-write stay
+ * read-only until they are written to. */
+/* Returns 0 on success, -1 if nothing was mapped in the range */
+int protect_range(struct pagemap_t *pagemap, size_t virt_addr, size_t length,
+                  size_t flags) {
+    size_t end = virt_addr + DIV_ROUNDUP(length, PAGE_SIZE) * PAGE_SIZE;
+    int flush = 0, found = 0;
+
+    spinlock_acquire(&pagemap->lock);
+
+    for (size_t virt = virt_addr; virt < end; ) {
+        size_t span;
+        pt_entry_t *entry = get_pt_entry(pagemap, virt, &span);
+
+        size_t count = 1;
+        if (entry && span == PAGE_SIZE) {
+            count = PAGE_TABLE_ENTRIES - ((virt & ((size_t)0x1ff << 12)) >> 12);
+            if (count > (end - virt) / PAGE_SIZE)
+                count = (end - virt) / PAGE_SIZE;
+        }
+
+        for (size_t i = 0; entry && i < count; i++) {
+            pt_entry_t old_entry = entry[i];
+            pt_entry_t new_entry;
+
+            if (!old_entry)
+                continue;
+            found = 1;
+
+            if (!(old_entry & 0x1)) {
+                if (old_entry & PAGE_LAZY)
+                    entry[i] = (old_entry & PAGE_HUGE) | PAGE_LAZY | (flags & ~(size_t)0x1);
+                continue;
+            }
+
+            new_entry = (old_entry & ENTRY_ADDR_MASK) | (old_entry & PAGE_HUGE) | flags;
+            if ((flags & 0x02) && virt < 0x800000000000
+             && ((old_entry & PAGE_COW) || pmm_page_shared((void *)(old_entry & ENTRY_ADDR_MASK), span / PAGE_SIZE)))
+                new_entry = (new_entry & ~(pt_entry_t)0x02) | PAGE_COW;
+
+            if (new_entry != old_entry)
+                flush = 1;
+            entry[i] = new_entry;
+        }
+
+        if (entry && span == PAGE_SIZE)
+            virt += count * PAGE_SIZE;
+        else
+            virt = (virt & ~(span - 1)) + span;
+    }
+
     spinlock_release(&pagemap->lock);
-    return -1;
+
+    if (flush)
+        tlb_shootdown(pagemap, virt_addr, (end - virt_addr) / PAGE_SIZE);
+
+    return found ? 0 : -1;
+}
+
+/* Update flags for a mapping */
+int remap_page(struct pagemap_t *pagemap, size_t virt_addr, size_t flags) {
+    return protect_range(pagemap, virt_addr, PAGE_SIZE, flags);
 }
 
 /* Map the first 4GiB of memory, this saves issues with MMIO hardware < 4GiB later on */
 /* Then use the e820 to map all the available memory (saves on allocation time and it's easier) */
 /* The physical memory is mapped at the beginning of the higher half (entry 256 of the pml4) onwards */
 void init_vmm(struct stivale_memmap_t *memmap) {
+    uint32_t eax, ebx, ecx, edx;
+    if (cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx) && (edx & (1 << 26)))
+        huge_1g_supported = 1;
+
     kernel_pagemap->pml4 = (pt_entry_t *)((size_t)pmm_allocz(1) + MEM_PHYS_OFFSET);
     if ((size_t)kernel_pagemap->pml4 == MEM_PHYS_OFFSET)
         panic(NULL, 1, "init_vmm failure");
 
-    spinlock_release(&kernel_pagemap->lock);
+    kernel_pagemap->lock = new_lock;
 
     kprint(KPRN_INFO, "vmm: Mapping memory");
 
     /* Identity map the first 32 MiB */
-    /* Map 32 MiB for the phys mem area, and 32 MiB for the kernel in the higher half */
+    /* Map 32 MiB for the kernel in the higher half. These stay small pages,
+     * guard pages get punched into the kernel image later on */
     for (size_t i = 0; i < (0x2000000 / PAGE_SIZE); i++) {
         size_t addr = i * PAGE_SIZE;
         map_page(kernel_pagemap, addr, addr, 0x03);
-        map_page(kernel_pagemap, addr, MEM_PHYS_OFFSET + addr, 0x03);
         map_page(kernel_pagemap, addr, KERNEL_PHYS_OFFSET + addr, 0x03 | (1 << 8));
     }
 
+    /* Forcefully map the first 4 GiB for I/O into the higher half, with
+     * the largest pages available */
+    map_range(kernel_pagemap, 0, MEM_PHYS_OFFSET, 0x100000000, 0x03);
+
     /* Reload new pagemap */
     write_cr("3", (size_t)kernel_pagemap->pml4 - MEM_PHYS_OFFSET);
 
-    /* Forcefully map the first 4 GiB for I/O into the higher half */
-    for (size_t i = 0; i < (0x100000000 / PAGE_SIZE); i++) {
-        size_t addr = i * PAGE_SIZE;
-
-        map_page(kernel_pagemap, addr, MEM_PHYS_OFFSET + addr, 0x03);
-    }
-
     /* Map the rest according to e820 into the higher half */
     for (size_t i = 0; i < memmap->entries; i++) {
         struct stivale_memmap_entry_t *entry = &(memmap->address[i]);
@@ -402,17 +1005,18 @@ void init_vmm(struct stivale_memmap_t *memmap) {
         if (entry->base % PAGE_SIZE)
             aligned_length += PAGE_SIZE;
 
-        for (size_t j = 0; j * PAGE_SIZE < aligned_length; j++) {
-            size_t addr = aligned_base + j * PAGE_SIZE;
-
-            /* Skip over first 4 GiB */
-            if (addr < 0x100000000)
-                continue;
-
-            map_page(kernel_pagemap, addr, MEM_PHYS_OFFSET + addr, 0x03);
+        /* Skip over first 4 GiB */
+        if (aligned_base + aligned_length <= 0x100000000)
+            continue;
+        if (aligned_base < 0x100000000) {
+            aligned_length -= 0x100000000 - aligned_base;
+            aligned_base = 0x100000000;
         }
+
+        map_range(kernel_pagemap, aligned_base, MEM_PHYS_OFFSET + aligned_base,
+                  aligned_length, 0x03);
     }
 
-    /* lol bug fix */
-    pmm_change_allocation_method();
+    /* All of physical memory is mapped now, let the PMM hand it out */
+    pmm_add_high_memory(memmap);
 }
@@ -91,11 +91,9 @@ int elf_load(int fd, struct pagemap_t *pagemap, size_t base, struct auxval_t *au
         size_t pf = 0x05;
         if(phdr[i].p_flags & PF_W)
             pf |= 0x02;
-        for (size_t j = 0; j < page_count; j++) {
-            size_t virt = base + phdr[i].p_vaddr + (j * PAGE_SIZE);
-            size_t phys = (size_t)addr + (j * PAGE_SIZE);
-            map_page(pagemap, phys, virt, pf);
-        }
+        map_range(pagemap, (size_t)addr,
+                  (base + phdr[i].p_vaddr) & ~(PAGE_SIZE - 1),
+                  page_count * PAGE_SIZE, pf);
 
         ret = lseek(fd, phdr[i].p_offset, SEEK_SET);
         if (ret == -1) {
@@ -0,0 +1,283 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <proc/futex.h>
+#include <proc/task.h>
+#include <lib/lock.h>
+#include <lib/errno.h>
+#include <lib/time.h>
+#include <sys/cpu.h>
+#include <sys/timer.h>
+
+/* Threads waiting on a futex are queued in a hash table keyed by address
+ * space and user address, through nodes living on their own stacks. Each
+ * bucket has its own lock, and the futex word is only read with it held, so
+ * a waker which changes the word before calling futex_wake() cannot miss a
+ * thread on its way to sleep.
+ * Bucket locks are never taken from interrupt context. Timeouts only wake
+ * the waiting thread up, which then takes itself off its bucket. */
+
+#define FUTEX_HASH_BITS 8
+#define FUTEX_BUCKETS (1 << FUTEX_HASH_BITS)
+
+struct futex_bucket_t;
+
+struct futex_waiter_t {
+    struct pagemap_t *pagemap;
+    size_t addr;
+    struct thread_t *thread;
+    /* Bucket the waiter is queued on, NULL once it got woken up */
+    struct futex_bucket_t *bucket;
+    struct futex_waiter_t *next;
+    struct futex_waiter_t *prev;
+};
+
+struct futex_bucket_t {
+    lock_t lock;
+    /* Waiters in the order they went to sleep */
+    struct futex_waiter_t *head;
+    struct futex_waiter_t *tail;
+};
+
+static struct futex_bucket_t futex_buckets[FUTEX_BUCKETS] = {
+    [0 ... FUTEX_BUCKETS - 1] = { new_lock, NULL, NULL }
+};
+
+static inline struct futex_bucket_t *futex_bucket(struct pagemap_t *pagemap, size_t addr) {
+    uint64_t key = ((size_t)pagemap >> 4) ^ (addr >> 2);
+    return &futex_buckets[(key * 0x9e3779b97f4a7c15) >> (64 - FUTEX_HASH_BITS)];
+}
+
+static struct pagemap_t *futex_current_pagemap(void) {
+    sched_lock();
+    struct pagemap_t *pagemap = process_table[CURRENT_PROCESS]->pagemap;
+    sched_unlock();
+    return pagemap;
+}
+
+/* Must be called with the bucket lock held */
+static void futex_link_locked(struct futex_bucket_t *bucket, struct futex_waiter_t *waiter) {
+    waiter->next = NULL;
+    waiter->prev = bucket->tail;
+    if (bucket->tail)
+        bucket->tail->next = waiter;
+    else
+        bucket->head = waiter;
+    bucket->tail = waiter;
+    locked_write(struct futex_bucket_t *, &waiter->bucket, bucket);
+}
+
+/* Must be called with the bucket lock held. Leaves waiter->bucket alone. */
+static void futex_unlink_locked(struct futex_bucket_t *bucket, struct futex_waiter_t *waiter) {
+    if (waiter->prev)
+        waiter->prev->next = waiter->next;
+    else
+        bucket->head = waiter->next;
+    if (waiter->next)
+        waiter->next->prev = waiter->prev;
+    else
+        bucket->tail = waiter->prev;
+}
+
+/* Must be called with the bucket lock held. The waiting thread only looks at
+ * its waiter with the lock held, see futex_queued(), so it cannot tell the
+ * two steps apart or return while its thread is still being woken up. */
+static void futex_wake_locked(struct futex_bucket_t *bucket, struct futex_waiter_t *waiter) {
+    futex_unlink_locked(bucket, waiter);
+    task_wake(waiter->thread);
+    locked_write(struct futex_bucket_t *, &waiter->bucket, NULL);
+}
+
+/* Returns whether a waiter is still queued, checked under the lock of its
+ * bucket so that a wakeup is either seen here or comes after the call */
+static int futex_queued(struct futex_waiter_t *waiter) {
+    for (;;) {
+        struct futex_bucket_t *bucket =
+            locked_read(struct futex_bucket_t *, &waiter->bucket);
+        if (!bucket)
+            return 0;
+        spinlock_acquire(&bucket->lock);
+        /* It may have been requeued before we got the lock */
+        int queued = waiter->bucket == bucket;
+        spinlock_release(&bucket->lock);
+        if (queued)
+            return 1;
+    }
+}
+
+/* Take a waiter off whichever bucket it sits on. Returns 1 if it was still
+ * queued, 0 if a wakeup got to it first. */
+static int futex_unqueue(struct futex_waiter_t *waiter) {
+    for (;;) {
+        struct futex_bucket_t *bucket =
+            locked_read(struct futex_bucket_t *, &waiter->bucket);
+        if (!bucket)
+            return 0;
+        spinlock_acquire(&bucket->lock);
+        /* It may have been requeued before we got the lock */
+        if (waiter->bucket == bucket) {
+            futex_unlink_locked(bucket, waiter);
+            locked_write(struct futex_bucket_t *, &waiter->bucket, NULL);
+            spinlock_release(&bucket->lock);
+            return 1;
+        }
+        spinlock_release(&bucket->lock);
+    }
+}
+
+static void futex_timer_wake(void *thread) {
+    task_wake(thread);
+}
+
+/* Sleep as long as *uaddr holds expected, until futex_wake() is called on
+ * it or get_uptime_ns() reaches deadline. A deadline of 0 means no timeout.
+ * Returns 0 once woken up, -1 with errno set to EAGAIN if *uaddr did not
+ * match, ETIMEDOUT if the deadline passed or EINTR if the wait got aborted. */
+int futex_wait(int *uaddr, int expected, uint64_t deadline) {
+    struct timer_t timer = { .cpu = -1 };
+    struct futex_waiter_t waiter;
+
+    if ((size_t)uaddr & (sizeof(int) - 1)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    sched_lock();
+    struct thread_t *thread = task_table[CURRENT_TASK];
+    sched_unlock();
+
+    waiter.pagemap = futex_current_pagemap();
+    waiter.addr = (size_t)uaddr;
+    waiter.thread = thread;
+
+    struct futex_bucket_t *bucket = futex_bucket(waiter.pagemap, waiter.addr);
+
+    spinlock_acquire(&bucket->lock);
+    if (*(volatile int *)uaddr != expected) {
+        spinlock_release(&bucket->lock);
+        errno = EAGAIN;
+        return -1;
+    }
+    futex_link_locked(bucket, &waiter);
+    spinlock_release(&bucket->lock);
+
+    for (;;) {
+        /* Holding scheduler_lock keeps us from being switched out between
+         * blocking and rescheduling */
+        sched_lock();
+
+        task_block(thread);
+
+        /* task_tkill() and task_tpause() set event_abrt before waking us */
+        if (!futex_queued(&waiter)
+         || locked_read(int, &thread->event_abrt)
+         || (deadline && deadline <= get_uptime_ns())) {
+            sched_unlock();
+            task_wake(thread);
+            break;
+        }
+
+        if (deadline)
+            timer_arm(&timer, deadline, futex_timer_wake, thread);
+        force_resched();
+
+        timer_cancel(&timer);
+        task_wake(thread);
+    }
+
+    if (futex_unqueue(&waiter)) {
+        errno = locked_read(int, &thread->event_abrt) ? EINTR : ETIMEDOUT;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Wake up to count threads waiting on uaddr, oldest first. Returns the
+ * number of threads woken up. */
+int futex_wake(int *uaddr, int count) {
+    struct pagemap_t *pagemap = futex_current_pagemap();
+    size_t addr = (size_t)uaddr;
+    struct futex_bucket_t *bucket = futex_bucket(pagemap, addr);
+    int woken = 0;
+
+    spinlock_acquire(&bucket->lock);
+
+    struct futex_waiter_t *waiter = bucket->head;
+    while (waiter && woken < count) {
+        struct futex_waiter_t *next = waiter->next;
+        if (waiter->pagemap == pagemap && waiter->addr == addr) {
+            futex_wake_locked(bucket, waiter);
+            woken++;
+        }
+        waiter = next;
+    }
+
+    spinlock_release(&bucket->lock);
+
+    return woken;
+}
+
+/* If *uaddr holds expected, wake up to nr_wake threads waiting on uaddr and
+ * move up to nr_requeue of the remaining ones over to uaddr2, so that a
+ * broadcast doesn't wake threads which would only block again on the mutex.
+ * Returns the number of threads woken up or moved, -1 with errno set to
+ * EAGAIN if *uaddr did not match. */
+int futex_requeue(int *uaddr, int nr_wake, int *uaddr2, int nr_requeue, int expected) {
+    if (uaddr == uaddr2 || ((size_t)uaddr2 & (sizeof(int) - 1))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct pagemap_t *pagemap = futex_current_pagemap();
+    size_t addr = (size_t)uaddr;
+    size_t addr2 = (size_t)uaddr2;
+    struct futex_bucket_t *bucket = futex_bucket(pagemap, addr);
+    struct futex_bucket_t *bucket2 = futex_bucket(pagemap, addr2);
+
+    /* Take the two locks in address order */
+    if (bucket < bucket2) {
+        spinlock_acquire(&bucket->lock);
+        spinlock_acquire(&bucket2->lock);
+    } else if (bucket > bucket2) {
+        spinlock_acquire(&bucket2->lock);
+        spinlock_acquire(&bucket->lock);
+    } else {
+        spinlock_acquire(&bucket->lock);
+    }
+
+    int ret = -1;
+
+    if (*(volatile int *)uaddr != expected) {
+        errno = EAGAIN;
+        goto out;
+    }
+
+    int woken = 0;
+    int requeued = 0;
+
+    struct futex_waiter_t *waiter = bucket->head;
+    while (waiter && (woken < nr_wake || requeued < nr_requeue)) {
+        struct futex_waiter_t *next = waiter->next;
+        if (waiter->pagemap == pagemap && waiter->addr == addr) {
+            if (woken < nr_wake) {
+                futex_wake_locked(bucket, waiter);
+                woken++;
+            } else {
+                futex_unlink_locked(bucket, waiter);
+                waiter->addr = addr2;
+                futex_link_locked(bucket2, waiter);
+                requeued++;
+            }
+        }
+        waiter = next;
+    }
+
+    ret = woken + requeued;
+
+out:
+    if (bucket != bucket2)
+        spinlock_release(&bucket2->lock);
+    spinlock_release(&bucket->lock);
+
+    return ret;
+}
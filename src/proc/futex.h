@@ -0,0 +1,11 @@
+#ifndef __FUTEX_H__
+#define __FUTEX_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+int futex_wait(int *, int, uint64_t);
+int futex_wake(int *, int);
+int futex_requeue(int *, int, int *, int, int);
+
+#endif
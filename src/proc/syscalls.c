@@ -1,8 +1,10 @@
 #include <stdint.h>
 #include <stddef.h>
+#include <limits.h>
 #include <lib/klib.h>
 #include <sys/smp.h>
 #include <proc/task.h>
+#include <proc/futex.h>
 #include <lib/lock.h>
 #include <fd/vfs/vfs.h>
 #include <fd/pipe/pipe.h>
@@ -14,7 +16,6 @@
 #include <devices/term/tty/tty.h>
 #include <sys/urm.h>
 #include <net/hostname.h>
-#include <sys/hpet.h>
 #include <lib/cstring.h>
 #include <lib/cmem.h>
 
@@ -27,30 +28,35 @@ static inline int privilege_check(size_t base, size_t len) {
 }
 
 void enter_syscall(int syscall) {
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_task = cpu_locals[current_cpu].current_task;
     struct thread_t *thread = task_table[current_task];
 
     while (locked_read(int, &thread->event_abrt)) {
-        spinlock_release(&scheduler_lock);
+        sched_unlock();
         yield();
-        spinlock_acquire(&scheduler_lock);
+        sched_lock();
     }
 
+    /* Charge the time until now as user time */
+    task_account(thread, get_uptime_ns());
     locked_write(int, &thread->in_syscall, 1);
     thread->last_syscall = syscall;
 
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 }
 
 void leave_syscall(void) {
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_task = cpu_locals[current_cpu].current_task;
     struct thread_t *thread = task_table[current_task];
 
     int *in_syscall_ptr = &thread->in_syscall;
 
-    spinlock_release(&scheduler_lock);
+    /* Charge the syscall as system time */
+    task_account(thread, get_uptime_ns());
+
+    sched_unlock();
 
     locked_write(int, in_syscall_ptr, 0);
 }
@@ -64,10 +70,10 @@ int syscall_poll(struct regs_t *regs) {
     size_t         nfds    = (size_t)regs->rsi;
     int            timeout = (int)regs->rdx;
 
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     struct pollfd *system_fds = kalloc(sizeof(struct pollfd) * nfds);
     for (size_t i = 0; i < nfds; i++) {
@@ -90,21 +96,114 @@ int syscall_poll(struct regs_t *regs) {
 
 int syscall_sleep(struct regs_t *regs) {
     unsigned int secs = (unsigned int)regs->rdi;
-    relaxed_sleep(secs * HPET_FREQUENCY_HZ);
+    relaxed_sleep((uint64_t)secs * 1000);
+    return 0;
+}
+
+/* Sleep up to an uptime deadline, filling in rem on interruption */
+static int do_nanosleep(uint64_t deadline, struct timespec *rem) {
+    if (task_sleep_until(deadline) == -1) {
+        if (rem) {
+            uint64_t now = get_uptime_ns();
+            uint64_t left = deadline > now ? deadline - now : 0;
+            rem->tv_sec = left / 1000000000;
+            rem->tv_nsec = left % 1000000000;
+        }
+        errno = EINTR;
+        return -1;
+    }
+    return 0;
+}
+
+static int timespec_to_ns(const struct timespec *ts, uint64_t *ns) {
+    if (ts->tv_sec < 0 || ts->tv_nsec < 0 || ts->tv_nsec >= 1000000000)
+        return -1;
+    /* Clamp anything past a few centuries */
+    if ((uint64_t)ts->tv_sec >= (uint64_t)-1 / 1000000000 - 1)
+        *ns = (uint64_t)-1 / 2;
+    else
+        *ns = (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
     return 0;
 }
 
+int syscall_nanosleep(struct regs_t *regs) {
+    /* rdi: const struct timespec *req
+     * rsi: struct timespec *rem
+     */
+    if (privilege_check(regs->rdi, sizeof(struct timespec))
+     || (regs->rsi && privilege_check(regs->rsi, sizeof(struct timespec)))) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    uint64_t ns;
+    if (timespec_to_ns((struct timespec *)regs->rdi, &ns)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return do_nanosleep(get_uptime_ns() + ns, (struct timespec *)regs->rsi);
+}
+
+int syscall_clock_nanosleep(struct regs_t *regs) {
+    /* rdi: clk_id
+     * rsi: flags
+     * rdx: const struct timespec *req
+     * r10: struct timespec *rem
+     */
+    if (privilege_check(regs->rdx, sizeof(struct timespec))
+     || (regs->r10 && privilege_check(regs->r10, sizeof(struct timespec)))) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    uint64_t ns;
+    if (timespec_to_ns((struct timespec *)regs->rdx, &ns)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint64_t now = get_uptime_ns();
+    uint64_t deadline;
+
+    if (!(regs->rsi & TIMER_ABSTIME)) {
+        deadline = now + ns;
+    } else {
+        switch (regs->rdi) {
+            case CLOCK_MONOTONIC:
+            case CLOCK_MONOTONIC_RAW:
+            case CLOCK_MONOTONIC_COARSE:
+            case CLOCK_BOOTTIME:
+                deadline = ns;
+                break;
+            case CLOCK_REALTIME:
+            case CLOCK_REALTIME_COARSE: {
+                uint64_t realtime = get_realtime_ns();
+                deadline = ns > realtime ? now + (ns - realtime) : now;
+                break;
+            }
+            default:
+                errno = EINVAL;
+                return -1;
+        }
+        /* rem is not updated for absolute sleeps */
+        regs->r10 = 0;
+    }
+
+    return do_nanosleep(deadline, (struct timespec *)regs->r10);
+}
+
 int syscall_getpgrp(struct regs_t *regs) {
     // rdi: PID, 0 means current process
     pid_t pid = (pid_t)regs->rdi;
     pid_t ret;
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     if (pid)
         // TODO check if it's a valid process
         ret = process_table[pid]->pgid;
     else
         ret = process_table[CURRENT_PROCESS]->pgid;
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
     return ret;
 }
 
@@ -112,9 +211,9 @@ int syscall_setuid(struct regs_t *regs) {
     // rdi: UID to set.
     uid_t uid = (uid_t)regs->rdi;
 
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     process_table[CURRENT_PROCESS]->uid = uid;
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     return 0;
 }
@@ -148,18 +247,91 @@ int syscall_gethostname(struct regs_t *regs) {
 }
 
 int syscall_futex_wait(struct regs_t *regs) {
-    int *ptr = (int *)regs->rdi;
-    int expected = (int)regs->rsi;
+    /* rdi: int *ptr
+     * rsi: expected value
+     * Waits without a timeout, see syscall_futex_timedwait().
+     */
+    if (privilege_check(regs->rdi, sizeof(int))) {
+        errno = EFAULT;
+        return -1;
+    }
 
-    kprint(0, "futex_wait(%X, %d);", ptr, expected);
-    return 0;
+    return futex_wait((int *)regs->rdi, (int)regs->rsi, 0);
+}
+
+int syscall_futex_timedwait(struct regs_t *regs) {
+    /* rdi: int *ptr
+     * rsi: expected value
+     * rdx: const struct timespec *timeout, relative, NULL waits forever
+     */
+    if (privilege_check(regs->rdi, sizeof(int))
+     || (regs->rdx && privilege_check(regs->rdx, sizeof(struct timespec)))) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    uint64_t deadline = 0;
+    if (regs->rdx) {
+        uint64_t ns;
+        if (timespec_to_ns((struct timespec *)regs->rdx, &ns)) {
+            errno = EINVAL;
+            return -1;
+        }
+        /* 0 means no timeout to futex_wait() */
+        deadline = get_uptime_ns() + ns;
+        if (!deadline)
+            deadline = 1;
+    }
+
+    return futex_wait((int *)regs->rdi, (int)regs->rsi, deadline);
 }
 
 int syscall_futex_wake(struct regs_t *regs) {
-    int *ptr = (int *)regs->rdi;
+    /* rdi: int *ptr
+     * Wakes up every waiter, see syscall_futex_wake_count().
+     * Returns the number of threads woken up.
+     */
+    if (privilege_check(regs->rdi, sizeof(int))) {
+        errno = EFAULT;
+        return -1;
+    }
 
-    kprint(0, "futex_wake(%X);", ptr);
-    return 0;
+    return futex_wake((int *)regs->rdi, INT_MAX);
+}
+
+int syscall_futex_wake_count(struct regs_t *regs) {
+    /* rdi: int *ptr
+     * rsi: maximum number of threads to wake up, 0 or less for all of them
+     * Returns the number of threads woken up.
+     */
+    if (privilege_check(regs->rdi, sizeof(int))) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    int count = (int)regs->rsi;
+    if (count <= 0)
+        count = INT_MAX;
+
+    return futex_wake((int *)regs->rdi, count);
+}
+
+int syscall_futex_requeue(struct regs_t *regs) {
+    /* rdi: int *ptr
+     * rsi: maximum number of threads to wake up
+     * rdx: int *ptr2
+     * r10: maximum number of threads to move over to ptr2
+     * r8: value *ptr is expected to hold
+     * Returns the number of threads woken up or moved.
+     */
+    if (privilege_check(regs->rdi, sizeof(int))
+     || privilege_check(regs->rdx, sizeof(int))) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    return futex_requeue((int *)regs->rdi, (int)regs->rsi,
+                         (int *)regs->rdx, (int)regs->r10, (int)regs->r8);
 }
 
 int syscall_sigaction(struct regs_t *regs) {
@@ -167,7 +339,7 @@ int syscall_sigaction(struct regs_t *regs) {
     struct sigaction *act = (void *)regs->rsi;
     struct sigaction *oldact = (void *)regs->rdx;
 
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t pid = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[pid];
 
@@ -176,7 +348,7 @@ int syscall_sigaction(struct regs_t *regs) {
     if (act)
         process->signal_handlers[signum] = *act;
 
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
     return 0;
 }
 
@@ -204,29 +376,407 @@ int syscall_getrusage(struct regs_t *regs) {
     }
 
     struct rusage_t *usage = (struct rusage_t *)regs->rsi;
-    spinlock_acquire(&scheduler_lock);
+    struct rusage_t ret;
+
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
     spinlock_acquire(&process->usage_lock);
 
     switch (regs->rdi) {
-        case RUSAGE_SELF:
-            *usage = process->own_usage;
+        case RUSAGE_SELF: {
+            /* Dead threads are in own_usage already, add the live ones */
+            uint64_t utime = 0, stime = 0;
+            task_account(task_table[cpu_locals[current_cpu].current_task],
+                         get_uptime_ns());
+            for (size_t i = 0; i < MAX_THREADS; i++) {
+                struct thread_t *thread = process->threads[i];
+                if (!thread || thread == (void *)(-1) || thread == (void *)(-2))
+                    continue;
+                utime += thread->utime;
+                stime += thread->stime;
+            }
+            ret = process->own_usage;
+            add_usage_ns(&ret, utime, stime);
             break;
+        }
         case RUSAGE_CHILDREN:
-            *usage = process->child_usage;
+            ret = process->child_usage;
             break;
         default:
             spinlock_release(&process->usage_lock);
+            sched_unlock();
             errno = ENOSYS;
             return -1;
     }
 
     spinlock_release(&process->usage_lock);
+    sched_unlock();
+
+    *usage = ret;
+    return 0;
+}
+
+/* Resolve a setpriority()/getpriority() target to a process test. who == 0
+ * means the calling process, its group or its user. Returns -1 if which is
+ * invalid. Called with scheduler_lock held. */
+static int prio_resolve_who(int which, int who) {
+    struct process_t *current = process_table[CURRENT_PROCESS];
+
+    switch (which) {
+        case PRIO_PROCESS:
+            return who ? who : current->pid;
+        case PRIO_PGRP:
+            return who ? who : current->pgid;
+        case PRIO_USER:
+            return who ? who : (int)current->uid;
+        default:
+            return -1;
+    }
+}
+
+static int prio_match(struct process_t *process, int which, int who) {
+    /* Kernel threads are not subject to renicing */
+    if (!process || process == EMPTY || process == (void *)(-2) || !process->pid)
+        return 0;
+
+    switch (which) {
+        case PRIO_PROCESS:
+            return process->pid == who;
+        case PRIO_PGRP:
+            return process->pgid == who;
+        case PRIO_USER:
+            return (int)process->uid == who;
+        default:
+            return 0;
+    }
+}
+
+int syscall_setpriority(struct regs_t *regs) {
+    /* rdi: which
+     * rsi: who
+     * rdx: nice value, clamped to NICE_MIN..NICE_MAX
+     */
+    int which = (int)regs->rdi;
+    int nice = (int)regs->rdx;
+
+    if (nice < NICE_MIN)
+        nice = NICE_MIN;
+    if (nice > NICE_MAX)
+        nice = NICE_MAX;
+
+    sched_lock();
+
+    int who = prio_resolve_who(which, (int)regs->rsi);
+    if (who == -1) {
+        sched_unlock();
+        errno = EINVAL;
+        return -1;
+    }
+
+    uid_t uid = process_table[CURRENT_PROCESS]->uid;
+    int found = 0, denied = 0;
+
+    for (pid_t pid = 0; pid < MAX_PROCESSES; pid++) {
+        struct process_t *process = process_table[pid];
+        if (!prio_match(process, which, who))
+            continue;
+        /* Only root may touch other users' processes */
+        if (uid && process->uid != uid) {
+            denied = 1;
+            continue;
+        }
+        found = 1;
+        for (size_t i = 0; i < MAX_THREADS; i++) {
+            struct thread_t *thread = process->threads[i];
+            if (!thread || thread == EMPTY || thread == (void *)(-2))
+                continue;
+            /* Only root may raise priorities */
+            if (uid && nice < thread->nice) {
+                denied = 1;
+                continue;
+            }
+            thread->nice = nice;
+        }
+    }
+
+    sched_unlock();
+
+    if (denied) {
+        errno = EACCES;
+        return -1;
+    }
+    if (!found) {
+        errno = ESRCH;
+        return -1;
+    }
+    return 0;
+}
+
+int syscall_getpriority(struct regs_t *regs) {
+    /* rdi: which
+     * rsi: who
+     * Returns 20 - nice of the highest priority thread matched, so that the
+     * result is always positive and -1 stays free for errors.
+     */
+    int which = (int)regs->rdi;
+
+    sched_lock();
+
+    int who = prio_resolve_who(which, (int)regs->rsi);
+    if (who == -1) {
+        sched_unlock();
+        errno = EINVAL;
+        return -1;
+    }
+
+    int found = 0;
+    int nice = NICE_MAX;
+
+    for (pid_t pid = 0; pid < MAX_PROCESSES; pid++) {
+        struct process_t *process = process_table[pid];
+        if (!prio_match(process, which, who))
+            continue;
+        for (size_t i = 0; i < MAX_THREADS; i++) {
+            struct thread_t *thread = process->threads[i];
+            if (!thread || thread == EMPTY || thread == (void *)(-2))
+                continue;
+            found = 1;
+            if (thread->nice < nice)
+                nice = thread->nice;
+        }
+    }
+
+    sched_unlock();
+
+    if (!found) {
+        errno = ESRCH;
+        return -1;
+    }
+    return 20 - nice;
+}
+
+/* Look up the process a sched_* syscall refers to, 0 means the calling
+ * process. Called with scheduler_lock held. */
+static struct process_t *sched_get_process(pid_t pid) {
+    if (!pid)
+        return process_table[CURRENT_PROCESS];
+    if (pid < 0 || pid >= MAX_PROCESSES)
+        return NULL;
+    struct process_t *process = process_table[pid];
+    if (!process || process == EMPTY || process == (void *)(-2))
+        return NULL;
+    return process;
+}
+
+/* The first live thread of a process, or the calling thread for itself.
+ * Called with scheduler_lock held. */
+static struct thread_t *sched_get_thread(pid_t pid, struct process_t *process) {
+    if (!pid)
+        return task_table[CURRENT_TASK];
+    for (size_t i = 0; i < MAX_THREADS; i++) {
+        struct thread_t *thread = process->threads[i];
+        if (thread && thread != EMPTY && thread != (void *)(-2))
+            return thread;
+    }
+    return NULL;
+}
+
+int syscall_sched_setscheduler(struct regs_t *regs) {
+    /* rdi: pid, 0 means the calling process
+     * rsi: policy
+     * rdx: struct sched_param *
+     * Applies to every thread of the process.
+     */
+    if (privilege_check(regs->rdx, sizeof(struct sched_param))) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    pid_t pid = (pid_t)regs->rdi;
+    int policy = (int)regs->rsi;
+    int priority = ((struct sched_param *)regs->rdx)->sched_priority;
+
+    if (!sched_param_valid(policy, priority)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    sched_lock();
+
+    struct process_t *process = sched_get_process(pid);
+    if (!process || !process->pid) {
+        sched_unlock();
+        errno = ESRCH;
+        return -1;
+    }
+
+    uid_t uid = process_table[CURRENT_PROCESS]->uid;
+    /* Only root may use the real time classes or touch other users */
+    if (uid && (policy != SCHED_OTHER || process->uid != uid)) {
+        sched_unlock();
+        errno = EPERM;
+        return -1;
+    }
+
+    pid = process->pid;
+
+    sched_unlock();
+
+    /* Fails for the unused thread slots only */
+    for (tid_t tid = 0; tid < MAX_THREADS; tid++)
+        task_setscheduler(pid, tid, policy, priority);
+
+    return 0;
+}
+
+int syscall_sched_getparam(struct regs_t *regs) {
+    /* rdi: pid, 0 means the calling thread
+     * rsi: struct sched_param *
+     */
+    if (privilege_check(regs->rsi, sizeof(struct sched_param))) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    pid_t pid = (pid_t)regs->rdi;
+    struct sched_param param;
+
+    sched_lock();
+
+    struct process_t *process = sched_get_process(pid);
+    struct thread_t *thread = process ? sched_get_thread(pid, process) : NULL;
+    if (!thread) {
+        sched_unlock();
+        errno = ESRCH;
+        return -1;
+    }
+    param.sched_priority = thread->policy == SCHED_OTHER ? 0 : thread->rt_priority;
+
+    sched_unlock();
+
+    *(struct sched_param *)regs->rsi = param;
+    return 0;
+}
+
+int syscall_sched_getscheduler(struct regs_t *regs) {
+    /* rdi: pid, 0 means the calling thread */
+    pid_t pid = (pid_t)regs->rdi;
+
+    sched_lock();
+
+    struct process_t *process = sched_get_process(pid);
+    struct thread_t *thread = process ? sched_get_thread(pid, process) : NULL;
+    if (!thread) {
+        sched_unlock();
+        errno = ESRCH;
+        return -1;
+    }
+    int policy = thread->policy;
+
+    sched_unlock();
+
+    return policy;
+}
+
+int syscall_sched_setaffinity(struct regs_t *regs) {
+    /* rdi: pid, 0 means the calling thread
+     * rsi: size of the mask in bytes
+     * rdx: mask, CPUs past its end are left out
+     * Applies to every thread of the process for a non zero pid.
+     */
+    size_t size = regs->rsi < sizeof(cpumask_t) ? regs->rsi : sizeof(cpumask_t);
+
+    if (privilege_check(regs->rdx, size)) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    pid_t pid = (pid_t)regs->rdi;
+    cpumask_t mask;
+
+    cpumask_zero(&mask);
+    memcpy(&mask, (void *)regs->rdx, size);
+
+    if (cpumask_first(&mask, smp_cpu_count) == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    sched_lock();
+
+    struct process_t *process = sched_get_process(pid);
+    if (!process || !process->pid) {
+        sched_unlock();
+        errno = ESRCH;
+        return -1;
+    }
+
+    uid_t uid = process_table[CURRENT_PROCESS]->uid;
+    if (uid && process->uid != uid) {
+        sched_unlock();
+        errno = EPERM;
+        return -1;
+    }
+
+    pid_t target = process->pid;
+
+    sched_unlock();
+
+    if (!pid) {
+        task_setaffinity(target, CURRENT_THREAD, &mask);
+        return 0;
+    }
+
+    /* Fails for the unused thread slots only */
+    for (tid_t tid = 0; tid < MAX_THREADS; tid++)
+        task_setaffinity(target, tid, &mask);
+
     return 0;
 }
 
+int syscall_sched_getaffinity(struct regs_t *regs) {
+    /* rdi: pid, 0 means the calling thread
+     * rsi: size of the mask in bytes, has to cover every CPU
+     * rdx: mask
+     * Returns the number of bytes written, the rest of the mask is left as is.
+     */
+    if (regs->rsi * 8 < (size_t)smp_cpu_count) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t size = regs->rsi < sizeof(cpumask_t) ? regs->rsi : sizeof(cpumask_t);
+
+    if (privilege_check(regs->rdx, size)) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    pid_t pid = (pid_t)regs->rdi;
+    cpumask_t mask;
+
+    sched_lock();
+
+    struct process_t *process = sched_get_process(pid);
+    struct thread_t *thread = process ? sched_get_thread(pid, process) : NULL;
+    if (!thread) {
+        sched_unlock();
+        errno = ESRCH;
+        return -1;
+    }
+    mask = thread->cpus_allowed;
+
+    sched_unlock();
+
+    /* Only report the CPUs which exist */
+    for (int i = smp_cpu_count; i < MAX_CPUS; i++)
+        cpumask_clear(&mask, i);
+
+    memcpy((void *)regs->rdx, &mask, size);
+    return (int)size;
+}
+
 int syscall_clock_gettime(struct regs_t *regs) {
     /* rdi: clk_id
      * rsi: timespec
@@ -237,8 +787,23 @@ int syscall_clock_gettime(struct regs_t *regs) {
     }
 
     struct timespec *tp = (struct timespec *)regs->rsi;
-    tp->tv_sec = unix_epoch;
-    tp->tv_nsec = 0;
+    switch (regs->rdi) {
+        case CLOCK_MONOTONIC:
+        case CLOCK_MONOTONIC_RAW:
+        case CLOCK_MONOTONIC_COARSE:
+        case CLOCK_BOOTTIME: {
+            uint64_t now = get_uptime_ns();
+            tp->tv_sec = now / 1000000000;
+            tp->tv_nsec = now % 1000000000;
+            break;
+        }
+        default: {
+            uint64_t now = get_realtime_ns();
+            tp->tv_sec = now / 1000000000;
+            tp->tv_nsec = now % 1000000000;
+            break;
+        }
+    }
     return 0;
 }
 
@@ -251,10 +816,10 @@ int syscall_tcgetattr(struct regs_t *regs) {
         return -1;
     }
 
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     if (regs->rdi >= MAX_FILE_HANDLES) {
         errno = EBADF;
@@ -284,10 +849,10 @@ int syscall_tcsetattr(struct regs_t *regs) {
         return -1;
     }
 
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     if (regs->rdi >= MAX_FILE_HANDLES) {
         errno = EBADF;
@@ -311,10 +876,10 @@ int syscall_tcflow(struct regs_t *regs) {
     /* rdi: fd
      * rsi: action
      */
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     if (regs->rdi >= MAX_FILE_HANDLES) {
         errno = EBADF;
@@ -336,10 +901,10 @@ int syscall_tcflow(struct regs_t *regs) {
 int syscall_isatty(struct regs_t *regs) {
     /* rdi: fd
      */
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     if (regs->rdi >= MAX_FILE_HANDLES) {
         errno = EBADF;
@@ -364,10 +929,10 @@ int syscall_getcwd(struct regs_t *regs) {
         return -1;
     }
 
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     char *buf = (char *)regs->rdi;
     size_t limit = (size_t)regs->rsi;
@@ -393,10 +958,10 @@ int syscall_readdir(struct regs_t *regs) {
         return -1;
     }
 
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     spinlock_acquire(&process->file_handles_lock);
     if (process->file_handles[fd] == -1) {
@@ -418,10 +983,10 @@ int syscall_chdir(struct regs_t *regs) {
     if (privilege_check(regs->rdi, strlen(new_path) + 1))
         return -1;
 
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     char abs_path[2048];
     spinlock_acquire(&process->cwd_lock);
@@ -458,10 +1023,10 @@ int syscall_waitpid(struct regs_t *regs) {
         return -1;
     }
 
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     for (;;) {
         spinlock_acquire(&process->child_event_lock);
@@ -478,13 +1043,15 @@ int syscall_waitpid(struct regs_t *regs) {
                 process->child_events = krealloc(process->child_events,
                     sizeof(struct child_event_t) * process->child_event_i);
                 spinlock_release(&process->child_event_lock);
-                spinlock_acquire(&scheduler_lock);
-                kfree(child_process);
-                process_table[child_pid] = (void *)(-1);
+                sched_lock();
                 /* the child has been waited for so we need to add the usage */
+                spinlock_acquire(&process->usage_lock);
                 add_usage(&process->child_usage, &child_process->own_usage);
                 add_usage(&process->child_usage, &child_process->child_usage);
-                spinlock_release(&scheduler_lock);
+                spinlock_release(&process->usage_lock);
+                kfree(child_process);
+                process_table[child_pid] = (void *)(-1);
+                sched_unlock();
                 return child_pid;
             }
         }
@@ -517,14 +1084,14 @@ int syscall_exit(struct regs_t *regs) {
 int syscall_execve(struct regs_t *regs) {
     /* FIXME check if filename and argv/envp are in userspace */
 
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     int _current_cpu = current_cpu;
     pid_t current_process = cpu_locals[_current_cpu].current_process;
     tid_t current_thread = cpu_locals[_current_cpu].current_thread;
     tid_t current_task = cpu_locals[_current_cpu].current_task;
     struct process_t *process = process_table[current_process];
     struct thread_t *thread = task_table[current_task];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     char *path = (char *)regs->rdi;
 
@@ -562,20 +1129,29 @@ int syscall_execve(struct regs_t *regs) {
 }
 
 int syscall_fork(struct regs_t *regs) {
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
 
     pid_t current_task = cpu_locals[current_cpu].current_task;
     struct thread_t *calling_thread = task_table[current_task];
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *old_process = process_table[current_process];
 
-    spinlock_release(&scheduler_lock);
-    pid_t new_pid = task_pcreate();
-    if (new_pid == -1)
-        return -1;
-    spinlock_acquire(&scheduler_lock);
+    sched_unlock();
 
+    /* Copy the address space before taking a process slot, so that a
+     * failure leaves nothing to tear down but the copy */
     struct pagemap_t *new_pagemap = fork_address_space(old_process->pagemap);
+    if (!new_pagemap) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    pid_t new_pid = task_pcreate();
+    if (new_pid == -1) {
+        free_address_space(new_pagemap);
+        return -1;
+    }
+    sched_lock();
 
     struct process_t *new_process = process_table[new_pid];
 
@@ -606,7 +1182,7 @@ int syscall_fork(struct regs_t *regs) {
             old_process->signal_handlers[i].sa_handler;
     new_process->sigmask = old_process->sigmask;
 
-    new_process->threads[0] = kalloc(sizeof(struct thread_t));
+    new_process->threads[0] = kmem_cache_alloc(thread_cache);
     struct thread_t *new_thread = new_process->threads[0];
 
     /* Search for free global task ID */
@@ -624,11 +1200,18 @@ found_new_task_id:
     new_thread->task_id = new_task_id;
     new_thread->process = new_pid;
     new_thread->lock = new_lock;
-    new_thread->yield_target = 0;
     new_thread->active_on_cpu = -1;
+    new_thread->rq_cpu = -1;
+    new_thread->last_cpu = -1;
+    new_thread->fpu_cpu = -1;
+    new_thread->wake_lock = new_lock;
     /* TODO: fix this */
     new_thread->kstack = (size_t)kalloc(32768) + 32768;
     new_thread->fs_base = calling_thread->fs_base;
+    new_thread->nice = calling_thread->nice;
+    new_thread->policy = calling_thread->policy;
+    new_thread->rt_priority = calling_thread->rt_priority;
+    new_thread->cpus_allowed = calling_thread->cpus_allowed;
     new_thread->ctx.regs = *regs;
     new_thread->ctx.regs.rax = 0;
     new_thread->ctx.fxstate = kalloc(cpu_simd_region_size);
@@ -636,8 +1219,9 @@ found_new_task_id:
     cpu_save_simd(new_thread->ctx.fxstate);
 
     task_count++;
+    task_enqueue(new_thread);
 
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     return new_pid;
 }
@@ -645,14 +1229,14 @@ found_new_task_id:
 int syscall_set_fs_base(struct regs_t *regs) {
     // rdi: new fs base
 
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_task = cpu_locals[current_cpu].current_task;
     struct thread_t *thread = task_table[current_task];
 
     thread->fs_base = regs->rdi;
-    load_fs_base(regs->rdi);
+    cpu_set_fs_base(regs->rdi);
 
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     return 0;
 }
@@ -660,10 +1244,10 @@ int syscall_set_fs_base(struct regs_t *regs) {
 void *syscall_alloc_at(struct regs_t *regs) {
     // rdi: virtual address / 0 for sbrk-like allocation
     // rsi: page count
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     size_t base_address;
     if (regs->rdi) {
@@ -681,19 +1265,11 @@ void *syscall_alloc_at(struct regs_t *regs) {
         spinlock_release(&process->cur_brk_lock);
     }
 
-    void *ptr = pmm_allocz(regs->rsi);
-    if (!ptr) {
+    /* Pages are only backed by memory once they are touched */
+    if (map_lazy_range(process->pagemap, base_address, regs->rsi, 0x07)) {
         errno = ENOMEM;
         return (void *)0;
     }
-    for (size_t i = 0; i < regs->rsi; i++) {
-        if (map_page(process->pagemap, (size_t)ptr + i * PAGE_SIZE,
-            base_address + i * PAGE_SIZE, 0x07)) {
-            pmm_free(ptr, regs->rsi);
-            errno = ENOMEM;
-            return (void *)0;
-        }
-    }
 
     return (void *)base_address;
 }
@@ -724,9 +1300,9 @@ pid_t syscall_getpid(void) {
 }
 
 pid_t syscall_getppid(void) {
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t ret = process_table[CURRENT_PROCESS]->ppid;
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
     return ret;
 }
 
@@ -734,10 +1310,10 @@ int syscall_pipe(struct regs_t *regs) {
     int *pipefd = (int *)regs->rdi;
     int flflags = (int)regs->rsi;
 
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     if (privilege_check(pipefd, sizeof(int) * 2))
         return -1;
@@ -789,10 +1365,10 @@ int syscall_pipe(struct regs_t *regs) {
 int syscall_unlink(struct regs_t *regs) {
     // rdi: path
 
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     const char *path = (const char *)regs->rdi;
 
@@ -818,10 +1394,10 @@ int syscall_unlink(struct regs_t *regs) {
 int syscall_mkdir(struct regs_t *regs) {
     // rdi: path
 
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     char abs_path[2048];
     spinlock_acquire(&process->cwd_lock);
@@ -834,10 +1410,10 @@ int syscall_mkdir(struct regs_t *regs) {
 int syscall_open(struct regs_t *regs) {
     // rdi: path
     // rsi: mode
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     if (privilege_check(regs->rdi, strlen((const char *)regs->rdi) + 1)) {
         errno = EFAULT;
@@ -874,10 +1450,10 @@ int syscall_open(struct regs_t *regs) {
 }
 
 static int get_fd_sys(int fd) {
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     if (fd < 0 || fd >= MAX_FILE_HANDLES)
         return -1;
@@ -906,10 +1482,10 @@ static int get_fd_sys(int fd) {
 #define F_GETPATH 100
 
 static int fcntl_dupfd(int fd, int lowest_fd, int cloexec) {
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     spinlock_acquire(&process->file_handles_lock);
     int old_fd_sys = process->file_handles[fd];
@@ -941,10 +1517,10 @@ fnd:;
 }
 
 static int fcntl_getfd(int fd) {
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     spinlock_acquire(&process->file_handles_lock);
     int fd_sys = process->file_handles[fd];
@@ -959,10 +1535,10 @@ static int fcntl_getfd(int fd) {
 }
 
 static int fcntl_setfd(int fd, int fdflags) {
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     spinlock_acquire(&process->file_handles_lock);
     int fd_sys = process->file_handles[fd];
@@ -977,10 +1553,10 @@ static int fcntl_setfd(int fd, int fdflags) {
 }
 
 static int fcntl_getfl(int fd) {
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     spinlock_acquire(&process->file_handles_lock);
     int fd_sys = process->file_handles[fd];
@@ -995,10 +1571,10 @@ static int fcntl_getfl(int fd) {
 }
 
 static int fcntl_setfl(int fd, int flflags) {
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     spinlock_acquire(&process->file_handles_lock);
     int fd_sys = process->file_handles[fd];
@@ -1089,10 +1665,10 @@ int syscall_dup2(struct regs_t *regs) {
     int old_fd = (int)regs->rdi;
     int new_fd = (int)regs->rsi;
 
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     spinlock_acquire(&process->file_handles_lock);
     int old_fd_sys = process->file_handles[old_fd];
@@ -1124,10 +1700,10 @@ int syscall_dup2(struct regs_t *regs) {
 int syscall_close(struct regs_t *regs) {
     // rdi: fd
 
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     if (regs->rdi >= MAX_FILE_HANDLES) {
         return -1;
@@ -1156,10 +1732,10 @@ int syscall_lseek(struct regs_t *regs) {
     // rsi: offset
     // rdx: type
 
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     if (regs->rdi >= MAX_FILE_HANDLES) {
         return -1;
@@ -1185,10 +1761,10 @@ int syscall_fstat(struct regs_t *regs) {
         return -1;
     }
 
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     spinlock_acquire(&process->file_handles_lock);
     if (process->file_handles[regs->rdi] == -1) {
@@ -1209,10 +1785,10 @@ int syscall_read(struct regs_t *regs) {
     // rdi: fd
     // rsi: buf
     // rdx: len
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     if (privilege_check(regs->rsi, regs->rdx)) {
         return -1;
@@ -1247,10 +1823,10 @@ int syscall_write(struct regs_t *regs) {
     // rdi: fd
     // rsi: buf
     // rdx: len
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     pid_t current_process = cpu_locals[current_cpu].current_process;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     if (privilege_check(regs->rsi, regs->rdx)) {
         return -1;
@@ -1,9 +1,7 @@
 global task_spinup
 global force_resched
 
-extern scheduler_lock
-extern resched_lock
-
+extern sched_unlock_resched
 extern task_resched
 
 section .data
@@ -50,10 +48,6 @@ task_spinup:
     mov ds, ax
     mov es, ax
 
-    ; release relevant locks
-    lock inc qword [scheduler_lock]
-    lock inc qword [resched_lock]
-
     pop rax
 
     iretq
@@ -86,7 +80,7 @@ force_resched:
     push r15
 
     ; release relevant locks
-    lock inc qword [scheduler_lock]
+    call sched_unlock_resched
 
     mov rdi, rsp
   .retry:
@@ -13,26 +13,71 @@
 #include <lib/time.h>
 #include <lib/event.h>
 #include <lib/signal.h>
-#include <sys/pit.h>
 #include <sys/urm.h>
 #include <lib/cstring.h>
 #include <lib/cmem.h>
+#include <lib/cio.h>
 #include <sys/cpu.h>
+#include <sys/timer.h>
+#include <lib/cmdline.h>
 
-#define SCHED_TIMESLICE_MS 5
-
-static int scheduler_ready = 0;
+#define SCHED_TIMESLICE_NS 5000000
+/* A waking thread preempts the running one if it is this far behind it */
+#define SCHED_WAKEUP_GRANULARITY_NS 1000000
+/* Head start in virtual runtime a thread keeps over sleeping */
+#define SCHED_SLEEPER_CREDIT_NS SCHED_TIMESLICE_NS
 
 void task_spinup(void *, size_t);
 
-lock_t scheduler_lock = new_lock_acquired;
-lock_t resched_lock = new_lock;
+/* Protects the process and task tables, see sched_lock() */
+static lock_t scheduler_lock = new_lock_acquired;
 
 struct process_t **process_table;
 
 struct thread_t **task_table;
 int64_t task_count = 0;
 
+struct kmem_cache_t *thread_cache;
+
+/* Per-CPU queues of runnable threads. A thread sits on at most one queue and
+ * is taken off it while it runs or is paused. The queue lock protects the
+ * trees. Rescheduling only takes queue locks, the lock of a thread is held
+ * by the CPU running it, see task_tkill().
+ * Real time threads sit in their own tree ordered by priority and then by
+ * the time they were queued, and always run before SCHED_OTHER ones. Those
+ * are ordered by virtual runtime instead.
+ * Virtual runtime is CPU time scaled down by the thread's nice weight, so
+ * always running the leftmost thread shares each CPU out by weight. Every
+ * queue keeps its own virtual clock in min_vruntime, threads moving between
+ * CPUs are rebased from one clock to the other.
+ * There is no periodic tick: the slice timer is only armed while other
+ * threads wait on the queue, and is only ever touched by its own CPU. */
+struct run_queue_t {
+    lock_t lock;
+    struct rb_root rt_tree;
+    struct rb_root tree;
+    /* Threads in both trees */
+    int count;
+    /* Never goes backwards, only written by the queue's own CPU */
+    uint64_t min_vruntime;
+    /* Class of the running thread, and its virtual runtime when it was
+     * picked. Written by the queue's own CPU only. */
+    int curr_policy;
+    int curr_prio;
+    uint64_t curr_vruntime;
+    struct timer_t slice_timer;
+    int need_resched;
+    /* The running thread holds scheduler_lock, and a reschedule waits for
+     * it to let go. Only touched by the queue's own CPU. */
+    int sched_locked;
+    int resched_deferred;
+};
+
+static struct run_queue_t run_queues[MAX_CPUS];
+
+/* CPUs kernel workers are pinned to, see task_pin_kworker() */
+static cpumask_t kworker_cpus;
+
 /* These represent the default new-thread register contexts for kernel space and
  * userspace. See kernel/include/ctx.h for the register order. */
 static struct regs_t default_krnl_regs = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0x08,0x202,0,0x10};
@@ -45,6 +90,10 @@ void init_sched(void) {
 
     cpu_save_simd(default_fxstate);
 
+    if (!(thread_cache = kmem_cache_create("thread_t", sizeof(struct thread_t)))) {
+        panic(NULL, 1, "sched: Unable to create thread cache.");
+    }
+
     kprint(KPRN_INFO, "sched: Initialising process table...");
 
     /* Make room for task table */
@@ -65,31 +114,113 @@ void init_sched(void) {
     process_table[0]->pagemap = kernel_pagemap;
     process_table[0]->pid = 0;
 
+    for (int i = 0; i < MAX_CPUS; i++) {
+        run_queues[i].lock = new_lock;
+        run_queues[i].slice_timer.cpu = -1;
+    }
+
+    /* Keeping the kernel workers off some cores leaves those to latency
+     * sensitive threads */
+    cpumask_fill(&kworker_cpus);
+    char kworker_cpus_list[64];
+    if (cmdline_get_value(kworker_cpus_list, 64, "kworker_cpus")) {
+        cpumask_t mask;
+        if (cpumask_parse(&mask, kworker_cpus_list)
+         || cpumask_first(&mask, smp_cpu_count) == -1) {
+            kprint(KPRN_WARN, "sched: Invalid kworker_cpus=%s, ignoring.", kworker_cpus_list);
+        } else {
+            kworker_cpus = mask;
+            kprint(KPRN_INFO, "sched: Kernel workers run on CPUs %s", kworker_cpus_list);
+        }
+    }
+
     kprint(KPRN_INFO, "sched: Init done.");
+}
 
-    scheduler_ready = 1;
+/* Besides guarding the tables, holding scheduler_lock keeps the holder's
+ * CPU from rescheduling, so that a holder cannot be switched out. Only that
+ * CPU holds off: task_resched() takes no global lock, and other CPUs keep
+ * scheduling while the lock is held. Waiters spin with interrupts enabled,
+ * holders may be waiting on IPIs to them. */
+void sched_lock(void) {
+    for (;;) {
+        uint64_t rflags = save_and_disable_interrupts();
+        if (spinlock_test_and_acquire(&scheduler_lock)) {
+            run_queues[current_cpu].sched_locked = 1;
+            restore_interrupts(rflags);
+            return;
+        }
+        restore_interrupts(rflags);
+        asm volatile ("pause" ::: "memory");
+    }
+}
+
+void sched_unlock(void) {
+    uint64_t rflags = save_and_disable_interrupts();
+    struct run_queue_t *rq = &run_queues[current_cpu];
+
+    rq->sched_locked = 0;
+    spinlock_release(&scheduler_lock);
+
+    /* Run the reschedule put off while we held the lock as soon as
+     * interrupts are enabled again */
+    if (rq->resched_deferred) {
+        rq->resched_deferred = 0;
+        lapic_send_ipi(current_cpu, IPI_RESCHED);
+    }
+
+    restore_interrupts(rflags);
+}
+
+/* Called by force_resched() with interrupts disabled, on behalf of the
+ * thread giving up the CPU with scheduler_lock held */
+void sched_unlock_resched(void) {
+    run_queues[current_cpu].sched_locked = 0;
+    spinlock_release(&scheduler_lock);
 }
 
 void yield(void) {
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     force_resched();
 }
 
-void relaxed_sleep(uint64_t ms) {
-    spinlock_acquire(&scheduler_lock);
+static void task_timer_wake(void *thread) {
+    task_wake(thread);
+}
 
-    uint64_t yield_target = (uptime_raw + (ms * (PIT_FREQUENCY_HZ / 1000))) + 1;
+/* Sleep until get_uptime_ns() reaches deadline. Returns -1 if the sleep got
+ * aborted by task_tkill() or task_tpause(), 0 otherwise. */
+int task_sleep_until(uint64_t deadline) {
+    struct timer_t timer = { .cpu = -1 };
 
-    tid_t current_task = cpu_locals[current_cpu].current_task;
-    task_table[current_task]->yield_target = yield_target;
+    sched_lock();
+    struct thread_t *thread = task_table[cpu_locals[current_cpu].current_task];
+    sched_unlock();
 
-    force_resched();
+    while (get_uptime_ns() < deadline) {
+        if (locked_read(int, &thread->event_abrt))
+            return -1;
+
+        sched_lock();
+        task_block(thread);
+        timer_arm(&timer, deadline, task_timer_wake, thread);
+        force_resched();
+
+        timer_cancel(&timer);
+        task_wake(thread);
+    }
+
+    return 0;
+}
+
+void relaxed_sleep(uint64_t ms) {
+    task_sleep_until(get_uptime_ns() + ms * 1000000);
 }
 
 int task_send_child_event(pid_t pid, struct child_event_t *child_event) {
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     struct process_t *process = process_table[pid];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     spinlock_acquire(&process->child_event_lock);
 
@@ -105,9 +236,9 @@ int task_send_child_event(pid_t pid, struct child_event_t *child_event) {
 }
 
 int kill(pid_t pid, int signal) {
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     struct process_t *process = process_table[pid];
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     kprint(0, "kernel: delivering %s to PID %d", signames[signal], pid);
 
@@ -149,14 +280,14 @@ int kill(pid_t pid, int signal) {
 
     // We need our new thread to have a valid thread local FS base.
     size_t fs_base;
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     for (size_t i = 0; i < MAX_THREADS; i++) {
         if (process->threads[i] == (void *)(-1) || !process->threads[i])
             continue;
         fs_base = process->threads[i]->fs_base;
         break;
     }
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     tid_t handler_tid = task_tcreate(pid, tcreate_fn_call,
             tcreate_fn_call_data((void*)fs_base,
@@ -166,71 +297,428 @@ int kill(pid_t pid, int signal) {
     return 0;
 }
 
-/* Search for a new task to run */
-static inline tid_t task_get_next(tid_t current_task) {
-    if (current_task != -1) {
-        current_task++;
-    } else {
-        current_task = 0;
+/* Weight of each nice level, from -20 to 19. Every level is worth about
+ * 10% of CPU time against a thread one level away. */
+#define NICE_0_WEIGHT 1024
+
+static const uint32_t nice_to_weight[NICE_MAX - NICE_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548,  7620,  6100,  4904,  3906,
+    3121,  2501,  1991,  1586,  1277,
+    1024,  820,   655,   526,   423,
+    335,   272,   215,   172,   137,
+    110,   87,    70,    56,    45,
+    36,    29,    23,    18,    15
+};
+
+/* Virtual runtimes wrap around, so only ever compare their difference */
+static inline int64_t vruntime_diff(uint64_t a, uint64_t b) {
+    return (int64_t)(a - b);
+}
+
+/* 0 for SCHED_OTHER threads, which rank below every real time priority */
+static inline int thread_prio(struct thread_t *thread) {
+    return thread->policy == SCHED_OTHER ? 0 : thread->rt_priority;
+}
+
+/* Charge the time since thread->exec_start to a running thread. Called on the
+ * thread's CPU with scheduler_lock held or interrupts disabled. */
+void task_account(struct thread_t *thread, uint64_t now) {
+    uint64_t delta = now - thread->exec_start;
+    thread->exec_start = now;
+
+    if (thread->policy == SCHED_OTHER) {
+        uint32_t weight = nice_to_weight[thread->nice - NICE_MIN];
+        thread->vruntime += delta * NICE_0_WEIGHT / weight;
     }
 
-    for (int64_t i = 0; i < task_count; ) {
-        struct thread_t *thread = task_table[current_task];
-        if (!thread) {
-            /* End of task table, rewind */
-            current_task = 0;
-            thread = task_table[current_task];
-        }
-        if (thread == (void *)(-1) || thread == (void *)(-2)) {
-            /* This is an empty thread, skip */
-            goto skip;
+    if (!thread->process || thread->in_syscall)
+        thread->stime += delta;
+    else
+        thread->utime += delta;
+}
+
+static int rq_comp(struct rb_node *a, struct rb_node *b, void *arg) {
+    (void)arg;
+    struct thread_t *x = rb_entry(a, struct thread_t, rq_node);
+    struct thread_t *y = rb_entry(b, struct thread_t, rq_node);
+
+    int64_t diff = vruntime_diff(x->vruntime, y->vruntime);
+    if (diff)
+        return diff < 0 ? -1 : 1;
+    if (x != y)
+        return x < y ? -1 : 1;
+    return 0;
+}
+
+static int rq_rt_comp(struct rb_node *a, struct rb_node *b, void *arg) {
+    (void)arg;
+    struct thread_t *x = rb_entry(a, struct thread_t, rq_node);
+    struct thread_t *y = rb_entry(b, struct thread_t, rq_node);
+
+    if (x->rt_priority != y->rt_priority)
+        return x->rt_priority > y->rt_priority ? -1 : 1;
+    if (x->rt_queued != y->rt_queued)
+        return x->rt_queued < y->rt_queued ? -1 : 1;
+    if (x != y)
+        return x < y ? -1 : 1;
+    return 0;
+}
+
+/* The tree a thread belongs in depends on its policy. Changing the policy
+ * of a queued thread requires taking it off its queue first. */
+static void rq_push_locked(struct run_queue_t *rq, struct thread_t *thread) {
+    if (thread->policy == SCHED_OTHER)
+        rb_insert(&rq->tree, rq_comp, NULL, &thread->rq_node);
+    else
+        rb_insert(&rq->rt_tree, rq_rt_comp, NULL, &thread->rq_node);
+    rq->count++;
+}
+
+static void rq_remove_locked(struct run_queue_t *rq, struct thread_t *thread) {
+    if (thread->policy == SCHED_OTHER)
+        rb_delete(&rq->tree, &thread->rq_node);
+    else
+        rb_delete(&rq->rt_tree, &thread->rq_node);
+    rq->count--;
+}
+
+/* Add a thread to a CPU's queue, returns whether the queue was empty. Real
+ * time threads go behind their priority peers if to_tail is set, and keep
+ * their place otherwise. */
+static int rq_add(struct thread_t *thread, int cpu, int to_tail) {
+    struct run_queue_t *rq = &run_queues[cpu];
+
+    if (thread->policy != SCHED_OTHER && to_tail)
+        thread->rt_queued = get_uptime_ns();
+
+    spinlock_acquire(&rq->lock);
+    int was_empty = !rq->count;
+    rq_push_locked(rq, thread);
+    locked_write(int, &thread->rq_cpu, cpu);
+    spinlock_release(&rq->lock);
+
+    return was_empty;
+}
+
+/* Whether the running thread of the current CPU has to share it */
+static int rq_wants_slice(struct run_queue_t *rq) {
+    switch (rq->curr_policy) {
+        case SCHED_FIFO:
+            return 0;
+        case SCHED_RR: {
+            /* Only round robin among threads of the same priority */
+            spinlock_acquire(&rq->lock);
+            struct rb_node *first = rb_first(&rq->rt_tree);
+            int ret = first && rb_entry(first, struct thread_t, rq_node)->rt_priority
+                               == rq->curr_prio;
+            spinlock_release(&rq->lock);
+            return ret;
         }
-        if (thread->yield_target > uptime_raw) {
-            goto next;
+        default:
+            return locked_read(int, &rq->count) != 0;
+    }
+}
+
+/* Move a thread's virtual runtime from one CPU's clock to another's */
+static void rq_rebase(struct thread_t *thread, int from, int to) {
+    thread->vruntime += locked_read(uint64_t, &run_queues[to].min_vruntime)
+                      - locked_read(uint64_t, &run_queues[from].min_vruntime);
+}
+
+static void task_slice_expired(void *arg) {
+    struct run_queue_t *rq = arg;
+    locked_write(int, &rq->need_resched, 1);
+}
+
+/* (Re)start the current CPU's time slice if other threads wait for it, stop
+ * it otherwise. Called with interrupts disabled. */
+static void task_update_slice(void) {
+    struct run_queue_t *rq = &run_queues[current_cpu];
+
+    locked_write(int, &rq->need_resched, 0);
+    timer_cancel(&rq->slice_timer);
+    if (rq_wants_slice(rq))
+        timer_arm(&rq->slice_timer, get_uptime_ns() + SCHED_TIMESLICE_NS,
+                  task_slice_expired, rq);
+}
+
+static inline int cpu_is_idle(int cpu) {
+    return locked_read(tid_t, &cpu_locals[cpu].current_task) == -1
+        && !locked_read(int, &run_queues[cpu].count);
+}
+
+/* Whether a thread queued on a CPU should preempt the thread running there */
+static int task_preempts(struct thread_t *thread, struct run_queue_t *rq) {
+    int prio = thread_prio(thread);
+    int curr_prio = locked_read(int, &rq->curr_prio);
+
+    if (prio != curr_prio)
+        return prio > curr_prio;
+    /* Real time peers wait for their turn */
+    if (prio)
+        return 0;
+    /* The running thread had its share, let the waking one in now */
+    return vruntime_diff(thread->vruntime + SCHED_WAKEUP_GRANULARITY_NS,
+                         locked_read(uint64_t, &rq->curr_vruntime)) < 0;
+}
+
+/* Threads stay on the CPU they last ran on unless it is busy while another
+ * one idles, idle CPUs don't go looking for work by themselves. Real time
+ * threads otherwise look for a CPU running something less important. New
+ * threads go to the CPU with the shortest queue. Only CPUs in the thread's
+ * cpus_allowed are considered. */
+static int rq_select_cpu(struct thread_t *thread) {
+    const cpumask_t *allowed = &thread->cpus_allowed;
+    int last_cpu = thread->last_cpu;
+
+    if (last_cpu != -1 && !cpumask_test(allowed, last_cpu))
+        last_cpu = -1;
+
+    if (last_cpu != -1 && cpu_is_idle(last_cpu))
+        return last_cpu;
+
+    for (int i = 0; i < smp_cpu_count; i++) {
+        if (cpumask_test(allowed, i) && cpu_is_idle(i))
+            return i;
+    }
+
+    int prio = thread_prio(thread);
+    if (prio) {
+        int target = last_cpu;
+        int target_prio = last_cpu == -1 ? prio
+                        : locked_read(int, &run_queues[last_cpu].curr_prio);
+        for (int i = 0; i < smp_cpu_count && target_prio; i++) {
+            if (!cpumask_test(allowed, i))
+                continue;
+            int curr_prio = locked_read(int, &run_queues[i].curr_prio);
+            if (curr_prio < target_prio) {
+                target = i;
+                target_prio = curr_prio;
+            }
         }
-        if (!spinlock_test_and_acquire(&thread->lock)) {
-            /* If unable to acquire the thread's lock, skip */
-            goto next;
+        if (target != -1)
+            return target;
+    }
+
+    if (last_cpu != -1)
+        return last_cpu;
+
+    int best_cpu = current_cpu;
+    if (!cpumask_test(allowed, best_cpu))
+        best_cpu = cpumask_first(allowed, smp_cpu_count);
+    int best_count = locked_read(int, &run_queues[best_cpu].count);
+
+    for (int i = 0; i < smp_cpu_count && best_count; i++) {
+        if (!cpumask_test(allowed, i))
+            continue;
+        int count = locked_read(int, &run_queues[i].count);
+        if (count < best_count) {
+            best_cpu = i;
+            best_count = count;
         }
-        if (locked_read(int, &thread->paused)) {
-            spinlock_release(&thread->lock);
-            goto next;
+    }
+
+    return best_cpu;
+}
+
+/* Queue a thread on a given CPU and make sure that CPU gets to it. Must be
+ * called with the thread's wake_lock held and interrupts disabled. */
+static void task_enqueue_on(struct thread_t *thread, int cpu) {
+    struct run_queue_t *rq = &run_queues[cpu];
+
+    if (thread->policy == SCHED_OTHER) {
+        uint64_t min_vruntime = locked_read(uint64_t, &rq->min_vruntime);
+
+        if (thread->last_cpu == -1)
+            thread->vruntime = min_vruntime;
+        else if (thread->last_cpu != cpu)
+            rq_rebase(thread, thread->last_cpu, cpu);
+
+        /* Sleeping doesn't bank CPU time beyond a small head start */
+        if (vruntime_diff(thread->vruntime, min_vruntime - SCHED_SLEEPER_CREDIT_NS) < 0)
+            thread->vruntime = min_vruntime - SCHED_SLEEPER_CREDIT_NS;
+    }
+
+    int was_empty = rq_add(thread, cpu, 1);
+
+    if (locked_read(tid_t, &cpu_locals[cpu].current_task) == -1) {
+        /* Wake the CPU up from idle */
+        lapic_send_ipi(cpu, IPI_RESCHED);
+    } else if (task_preempts(thread, rq)) {
+        lapic_send_ipi(cpu, IPI_RESCHED);
+    } else if (cpu == current_cpu) {
+        /* The running thread may have company now and need a time slice */
+        if (rq->slice_timer.cpu == -1 && !rq->need_resched && rq_wants_slice(rq))
+            timer_arm(&rq->slice_timer, get_uptime_ns() + SCHED_TIMESLICE_NS,
+                      task_slice_expired, rq);
+    } else {
+        /* The slice timer can only be armed by its own CPU, so a remote one
+         * reschedules right away instead */
+        int curr_policy = locked_read(int, &rq->curr_policy);
+        if ((curr_policy == SCHED_OTHER && was_empty)
+         || (curr_policy == SCHED_RR && thread->policy == SCHED_RR
+          && thread->rt_priority == locked_read(int, &rq->curr_prio)))
+            lapic_send_ipi(cpu, IPI_RESCHED);
+    }
+}
+
+/* Queue a thread which became runnable. Must be called with the thread's
+ * wake_lock held and interrupts disabled. */
+static void task_enqueue_locked(struct thread_t *thread) {
+    if (thread->rq_cpu != -1 || thread->active_on_cpu != -1)
+        return;
+
+    task_enqueue_on(thread, rq_select_cpu(thread));
+}
+
+void task_enqueue(struct thread_t *thread) {
+    uint64_t rflags = save_and_disable_interrupts();
+    spinlock_acquire(&thread->wake_lock);
+    task_enqueue_locked(thread);
+    spinlock_release(&thread->wake_lock);
+    restore_interrupts(rflags);
+}
+
+/* Mark a thread as waiting. The next resched takes it off the run queues
+ * until task_wake() is called. Must be called by the thread itself with
+ * scheduler_lock held, so that it cannot be switched out halfway. */
+void task_block(struct thread_t *thread) {
+    uint64_t rflags = save_and_disable_interrupts();
+    spinlock_acquire(&thread->wake_lock);
+    locked_write(int, &thread->blocked, 1);
+    spinlock_release(&thread->wake_lock);
+    restore_interrupts(rflags);
+}
+
+/* Make a blocked thread runnable again. Safe to call from interrupt context
+ * and on threads which are not blocked. */
+void task_wake(struct thread_t *thread) {
+    uint64_t rflags = save_and_disable_interrupts();
+    spinlock_acquire(&thread->wake_lock);
+    if (thread->blocked) {
+        thread->blocked = 0;
+        task_enqueue_locked(thread);
+    }
+    spinlock_release(&thread->wake_lock);
+    restore_interrupts(rflags);
+}
+
+/* Called by task_resched() on the thread it is switching away from */
+static void task_switch_out(struct thread_t *thread, int slice_expired) {
+    spinlock_acquire(&thread->wake_lock);
+    thread->active_on_cpu = -1;
+    /* Paused threads wait for task_tresume(), blocked ones for task_wake().
+     * Preempted threads stay on this CPU, they only migrate when woken or
+     * when their affinity no longer allows this CPU.
+     * SCHED_FIFO threads keep their place among their peers, SCHED_RR ones
+     * only until their slice runs out. */
+    if (!locked_read(int, &thread->paused) && !thread->blocked
+     && thread->rq_cpu == -1) {
+        if (cpumask_test(&thread->cpus_allowed, current_cpu))
+            rq_add(thread, current_cpu, thread->policy == SCHED_RR && slice_expired);
+        else
+            task_enqueue_on(thread, rq_select_cpu(thread));
+    }
+    spinlock_release(&thread->wake_lock);
+}
+
+/* Take a thread off its run queue, returns whether it was queued */
+static int task_dequeue(struct thread_t *thread) {
+    int ret = 0;
+    uint64_t rflags = save_and_disable_interrupts();
+
+    for (;;) {
+        int cpu = locked_read(int, &thread->rq_cpu);
+        if (cpu == -1)
+            break;
+        struct run_queue_t *rq = &run_queues[cpu];
+        spinlock_acquire(&rq->lock);
+        /* The thread may have been stolen before we got the lock */
+        if (thread->rq_cpu == cpu) {
+            rq_remove_locked(rq, thread);
+            locked_write(int, &thread->rq_cpu, -1);
+            spinlock_release(&rq->lock);
+            ret = 1;
+            break;
         }
-        if (thread->event_ptr) {
-            if(!thread->event_abrt) {
-                int wake = 0;
-                for(int i = 0; i < (thread->event_num); i++) {
-                    if(locked_read(event_t, thread->event_ptr[i])) {
-                        wake = 1;
-                        locked_dec(thread->event_ptr[i]);
-                        thread->out_event_ptr[i] = 1;
-                    }
-                }
-
-                //only trigger timeout if no other events happened
-                if(thread->event_timeout <= uptime_raw && (thread->event_timeout != 0) && !wake) {
-                    thread->event_ptr = 0;
-                    thread->event_timeout = 0;
-                    wake = 1;
-                }
-
-                if(wake) {
-                    thread->event_ptr = 0;
-                } else {
-                    spinlock_release(&thread->lock);
-                    goto next;
-                }
-            }
+        spinlock_release(&rq->lock);
+    }
+
+    restore_interrupts(rflags);
+    return ret;
+}
+
+/* Take the lock of a queued thread. The CPU switching a thread out lets go
+ * of its lock right after queueing it, wait for that instead of passing the
+ * thread over. Returns 0 if the thread got paused meanwhile. */
+static int rq_lock_thread(struct thread_t *thread) {
+    while (!spinlock_test_and_acquire(&thread->lock)) {
+        if (locked_read(int, &thread->paused))
+            return 0;
+        asm volatile ("pause");
+    }
+    return 1;
+}
+
+/* Take the highest priority real time thread, or else the runnable thread
+ * with the least virtual runtime, off a CPU's queue to run it on `cpu`.
+ * Returns with the thread's lock held. Threads which may not run on `cpu`
+ * are skipped when stealing. Paused ones are dropped
+ * until task_tresume() queues them again. */
+static struct thread_t *rq_pick_tree(struct run_queue_t *rq, struct rb_root *tree,
+                                     int cpu) {
+    struct rb_node *node = rb_first(tree);
+
+    while (node) {
+        struct thread_t *thread = rb_entry(node, struct thread_t, rq_node);
+        node = rb_next(node);
+        if (!locked_read(int, &thread->paused)
+         && !cpumask_test(&thread->cpus_allowed, cpu))
+            continue;
+        rq_remove_locked(rq, thread);
+        locked_write(int, &thread->rq_cpu, -1);
+        if (locked_read(int, &thread->paused) || !rq_lock_thread(thread))
+            continue;
+        return thread;
+    }
+
+    return NULL;
+}
+
+static struct thread_t *rq_pick(int victim, int cpu) {
+    struct run_queue_t *rq = &run_queues[victim];
+
+    spinlock_acquire(&rq->lock);
+
+    struct thread_t *ret = rq_pick_tree(rq, &rq->rt_tree, cpu);
+    if (!ret)
+        ret = rq_pick_tree(rq, &rq->tree, cpu);
+
+    spinlock_release(&rq->lock);
+
+    return ret;
+}
+
+/* Find a new thread to run, returns with the thread's lock held */
+static struct thread_t *task_get_next(int cpu) {
+    struct thread_t *thread = rq_pick(cpu, cpu);
+    if (thread)
+        return thread;
+
+    /* Our queue ran dry, steal work from the other CPUs */
+    for (int i = 1; i < smp_cpu_count; i++) {
+        int victim = (cpu + i) % smp_cpu_count;
+        if (!locked_read(int, &run_queues[victim].count))
+            continue;
+        if ((thread = rq_pick(victim, cpu))) {
+            rq_rebase(thread, victim, cpu);
+            return thread;
         }
-        return current_task;
-        next:
-        i++;
-        skip:
-        if (++current_task == MAX_TASKS)
-            current_task = 0;
     }
 
-    return -1;
+    return NULL;
 }
 
 __attribute__((noinline)) static void _idle(void) {
@@ -238,17 +726,16 @@ __attribute__((noinline)) static void _idle(void) {
     cpu_locals[_current_cpu].current_task = -1;
     cpu_locals[_current_cpu].current_thread = -1;
     cpu_locals[_current_cpu].current_process = -1;
-    spinlock_release(&scheduler_lock);
-    spinlock_release(&resched_lock);
-    asm volatile (
-        "sti;"
-        "1: "
-        "hlt;"
-        "jmp 1b;"
-    );
+    asm volatile ("sti");
+    for (;;) {
+        /* Put idle time to use by pre-zeroing pages for pmm_allocz() */
+        if (!pmm_zero_pool_refill())
+            asm volatile ("hlt");
+    }
 }
 
 __attribute__((noinline)) static void idle(void) {
+    locked_write(struct pagemap_t *, &cpu_locals[current_cpu].current_pagemap, kernel_pagemap);
     /* This idle function swaps cr3 and rsp then calls _idle for technical reasons */
     asm volatile (
         "mov rbx, cr3;"
@@ -259,25 +746,30 @@ __attribute__((noinline)) static void idle(void) {
         "mov rsp, qword ptr gs:[8];"
         "jmp _idle;"
         :
-        : "a" ((size_t)kernel_pagemap->pml4 - MEM_PHYS_OFFSET)
+        : "a" (vmm_get_cr3(kernel_pagemap))
     );
     /* Dead call so GCC doesn't garbage collect _idle */
     _idle();
 }
 
+/* Switch the current CPU to the next thread. Called with interrupts
+ * disabled. Only returns if the running thread holds scheduler_lock, in which
+ * case sched_unlock() reschedules later. */
 void task_resched(struct regs_t *regs) {
-    spinlock_acquire(&resched_lock);
+    int _current_cpu = current_cpu;
+    struct run_queue_t *rq = &run_queues[_current_cpu];
 
-    if (!spinlock_test_and_acquire(&scheduler_lock)) {
-        spinlock_release(&resched_lock);
+    if (rq->sched_locked) {
+        rq->resched_deferred = 1;
         return;
     }
+    rq->resched_deferred = 0;
 
-    int _current_cpu = current_cpu;
+    uint64_t now = get_uptime_ns();
+    int slice_expired = locked_read(int, &rq->need_resched);
 
     pid_t current_task = cpu_locals[_current_cpu].current_task;
     pid_t current_process = cpu_locals[_current_cpu].current_process;
-    pid_t last_task = current_task;
 
     if (current_task != -1) {
         struct thread_t *current_thread = task_table[current_task];
@@ -285,33 +777,52 @@ void task_resched(struct regs_t *regs) {
         if (current_thread == (void *)-1)
             goto skip_invalid_thread_context_save;
         /* Save current context */
-        current_thread->active_on_cpu = -1;
         current_thread->ctx.regs = *regs;
         if (current_process) {
-            /* Save FPU context */
+            /* Save FPU context. The registers keep holding it until another
+             * user thread gets switched in on this CPU. */
             cpu_save_simd(current_thread->ctx.fxstate);
             /* Save user rsp */
             current_thread->ustack = cpu_locals[current_cpu].thread_ustack;
             /* Save errno */
             current_thread->thread_errno = cpu_locals[current_cpu].thread_errno;
         }
-        /* Release lock on this thread */
+        task_account(current_thread, now);
+        /* Put it back on this CPU's queue if it can still run */
+        task_switch_out(current_thread, slice_expired);
+        /* Release lock on this thread, other CPUs may run it from now on */
         spinlock_release(&current_thread->lock);
     }
 skip_invalid_thread_context_save:
 
-    cpu_locals[_current_cpu].last_schedule_time = uptime_raw;
+    cpu_locals[_current_cpu].last_schedule_time = now;
 
     /* Get to the next task */
-    current_task = task_get_next(current_task);
+    struct thread_t *thread = task_get_next(_current_cpu);
+
     /* If there's nothing to do, idle */
-    if (current_task == -1)
+    if (!thread) {
+        locked_write(int, &rq->curr_policy, SCHED_OTHER);
+        locked_write(int, &rq->curr_prio, 0);
+        task_update_slice();
         idle();
+    }
+
+    thread->exec_start = now;
+    if (thread->policy == SCHED_OTHER) {
+        /* The picked thread was the leftmost one, move the clock up to it */
+        if (vruntime_diff(thread->vruntime, rq->min_vruntime) > 0)
+            locked_write(uint64_t, &rq->min_vruntime, thread->vruntime);
+        locked_write(uint64_t, &rq->curr_vruntime, thread->vruntime);
+    }
+    locked_write(int, &rq->curr_policy, thread->policy);
+    locked_write(int, &rq->curr_prio, thread_prio(thread));
+
+    task_update_slice();
 
     struct cpu_local_t *cpu_local = &cpu_locals[_current_cpu];
-    struct thread_t *thread = task_table[current_task];
 
-    cpu_local->current_task = current_task;
+    cpu_local->current_task = thread->task_id;
     cpu_local->current_thread = thread->tid;
     cpu_local->current_process = thread->process;
 
@@ -319,43 +830,43 @@ skip_invalid_thread_context_save:
         cpu_local->thread_kstack = thread->kstack;
         cpu_local->thread_ustack = thread->ustack;
         cpu_local->thread_errno = thread->thread_errno;
-        /* Restore FPU context */
-        cpu_restore_simd(thread->ctx.fxstate);
+        /* Restore FPU context, unless the thread last ran here and no other
+         * user thread loaded its own since. Kernel threads never touch it. */
+        if (cpu_local->fpu_owner != thread || thread->fpu_cpu != _current_cpu) {
+            cpu_restore_simd(thread->ctx.fxstate);
+            cpu_local->fpu_owner = thread;
+            thread->fpu_cpu = _current_cpu;
+        }
         /* Restore thread FS base */
-        load_fs_base(thread->fs_base);
+        cpu_set_fs_base(thread->fs_base);
     }
 
     thread->active_on_cpu = _current_cpu;
+    thread->last_cpu = _current_cpu;
 
     /* Swap cr3, if necessary */
-    if (task_table[last_task]->process != thread->process) {
+    struct pagemap_t *pagemap = process_table[thread->process]->pagemap;
+    if (cpu_local->current_pagemap != pagemap) {
         /* Switch cr3 and return to the thread */
-        task_spinup(&thread->ctx.regs, (size_t)process_table[thread->process]->pagemap->pml4 - MEM_PHYS_OFFSET);
+        /* Published before vmm_get_cr3() samples the shootdown generation */
+        locked_write(struct pagemap_t *, &cpu_local->current_pagemap, pagemap);
+        task_spinup(&thread->ctx.regs, vmm_get_cr3(pagemap));
     } else {
         /* Don't switch cr3 and return to the thread */
         task_spinup(&thread->ctx.regs, 0);
     }
 }
 
-static int pit_ticks = 0;
-
-void task_resched_bsp(struct regs_t *regs) {
-    if (scheduler_ready) {
-        if (++pit_ticks == SCHED_TIMESLICE_MS) {
-            pit_ticks = 0;
-        } else {
-            return;
-        }
-
-        for (int i = 1; i < smp_cpu_count; i++)
-            lapic_send_ipi(i, IPI_RESCHED);
+/* Called by the local APIC timer interrupt */
+void task_timer_interrupt(struct regs_t *regs) {
+    timer_handler();
 
-        /* Call task_scheduler on the BSP */
+    if (locked_read(int, &run_queues[current_cpu].need_resched))
         task_resched(regs);
-    }
 }
 
-void task_resched_ap(struct regs_t *regs) {
+/* Called by the IPI_RESCHED interrupt */
+void task_resched_ipi(struct regs_t *regs) {
     locked_write(int, &cpu_locals[current_cpu].ipi_resched_received, 1);
     task_resched(regs);
 }
@@ -365,7 +876,7 @@ void task_resched_ap(struct regs_t *regs) {
 /* Create process */
 /* Returns process ID, -1 on failure */
 pid_t task_pcreate(void) {
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
 
     /* Search for free process ID */
     pid_t new_pid;
@@ -373,36 +884,36 @@ pid_t task_pcreate(void) {
         if (!process_table[new_pid] || process_table[new_pid] == (void *)(-1))
             goto found_new_pid;
     }
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
     return -1;
 
 found_new_pid:
     process_table[new_pid] = (void *)(-2); // placeholder
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     /* Try to make space for this new task */
     struct process_t *new_process = kalloc(sizeof(struct process_t));
     if (!new_process) {
-        spinlock_acquire(&scheduler_lock);
+        sched_lock();
         process_table[new_pid] = EMPTY;
-        spinlock_release(&scheduler_lock);
+        sched_unlock();
         return -1;
     }
 
     if ((new_process->threads = kalloc(MAX_THREADS * sizeof(struct thread_t *))) == 0) {
         kfree(new_process);
-        spinlock_acquire(&scheduler_lock);
+        sched_lock();
         process_table[new_pid] = EMPTY;
-        spinlock_release(&scheduler_lock);
+        sched_unlock();
         return -1;
     }
 
     if ((new_process->file_handles = kalloc(MAX_FILE_HANDLES * sizeof(int))) == 0) {
         kfree(new_process->threads);
         kfree(new_process);
-        spinlock_acquire(&scheduler_lock);
+        sched_lock();
         process_table[new_pid] = EMPTY;
-        spinlock_release(&scheduler_lock);
+        sched_unlock();
         return -1;
     }
 
@@ -435,21 +946,37 @@ found_new_pid:
         kfree(new_process->file_handles);
         kfree(new_process->threads);
         kfree(new_process);
-        spinlock_acquire(&scheduler_lock);
+        sched_lock();
         process_table[new_pid] = EMPTY;
-        spinlock_release(&scheduler_lock);
+        sched_unlock();
         return -1;
     }
 
     new_process->pid = new_pid;
 
     // Actually "enable" the new process
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     process_table[new_pid] = new_process;
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
     return new_pid;
 }
 
+/* Called by the IPI_ABORTEXEC interrupt before it abandons the running
+ * thread. The thread task_tkill() is after may have been switched out since
+ * the IPI was sent, returns 0 and reports the miss if it does not run here. */
+int task_abortexec_check(void) {
+    int _current_cpu = current_cpu;
+    struct cpu_local_t *cpu_local = &cpu_locals[_current_cpu];
+
+    if (cpu_local->current_task != -1
+     && cpu_local->current_task == locked_read(tid_t, &cpu_local->abortexec_task))
+        return 1;
+
+    lapic_eoi();
+    locked_write(int, &cpu_local->ipi_abortexec_received, -1);
+    return 0;
+}
+
 void abort_thread_exec(size_t scheduler_not_locked) {
     write_cr("3", (size_t)kernel_pagemap->pml4 - MEM_PHYS_OFFSET);
 
@@ -476,26 +1003,31 @@ void abort_thread_exec(size_t scheduler_not_locked) {
 #define STACK_SIZE ((size_t)32768)
 
 int task_tpause(pid_t pid, tid_t tid) {
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
 
     if (!process_table[pid]->threads[tid]
         || process_table[pid]->threads[tid] == (void *)(-1)
         || process_table[pid]->threads[tid] == (void *)(-2)) {
-        spinlock_release(&scheduler_lock);
+        sched_unlock();
         return -1;
     }
 
     struct thread_t *thread = process_table[pid]->threads[tid];
-    int active_on_cpu = thread->active_on_cpu;
 
     locked_write(int, &thread->event_abrt, 1);
+    task_wake(thread);
 
     while (locked_read(int, &thread->in_syscall)) {
         force_resched();
-        spinlock_acquire(&scheduler_lock);
+        sched_lock();
     }
 
     locked_write(int, &thread->paused, 1);
+    task_dequeue(thread);
+
+    /* Other CPUs keep scheduling, sample this only now that the thread
+     * cannot be picked up anymore */
+    int active_on_cpu = locked_read(int, &thread->active_on_cpu);
 
     panic_unless(active_on_cpu != current_cpu);
 
@@ -505,69 +1037,205 @@ int task_tpause(pid_t pid, tid_t tid) {
         while (!locked_read(int, &cpu_locals[active_on_cpu].ipi_resched_received));
     }
 
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     return 0;
 }
 
 int task_tresume(pid_t pid, tid_t tid) {
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
 
     if (!process_table[pid]->threads[tid]
         || process_table[pid]->threads[tid] == (void *)(-1)
         || process_table[pid]->threads[tid] == (void *)(-2)) {
-        spinlock_release(&scheduler_lock);
+        sched_unlock();
         return -1;
     }
 
     locked_write(int, &process_table[pid]->threads[tid]->event_abrt, 0);
     locked_write(int, &process_table[pid]->threads[tid]->paused, 0);
+    task_enqueue(process_table[pid]->threads[tid]);
 
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     return 0;
 }
 
+/* Change the scheduling class of a thread, see sched_param_valid() */
+/* Return -1 on failure */
+int task_setscheduler(pid_t pid, tid_t tid, int policy, int priority) {
+    if (!sched_param_valid(policy, priority))
+        return -1;
+
+    sched_lock();
+
+    if (!process_table[pid]->threads[tid]
+        || process_table[pid]->threads[tid] == (void *)(-1)
+        || process_table[pid]->threads[tid] == (void *)(-2)) {
+        sched_unlock();
+        return -1;
+    }
+
+    struct thread_t *thread = process_table[pid]->threads[tid];
+
+    uint64_t rflags = save_and_disable_interrupts();
+    spinlock_acquire(&thread->wake_lock);
+
+    /* The policy picks the tree, so requeue the thread around the change */
+    int queued = task_dequeue(thread);
+
+    if (thread->policy != SCHED_OTHER && policy == SCHED_OTHER) {
+        /* Rejoin the fair class level with the other threads */
+        int cpu = thread->last_cpu == -1 ? current_cpu : thread->last_cpu;
+        thread->vruntime = locked_read(uint64_t, &run_queues[cpu].min_vruntime);
+    }
+    thread->policy = policy;
+    thread->rt_priority = priority;
+
+    if (queued)
+        task_enqueue_locked(thread);
+
+    int active_on_cpu = thread->active_on_cpu;
+
+    spinlock_release(&thread->wake_lock);
+    restore_interrupts(rflags);
+
+    /* A running thread which lost priority may have to make way */
+    if (active_on_cpu != -1)
+        lapic_send_ipi(active_on_cpu, IPI_RESCHED);
+
+    sched_unlock();
+
+    return 0;
+}
+
+/* Restrict a thread to the CPUs in a mask, which has to contain at least one
+ * online CPU. A running thread moves away from a CPU it may no longer use
+ * right away. */
+/* Return -1 on failure */
+int task_setaffinity(pid_t pid, tid_t tid, const cpumask_t *mask) {
+    if (cpumask_first(mask, smp_cpu_count) == -1)
+        return -1;
+
+    sched_lock();
+
+    if (!process_table[pid]->threads[tid]
+        || process_table[pid]->threads[tid] == (void *)(-1)
+        || process_table[pid]->threads[tid] == (void *)(-2)) {
+        sched_unlock();
+        return -1;
+    }
+
+    struct thread_t *thread = process_table[pid]->threads[tid];
+
+    uint64_t rflags = save_and_disable_interrupts();
+    spinlock_acquire(&thread->wake_lock);
+
+    /* A queued thread may sit on a CPU it is no longer allowed on */
+    int queued = task_dequeue(thread);
+
+    thread->cpus_allowed = *mask;
+
+    if (queued)
+        task_enqueue_locked(thread);
+
+    int active_on_cpu = thread->active_on_cpu;
+
+    spinlock_release(&thread->wake_lock);
+    restore_interrupts(rflags);
+
+    if (active_on_cpu != -1 && !cpumask_test(mask, active_on_cpu)) {
+        if (active_on_cpu == current_cpu) {
+            /* The caller itself, task_switch_out() finds it a new CPU */
+            sched_unlock();
+            yield();
+            return 0;
+        }
+        lapic_send_ipi(active_on_cpu, IPI_RESCHED);
+    }
+
+    sched_unlock();
+
+    return 0;
+}
+
+/* Pin the calling kernel thread to the CPUs given by the kworker_cpus=
+ * command line option, all of them by default */
+void task_pin_kworker(void) {
+    task_setaffinity(0, CURRENT_THREAD, &kworker_cpus);
+}
+
 /* Kill a thread in a given process */
 /* Return -1 on failure */
 int task_tkill(pid_t pid, tid_t tid) {
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
 
     if (!process_table[pid]->threads[tid]
         || process_table[pid]->threads[tid] == (void *)(-1)
         || process_table[pid]->threads[tid] == (void *)(-2)) {
-        spinlock_release(&scheduler_lock);
+        sched_unlock();
         return -1;
     }
 
     struct thread_t *thread = process_table[pid]->threads[tid];
-    int active_on_cpu = thread->active_on_cpu;
 
     locked_write(int, &thread->event_abrt, 1);
+    task_wake(thread);
 
     while (locked_read(int, &thread->in_syscall)) {
         force_resched();
-        spinlock_acquire(&scheduler_lock);
+        sched_lock();
     }
 
-    if (active_on_cpu != -1 && active_on_cpu != current_cpu) {
-        /* Send abort execution IPI */
-        locked_write(int, &cpu_locals[active_on_cpu].ipi_abortexec_received, 0);
-        lapic_send_ipi(active_on_cpu, IPI_ABORTEXEC);
-        while (!locked_read(int, &cpu_locals[active_on_cpu].ipi_abortexec_received));
+    int self = thread->task_id == cpu_locals[current_cpu].current_task;
+
+    if (!self) {
+        /* Keep other CPUs from picking the thread up again */
+        locked_write(int, &thread->paused, 1);
+        task_dequeue(thread);
+
+        /* The CPU running a thread holds its lock. Once we own the lock, or
+         * the CPU running the thread abandoned it, it is off every CPU for
+         * good. */
+        while (!spinlock_test_and_acquire(&thread->lock)) {
+            int cpu = locked_read(int, &thread->active_on_cpu);
+            if (cpu == -1) {
+                /* Being switched in or out */
+                asm volatile ("pause");
+                continue;
+            }
+
+            /* Send abort execution IPI */
+            locked_write(tid_t, &cpu_locals[cpu].abortexec_task, thread->task_id);
+            locked_write(int, &cpu_locals[cpu].ipi_abortexec_received, 0);
+            lapic_send_ipi(cpu, IPI_ABORTEXEC);
+            int received;
+            while (!(received = locked_read(int, &cpu_locals[cpu].ipi_abortexec_received)));
+            if (received == 1)
+                break;
+        }
     }
 
+    task_dequeue(thread);
+
+    /* The process keeps the CPU time of its dead threads */
+    if (self)
+        task_account(thread, get_uptime_ns());
+    spinlock_acquire(&process_table[pid]->usage_lock);
+    add_usage_ns(&process_table[pid]->own_usage, thread->utime, thread->stime);
+    spinlock_release(&process_table[pid]->usage_lock);
+
     task_table[process_table[pid]->threads[tid]->task_id] = (void *)(-1);
 
     void *kstack = (void *)(process_table[pid]->threads[tid]->kstack - STACK_SIZE);
 
-    kfree(process_table[pid]->threads[tid]);
+    kmem_cache_free(thread_cache, process_table[pid]->threads[tid]);
 
     process_table[pid]->threads[tid] = (void *)(-1);
 
     task_count--;
 
-    if (active_on_cpu == current_cpu) {
+    if (self) {
         asm volatile (
             "mov rsp, qword ptr gs:[8];"
             "call kfree;"
@@ -581,7 +1249,7 @@ int task_tkill(pid_t pid, tid_t tid) {
         kfree(kstack);
     }
 
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     return 0;
 }
@@ -589,7 +1257,7 @@ int task_tkill(pid_t pid, tid_t tid) {
 /* Create thread from function pointer */
 /* Returns thread ID, -1 on failure */
 tid_t task_tcreate(pid_t pid, enum tcreate_abi abi, const void *opaque_data) {
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
 
     /* Search for free thread ID in the process */
     tid_t new_tid;
@@ -597,7 +1265,7 @@ tid_t task_tcreate(pid_t pid, enum tcreate_abi abi, const void *opaque_data) {
         if (!process_table[pid]->threads[new_tid] || process_table[pid]->threads[new_tid] == (void *)(-1))
             goto found_new_tid;
     }
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
     return -1;
 found_new_tid:;
     process_table[pid]->threads[new_tid] = (void *)(-2); // placeholder
@@ -609,37 +1277,42 @@ found_new_tid:;
             goto found_new_task_id;
     }
     process_table[pid]->threads[new_tid] = EMPTY;
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
     return -1;
 found_new_task_id:;
     task_table[new_task_id] = (void *)(-2); // placeholder
 
-    spinlock_release(&scheduler_lock);
+    sched_unlock();
 
     /* Try to make space for this new thread */
     struct thread_t *new_thread;
-    if (!(new_thread = kalloc(sizeof(struct thread_t)))) {
-        spinlock_acquire(&scheduler_lock);
+    if (!(new_thread = kmem_cache_alloc(thread_cache))) {
+        sched_lock();
         process_table[pid]->threads[new_tid] = EMPTY;
         task_table[new_task_id] = EMPTY;
-        spinlock_release(&scheduler_lock);
+        sched_unlock();
         return -1;
     }
 
     /* Set up a kernel stack for the thread */
     new_thread->kstack = (size_t)kalloc(STACK_SIZE) + STACK_SIZE;
     if (new_thread->kstack == STACK_SIZE) {
-        kfree(new_thread);
-        spinlock_acquire(&scheduler_lock);
+        kmem_cache_free(thread_cache, new_thread);
+        sched_lock();
         process_table[pid]->threads[new_tid] = EMPTY;
         task_table[new_task_id] = EMPTY;
-        spinlock_release(&scheduler_lock);
+        sched_unlock();
         return -1;
     }
     new_thread->kstack -= sizeof(uint64_t);
     *((size_t *)new_thread->kstack) = 0;
 
     new_thread->active_on_cpu = -1;
+    new_thread->rq_cpu = -1;
+    new_thread->last_cpu = -1;
+    new_thread->fpu_cpu = -1;
+    new_thread->wake_lock = new_lock;
+    cpumask_fill(&new_thread->cpus_allowed);
 
     /* Set registers to defaults */
     if (pid)
@@ -660,11 +1333,11 @@ found_new_task_id:;
         char *stack_pm = pmm_allocz(STACK_SIZE / PAGE_SIZE);
         if (!stack_pm) {
             kfree((void *)(new_thread->kstack - STACK_SIZE));
-            kfree(new_thread);
-            spinlock_acquire(&scheduler_lock);
+            kmem_cache_free(thread_cache, new_thread);
+            sched_lock();
             process_table[pid]->threads[new_tid] = EMPTY;
             task_table[new_task_id] = EMPTY;
-            spinlock_release(&scheduler_lock);
+            sched_unlock();
             return -1;
         }
 
@@ -732,12 +1405,8 @@ found_new_task_id:;
         panic_unless(!((size_t)sp & 0xF) && "Stack must be 16-byte aligned on x86_64");
 
         /* Map the stack */
-        for (size_t i = 0; i < STACK_SIZE / PAGE_SIZE; i++) {
-            map_page(process_table[pid]->pagemap,
-                     (size_t)(stack_pm + (i * PAGE_SIZE)),
-                     (size_t)(stack_bottom + (i * PAGE_SIZE)),
-                     pid ? 0x07 : 0x03);
-        }
+        map_range(process_table[pid]->pagemap, (size_t)stack_pm, stack_bottom,
+                  STACK_SIZE, pid ? 0x07 : 0x03);
         /* Add a guard page */
         unmap_page(process_table[pid]->pagemap, stack_guardpage);
         new_thread->ctx.regs.rsp = stack_bottom + STACK_SIZE - ((sbase - sp) * sizeof(size_t));
@@ -763,13 +1432,14 @@ found_new_task_id:;
     new_thread->tid = new_tid;
     new_thread->task_id = new_task_id;
     new_thread->process = pid;
-    spinlock_release(&new_thread->lock);
+    new_thread->lock = new_lock;
 
     /* Actually "enable" the new thread */
-    spinlock_acquire(&scheduler_lock);
+    sched_lock();
     process_table[pid]->threads[new_tid] = new_thread;
     task_table[new_task_id] = new_thread;
     task_count++;
-    spinlock_release(&scheduler_lock);
+    task_enqueue(new_thread);
+    sched_unlock();
     return new_tid;
 }
@@ -8,12 +8,43 @@
 #include <lib/time.h>
 #include <lib/types.h>
 #include <lib/signal.h>
+#include <lib/rbtree.h>
+#include <sys/cpumask.h>
 
 #define MAX_PROCESSES 65536
 #define MAX_THREADS 1024
 #define MAX_TASKS (MAX_PROCESSES*16)
 #define MAX_FILE_HANDLES 256
 
+#define NICE_MIN (-20)
+#define NICE_MAX 19
+
+#define SCHED_OTHER 0
+#define SCHED_FIFO 1
+#define SCHED_RR 2
+
+/* Real time priorities, higher runs first */
+#define SCHED_PRIO_MIN 1
+#define SCHED_PRIO_MAX 99
+
+struct sched_param {
+    int sched_priority;
+};
+
+/* SCHED_OTHER takes priority 0, the real time classes a priority from
+ * SCHED_PRIO_MIN to SCHED_PRIO_MAX */
+static inline int sched_param_valid(int policy, int priority) {
+    switch (policy) {
+        case SCHED_OTHER:
+            return !priority;
+        case SCHED_FIFO:
+        case SCHED_RR:
+            return priority >= SCHED_PRIO_MIN && priority <= SCHED_PRIO_MAX;
+        default:
+            return 0;
+    }
+}
+
 #define CURRENT_PROCESS cpu_locals[current_cpu].current_process
 #define CURRENT_THREAD cpu_locals[current_cpu].current_thread
 #define CURRENT_TASK cpu_locals[current_cpu].current_task
@@ -54,7 +85,6 @@ struct thread_t {
     int in_syscall;
     int last_syscall;
     int event_abrt;
-    uint64_t yield_target;
     int paused;
     int active_on_cpu;
     size_t kstack;
@@ -62,10 +92,30 @@ struct thread_t {
     size_t thread_errno;
     size_t fs_base;
     struct ctx_t ctx;
-    event_t **event_ptr;
-    int *out_event_ptr;
-    size_t event_timeout;
-    int event_num;
+    /* CPU whose registers still hold the SIMD state, -1 if only ctx does */
+    int fpu_cpu;
+    /* Waiting on events, see task_block() */
+    int blocked;
+    lock_t wake_lock;
+    /* Run queue linkage, rq_cpu is -1 while off every queue */
+    struct rb_node rq_node;
+    int rq_cpu;
+    /* CPU this thread last ran on, -1 if it never ran */
+    int last_cpu;
+    /* Fair share scheduling, see task_account() */
+    int nice;
+    uint64_t vruntime;
+    uint64_t exec_start;
+    /* CPU time used in user and kernel mode, in nanoseconds */
+    uint64_t utime;
+    uint64_t stime;
+    /* Scheduling class, see task_setscheduler() */
+    int policy;
+    int rt_priority;
+    /* Orders real time threads of equal priority */
+    uint64_t rt_queued;
+    /* CPUs the thread may run on, see task_setaffinity() */
+    cpumask_t cpus_allowed;
 };
 
 #define AT_ENTRY 10
@@ -113,14 +163,19 @@ int task_send_child_event(pid_t, struct child_event_t *);
 
 extern int64_t task_count;
 
-extern lock_t scheduler_lock;
+/* Taking scheduler_lock also keeps the caller from being switched out */
+void sched_lock(void);
+void sched_unlock(void);
 
 extern struct process_t **process_table;
 extern struct thread_t **task_table;
 
+extern struct kmem_cache_t *thread_cache;
+
 void init_sched(void);
 void yield(void);
 void relaxed_sleep(uint64_t);
+int task_sleep_until(uint64_t);
 
 enum tcreate_abi {
     tcreate_fn_call,
@@ -150,6 +205,13 @@ pid_t task_pcreate(void);
 int task_tkill(pid_t, tid_t);
 int task_tpause(pid_t, tid_t);
 int task_tresume(pid_t, tid_t);
+int task_setscheduler(pid_t, tid_t, int, int);
+int task_setaffinity(pid_t, tid_t, const cpumask_t *);
+void task_pin_kworker(void);
+void task_enqueue(struct thread_t *);
+void task_block(struct thread_t *);
+void task_wake(struct thread_t *);
+void task_account(struct thread_t *, uint64_t);
 
 void force_resched(void);
 
@@ -5,6 +5,9 @@
 #include <acpi/madt.h>
 #include <mm/mm.h>
 #include <sys/cpu.h>
+#include <lib/cio.h>
+#include <lib/rand.h>
+#include <lib/time.h>
 
 #define APIC_CPUID_BIT (1 << 9)
 
@@ -66,8 +69,126 @@ void lapic_eoi(void) {
 }
 
 void lapic_send_ipi(int cpu, uint8_t vector) {
+    /* Wakeups can send IPIs from interrupt handlers, don't let one land
+     * between the two ICR writes */
+    uint64_t rflags = save_and_disable_interrupts();
     lapic_write(APICREG_ICR1, ((uint32_t)cpu_locals[cpu].lapic_id) << 24);
     lapic_write(APICREG_ICR0, vector);
+    restore_interrupts(rflags);
+}
+
+#define LAPIC_TIMER_MASKED (1 << 16)
+#define LAPIC_TIMER_TSC_DEADLINE (1 << 18)
+#define LAPIC_TIMER_DIVIDE_16 0x3
+
+#define IA32_TSC_DEADLINE 0x6e0
+
+#define LAPIC_TIMER_CALIBRATION_NS 10000000
+/* Far deadlines are cut short, the timer code re-arms for the remainder */
+#define LAPIC_TIMER_MAX_NS ((uint64_t)1 << 40)
+
+int lapic_timer_ready = 0;
+
+static int lapic_timer_tsc_deadline = 0;
+
+/* Timer ticks (or TSC cycles in TSC-deadline mode) per nanosecond, 32.32
+ * fixed point */
+static uint64_t lapic_timer_mult;
+
+static inline uint64_t lapic_timer_ns_to_ticks(uint64_t ns) {
+    return (uint64_t)(((unsigned __int128)ns * lapic_timer_mult) >> 32);
+}
+
+/* Program this CPU's timer LVT. The timer stays disarmed until
+ * lapic_timer_arm() is called. */
+void lapic_timer_enable(void) {
+    lapic_write(APICREG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+
+    if (lapic_timer_tsc_deadline) {
+        lapic_write(APICREG_LVT_TIMER, LAPIC_TIMER_VECTOR | LAPIC_TIMER_TSC_DEADLINE);
+        /* Order the LVT write before any write to the deadline MSR */
+        asm volatile ("mfence" ::: "memory");
+    } else {
+        /* One-shot mode */
+        lapic_write(APICREG_LVT_TIMER, LAPIC_TIMER_VECTOR);
+    }
+}
+
+/* Calibrate the local APIC timer against get_uptime_ns() and enable it on
+ * the BSP. The APs share the result, they only call lapic_timer_enable(). */
+void init_lapic_timer(void) {
+    uint32_t eax, ebx, ecx, edx;
+
+    /* TSC-deadline mode is only accurate with a constant rate TSC */
+    if (cpuid(1, 0, &eax, &ebx, &ecx, &edx) && (ecx & (1 << 24))
+     && cpuid(0x80000007, 0, &eax, &ebx, &ecx, &edx) && (edx & (1 << 8)))
+        lapic_timer_tsc_deadline = 1;
+
+    lapic_write(APICREG_LVT_TIMER, LAPIC_TIMER_MASKED);
+    lapic_write(APICREG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+
+    /* Start on a clock edge, the PIT fallback only moves once a millisecond */
+    uint64_t start = get_uptime_ns();
+    uint64_t now;
+    while ((now = get_uptime_ns()) == start);
+    start = now;
+
+    lapic_write(APICREG_TIMER_INITIAL, 0xffffffff);
+    uint64_t tsc_start = rdtsc(uint64_t);
+
+    while ((now = get_uptime_ns()) - start < LAPIC_TIMER_CALIBRATION_NS);
+
+    uint64_t lapic_ticks = 0xffffffff - lapic_read(APICREG_TIMER_CURRENT);
+    uint64_t tsc_ticks = rdtsc(uint64_t) - tsc_start;
+    lapic_write(APICREG_TIMER_INITIAL, 0);
+
+    uint64_t ticks = lapic_timer_tsc_deadline ? tsc_ticks : lapic_ticks;
+    uint64_t elapsed = now - start;
+
+    /* There is no libgcc for 128-bit division. Over the calibration window
+     * ticks stays well below 2^32, so the 32.32 quotient fits 64 bits; an
+     * absurdly fast clock only costs low bits of precision. */
+    int shift = 32;
+    while (shift && (ticks >> (64 - shift)))
+        shift--;
+    lapic_timer_mult = ((ticks << shift) / elapsed) << (32 - shift);
+
+    kprint(KPRN_INFO, "apic: Timer frequency is %UHz%s",
+           ticks * 1000000000 / elapsed,
+           lapic_timer_tsc_deadline ? " (TSC-deadline mode)" : "");
+
+    lapic_timer_enable();
+    lapic_timer_ready = 1;
+}
+
+/* Have this CPU's timer fire once get_uptime_ns() reaches deadline, replacing
+ * whatever was armed before. Called with interrupts disabled. */
+void lapic_timer_arm(uint64_t deadline) {
+    uint64_t now = get_uptime_ns();
+    uint64_t delta = deadline > now ? deadline - now : 0;
+
+    if (delta > LAPIC_TIMER_MAX_NS)
+        delta = LAPIC_TIMER_MAX_NS;
+
+    uint64_t ticks = lapic_timer_ns_to_ticks(delta);
+
+    if (lapic_timer_tsc_deadline) {
+        /* A deadline of 0 would disarm the timer */
+        wrmsr(IA32_TSC_DEADLINE, rdtsc(uint64_t) + ticks + 1);
+    } else {
+        if (!ticks)
+            ticks = 1;
+        if (ticks > 0xffffffff)
+            ticks = 0xffffffff;
+        lapic_write(APICREG_TIMER_INITIAL, (uint32_t)ticks);
+    }
+}
+
+void lapic_timer_stop(void) {
+    if (lapic_timer_tsc_deadline)
+        wrmsr(IA32_TSC_DEADLINE, 0);
+    else
+        lapic_write(APICREG_TIMER_INITIAL, 0);
 }
 
 /* Read from the `io_apic_num`'th I/O APIC as described by the MADT */
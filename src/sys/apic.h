@@ -6,6 +6,12 @@
 
 #define APICREG_ICR0 0x300
 #define APICREG_ICR1 0x310
+#define APICREG_LVT_TIMER 0x320
+#define APICREG_TIMER_INITIAL 0x380
+#define APICREG_TIMER_CURRENT 0x390
+#define APICREG_TIMER_DIVIDE 0x3e0
+
+#define LAPIC_TIMER_VECTOR 0x30
 
 #define IPI_BASE 0x40
 #define IPI_RESCHED (IPI_BASE + 1)
@@ -20,6 +26,13 @@ void lapic_enable(void);
 void lapic_eoi(void);
 void lapic_send_ipi(int, uint8_t);
 
+extern int lapic_timer_ready;
+
+void init_lapic_timer(void);
+void lapic_timer_enable(void);
+void lapic_timer_arm(uint64_t);
+void lapic_timer_stop(void);
+
 uint32_t io_apic_read(size_t, uint32_t);
 void io_apic_write(size_t, uint32_t, uint32_t);
 size_t io_apic_from_redirect(uint32_t);
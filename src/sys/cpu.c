@@ -3,6 +3,7 @@
 #include <sys/panic.h>
 
 unsigned int cpu_simd_region_size;
+int cpu_pcid_enabled = 0;
 
 void (*cpu_save_simd)(void *);
 void (*cpu_restore_simd)(void *);
@@ -10,6 +11,8 @@ void (*cpu_restore_simd)(void *);
 #define XSAVE_BIT (1 << 26)
 #define AVX_BIT (1 << 28)
 #define AVX512_BIT (1 << 16)
+#define PCID_BIT (1 << 17)
+#define XSAVEOPT_BIT (1 << 0)
 
 void syscall_entry(void);
 
@@ -19,6 +22,8 @@ void init_cpu_features(void) {
     cr0 = read_cr("0");
     cr0 &= ~(1 << 2);
     cr0 |=  (1 << 1);
+    /* Fault on kernel writes to read-only pages, copy-on-write relies on it */
+    cr0 |=  (1 << 16);
     write_cr("0", cr0);
 
     uint64_t cr4 = 0;
@@ -33,6 +38,9 @@ void init_cpu_features(void) {
     pat_msr |= (uint64_t)0x0105 << 32;
     wrmsr(0x277, pat_msr);
 
+    // Start from a known FS base, cpu_set_fs_base() caches it per CPU
+    load_fs_base(0);
+
     // Enable syscall in EFER
     uint64_t efer = rdmsr(0xc0000080);
     efer |= 1;
@@ -48,6 +56,15 @@ void init_cpu_features(void) {
     uint32_t a, b, c, d;
     cpuid(1, 0, &a, &b, &c, &d);
 
+    // Tag TLB entries with the address space, PCIDE can only be set with PCID 0 loaded
+    if ((c & PCID_BIT) && !(read_cr("3") & 0xfff)) {
+        cr4 = read_cr("4");
+        cr4 |= (1 << 7);  // Global pages, toggling PGE is how all PCIDs get flushed
+        cr4 |= (1 << 17); // Enable PCIDs
+        write_cr("4", cr4);
+        cpu_pcid_enabled = 1;
+    }
+
     if ((c & XSAVE_BIT)) {
         cr4 = read_cr("4");
         cr4 |= (1 << 18); // Enable XSAVE and x{get, set}bv
@@ -77,6 +94,11 @@ void init_cpu_features(void) {
 
         cpu_save_simd = xsave;
         cpu_restore_simd = xrstor;
+
+        /* Context switches save every time but the state rarely changes
+         * much, let the CPU skip unmodified components */
+        if (cpuid(0xD, 1, &a, &b, &c, &d) && (a & XSAVEOPT_BIT))
+            cpu_save_simd = xsaveopt;
     } else {
         cpu_simd_region_size = 512; // Legacy size for fxsave
         cpu_save_simd = fxsave;
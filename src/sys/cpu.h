@@ -34,12 +34,25 @@ struct cpu_local_t {
     int64_t last_schedule_time;
     uint8_t lapic_id;
     int ipi_abortexec_received;
+    /* Thread an IPI_ABORTEXEC is meant for, see task_tkill() */
+    tid_t abortexec_task;
     int ipi_resched_received;
+    /* Address space loaded in cr3, used to target TLB shootdowns */
+    struct pagemap_t *current_pagemap;
+    /* User thread whose SIMD state was last loaded, see task_resched() */
+    struct thread_t *fpu_owner;
+    /* Value of the FS base MSR */
+    size_t fs_base;
+    /* RCU read side sections entered and left on this CPU, per index, see
+     * lib/rcu.h */
+    uint64_t rcu_locks[2];
+    uint64_t rcu_unlocks[2];
 };
 
 extern struct cpu_local_t cpu_locals[MAX_CPUS];
 
 extern unsigned int cpu_simd_region_size;
+extern int cpu_pcid_enabled;
 
 extern void (*cpu_save_simd)(void *);
 extern void (*cpu_restore_simd)(void *);
@@ -109,6 +122,15 @@ static inline void xsave(void *region) {
                   : "memory");
 }
 
+/* Only writes out the state components modified since the last xrstor from
+ * the same region */
+static inline void xsaveopt(void *region) {
+    asm volatile ("xsaveopt [%0]"
+                  :
+                  : "r" (region), "a" (0xFFFFFFFF), "d" (0xFFFFFFFF)
+                  : "memory");
+}
+
 static inline void xrstor(void *region) {
     asm volatile ("xrstor [%0]"
                   :
@@ -130,4 +152,14 @@ static inline void fxrstor(void *region) {
                   : "memory");
 }
 
+/* Load a new FS base, skipping the MSR write if it is loaded already. Called
+ * with interrupts disabled or scheduler_lock held. */
+static inline void cpu_set_fs_base(size_t base) {
+    struct cpu_local_t *cpu_local = &cpu_locals[current_cpu];
+    if (cpu_local->fs_base != base) {
+        load_fs_base(base);
+        cpu_local->fs_base = base;
+    }
+}
+
 #endif
@@ -0,0 +1,51 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/cpumask.h>
+
+static int cpumask_parse_cpu(const char **str) {
+    const char *s = *str;
+    int cpu = 0;
+
+    if (*s < '0' || *s > '9')
+        return -1;
+
+    for (; *s >= '0' && *s <= '9'; s++) {
+        cpu = cpu * 10 + (*s - '0');
+        if (cpu >= MAX_CPUS)
+            return -1;
+    }
+
+    *str = s;
+    return cpu;
+}
+
+/* Parse a CPU list such as "0-3,6" into a mask. Returns -1 on malformed
+ * input, leaving the mask untouched. */
+int cpumask_parse(cpumask_t *mask, const char *str) {
+    cpumask_t ret;
+    cpumask_zero(&ret);
+
+    for (;;) {
+        int first = cpumask_parse_cpu(&str);
+        if (first == -1)
+            return -1;
+
+        int last = first;
+        if (*str == '-') {
+            str++;
+            if ((last = cpumask_parse_cpu(&str)) == -1 || last < first)
+                return -1;
+        }
+
+        for (int i = first; i <= last; i++)
+            cpumask_set(&ret, i);
+
+        if (!*str)
+            break;
+        if (*str++ != ',')
+            return -1;
+    }
+
+    *mask = ret;
+    return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef __SYS__CPUMASK_H__
+#define __SYS__CPUMASK_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/cpu.h>
+
+/* Set of CPUs, bit n stands for CPU number n */
+typedef struct {
+    uint64_t bits[MAX_CPUS / 64];
+} cpumask_t;
+
+static inline void cpumask_zero(cpumask_t *mask) {
+    for (size_t i = 0; i < MAX_CPUS / 64; i++)
+        mask->bits[i] = 0;
+}
+
+static inline void cpumask_fill(cpumask_t *mask) {
+    for (size_t i = 0; i < MAX_CPUS / 64; i++)
+        mask->bits[i] = ~(uint64_t)0;
+}
+
+static inline void cpumask_set(cpumask_t *mask, int cpu) {
+    mask->bits[cpu / 64] |= (uint64_t)1 << (cpu % 64);
+}
+
+static inline void cpumask_clear(cpumask_t *mask, int cpu) {
+    mask->bits[cpu / 64] &= ~((uint64_t)1 << (cpu % 64));
+}
+
+static inline int cpumask_test(const cpumask_t *mask, int cpu) {
+    return (mask->bits[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+/* Lowest CPU below cpu_count in the mask, -1 if there is none */
+static inline int cpumask_first(const cpumask_t *mask, int cpu_count) {
+    for (int i = 0; i < cpu_count; i++) {
+        if (cpumask_test(mask, i))
+            return i;
+    }
+    return -1;
+}
+
+int cpumask_parse(cpumask_t *, const char *);
+
+#endif
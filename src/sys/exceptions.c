@@ -64,6 +64,25 @@ static const char *exception_names[] = {
 };
 
 void exception_handler(int exception, struct regs_t *regs, size_t error_code) {
+    /* User pages may be reserved lazily or shared copy-on-write. This
+     * applies both to userspace and to the kernel accessing user buffers */
+    if (exception == EXC_PAGEFAULT && !(error_code & 0b1000)) {
+        size_t fault_addr = read_cr("2");
+        pid_t current_process = cpu_locals[current_cpu].current_process;
+        /* Idle CPUs and aborted threads have no process, their faults are
+         * kernel bugs */
+        if (fault_addr < 0x800000000000 && smp_ready && current_process != -1) {
+            struct pagemap_t *pagemap = process_table[current_process]->pagemap;
+            if (!(error_code & 0b1)) {
+                if (!vmm_handle_lazy_fault(pagemap, fault_addr))
+                    return;
+            } else if (error_code & 0b10) {
+                if (!vmm_handle_cow_fault(pagemap, fault_addr))
+                    return;
+            }
+        }
+    }
+
     if (regs->cs == 0x23) {
         // userspace
         switch (exception) {
@@ -47,48 +47,54 @@ struct hpet_t {
 
 static struct hpet_t *hpet;
 
+/* Nanoseconds per counter tick, 32.32 fixed point */
+static uint64_t hpet_ns_mult;
+
+int hpet_ready = 0;
+
+/* The HPET only serves as a clock source, its timers stay disabled */
 void init_hpet(void) {
     uint64_t tmp;
 
     /* Find the HPET description table. */
     struct hpet_table_t *hpet_table = acpi_find_sdt("HPET", 0);
 
-    if (!hpet_table)
-        panic(NULL, 0, "HPET ACPI table not found");
+    if (!hpet_table) {
+        kprint(KPRN_WARN, "hpet: HPET ACPI table not found");
+        return;
+    }
 
     hpet = (struct hpet_t *)(hpet_table->address + MEM_PHYS_OFFSET);
     tmp = hpet->general_capabilities;
 
-    /* Check that the HPET is valid for our uses */
-    if (!(tmp & (1 << 15)))
-        panic(NULL, 0, "HPET is not legacy replacement capable");
+    /* A 32 bit counter wraps around within minutes */
+    if (!(tmp & (1 << 13))) {
+        kprint(KPRN_WARN, "hpet: Main counter is not 64 bits wide");
+        return;
+    }
 
     uint64_t counter_clk_period = tmp >> 32;
     uint64_t frequency = 1000000000000000 / counter_clk_period;
 
     kprint(KPRN_INFO, "hpet: Detected frequency of %UHz", frequency);
 
-    kprint(KPRN_INFO, "hpet: Enabling legacy replacement mode");
+    /* The period is in femtoseconds and at most 100ns, so this can't
+     * overflow */
+    hpet_ns_mult = (counter_clk_period << 32) / 1000000;
+
+    kprint(KPRN_INFO, "hpet: Starting main counter");
     tmp = hpet->general_configuration;
-    tmp |= 0b10;
+    tmp &= ~((uint64_t)0b11);
     hpet->general_configuration = tmp;
 
     hpet->main_counter_value = 0;
 
-    kprint(KPRN_INFO, "hpet: Enabling interrupts on timer #0");
-    tmp = hpet->timers[0].config_and_capabilities;
-    if (!(tmp & (1 << 4)))
-        panic(NULL, 0, "HPET timer #0 does not support periodic mode");
-
-    tmp |= (1 << 2) | (1 << 3) | (1 << 6);
-    hpet->timers[0].config_and_capabilities = tmp;
-    hpet->timers[0].comparator_value = frequency / HPET_FREQUENCY_HZ;
-
-    kprint(KPRN_INFO, "hpet: Enabling overall");
-    tmp = hpet->general_configuration;
     tmp |= 0b01;
     hpet->general_configuration = tmp;
 
-    kprint(KPRN_INFO, "hpet: Unmasking IRQ #0");
-    io_apic_set_up_legacy_irq(0, 0, 1);
+    hpet_ready = 1;
+}
+
+uint64_t hpet_get_ns(void) {
+    return ((unsigned __int128)hpet->main_counter_value * hpet_ns_mult) >> 32;
 }
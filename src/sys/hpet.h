@@ -1,8 +1,11 @@
 #ifndef __HPET_H__
 #define __HPET_H__
 
-#define HPET_FREQUENCY_HZ 1000
+#include <stdint.h>
+
+extern int hpet_ready;
 
 void init_hpet(void);
+uint64_t hpet_get_ns(void);
 
 #endif
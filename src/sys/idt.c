@@ -4,6 +4,13 @@
 #include <sys/ipi.h>
 #include <lib/lock.h>
 
+event_t int_event[256];
+
+/* Called by the generic interrupt thunks */
+void int_event_trigger(int vector) {
+    event_trigger(&int_event[vector]);
+}
+
 static lock_t get_empty_int_lock = new_lock;
 static int free_int_vect_base = 0x80;
 static const int free_int_vect_limit = 0xa0;
@@ -82,10 +89,13 @@ void init_idt(void) {
 
     register_interrupt_handler(0x20, irq0_handler, 0, 0x8e);
 
+    register_interrupt_handler(LAPIC_TIMER_VECTOR, lapic_timer_handler, 0, 0x8e);
+
     /* Inter-processor interrupts */
     register_interrupt_handler(IPI_ABORT, ipi_abort, 1, 0x8e);
     register_interrupt_handler(IPI_RESCHED, ipi_resched, 1, 0x8e);
     register_interrupt_handler(IPI_ABORTEXEC, ipi_abortexec, 1, 0x8e);
+    register_interrupt_handler(IPI_TLB_SHOOTDOWN, ipi_tlb_shootdown, 1, 0x8e);
 
     /* Register dummy legacy PIC handlers */
     for (size_t i = 0; i < 8; i++)
@@ -58,9 +58,9 @@
 global ipi_abort
 global ipi_resched
 global ipi_abortexec
+global ipi_tlb_shootdown
 
 ; Misc.
-extern task_resched_bsp
 extern task_resched
 extern task_trigger_resched
 global syscall_entry
@@ -79,19 +79,17 @@ eoi:
 
 ; Interrupt thunks
 
-section .bss
-global int_event
-align 16
-int_event: resq 256
+extern int_event_trigger
 
 %macro raise_int 1
 align 16
 raise_int_%1:
-    lock inc dword [int_event+%1*4]
-    push rax
+    pusham
+    mov rdi, %1
+    call int_event_trigger
     mov rax, qword [lapic_eoi_ptr]
     mov dword [rax], 0
-    pop rax
+    popam
     iretq
 %endmacro
 
@@ -229,6 +227,20 @@ section .text
 
 align 16
 ipi_abortexec:
+    pusham
+
+    ; the thread may have been switched out since the IPI was sent
+    extern task_abortexec_check
+    xor rbp, rbp
+    call task_abortexec_check
+    test eax, eax
+    jnz .abort
+
+    popam
+    iretq
+
+  .abort:
+    popam
     cld
     mov rdi, qword [rsp]
     mov rsp, qword [gs:0008]
@@ -248,9 +260,23 @@ ipi_resched:
 
     mov rdi, rsp
 
-    extern task_resched_ap
+    extern task_resched_ipi
     xor rbp, rbp
-    call task_resched_ap
+    call task_resched_ipi
+
+    popam
+    iretq
+
+align 16
+ipi_tlb_shootdown:
+    pusham
+
+    extern tlb_shootdown_handler
+    xor rbp, rbp
+    call tlb_shootdown_handler
+
+    mov rax, qword [lapic_eoi_ptr]
+    mov dword [rax], 0
 
     popam
     iretq
@@ -359,6 +385,30 @@ syscall_table:
     dq syscall_umount ;42
     extern syscall_poll
     dq syscall_poll ;43
+    extern syscall_nanosleep
+    dq syscall_nanosleep ;44
+    extern syscall_clock_nanosleep
+    dq syscall_clock_nanosleep ;45
+    extern syscall_setpriority
+    dq syscall_setpriority ;46
+    extern syscall_getpriority
+    dq syscall_getpriority ;47
+    extern syscall_sched_setscheduler
+    dq syscall_sched_setscheduler ;48
+    extern syscall_sched_getparam
+    dq syscall_sched_getparam ;49
+    extern syscall_sched_getscheduler
+    dq syscall_sched_getscheduler ;50
+    extern syscall_sched_setaffinity
+    dq syscall_sched_setaffinity ;51
+    extern syscall_sched_getaffinity
+    dq syscall_sched_getaffinity ;52
+    extern syscall_futex_requeue
+    dq syscall_futex_requeue ;53
+    extern syscall_futex_wake_count
+    dq syscall_futex_wake_count ;54
+    extern syscall_futex_timedwait
+    dq syscall_futex_timedwait ;55
   .end:
 
 section .text
@@ -428,11 +478,24 @@ irq0_handler:
     mov rax, qword [lapic_eoi_ptr]
     mov dword [rax], 0
 
+    popam
+    iretq
+
+; Local APIC timer thunk
+
+align 16
+global lapic_timer_handler
+lapic_timer_handler:
+    pusham
+
+    mov rax, qword [lapic_eoi_ptr]
+    mov dword [rax], 0
+
     mov rdi, rsp
 
-    extern task_resched_bsp
+    extern task_timer_interrupt
     xor rbp, rbp
-    call task_resched_bsp
+    call task_timer_interrupt
 
     popam
     iretq
@@ -112,7 +112,8 @@ struct pci_device_t *pci_get_device(uint8_t class, uint8_t subclass, uint8_t pro
     size_t i;
     struct pci_device_t *ret = dynarray_search(struct pci_device_t, pci_devices, &i, elem->device_class == class
                             && elem->subclass == subclass && elem->prog_if == prog_if, index);
-    dynarray_unref(pci_devices, i);
+    if (ret)
+        dynarray_unref(pci_devices, i);
     return ret;
 }
 
@@ -120,7 +121,8 @@ struct pci_device_t *pci_get_device_by_vendor(uint16_t vendor, uint16_t id, size
     size_t i;
     struct pci_device_t *ret = dynarray_search(struct pci_device_t, pci_devices, &i,
             elem->vendor_id == vendor && elem->device_id == id, index);
-    dynarray_unref(pci_devices, i);
+    if (ret)
+        dynarray_unref(pci_devices, i);
     return ret;
 }
 
@@ -57,6 +57,7 @@ static void ap_kernel_entry(void) {
     /* Enable this AP's local APIC */
     init_cpu_features();
     lapic_enable();
+    lapic_timer_enable();
 
     /* Enable interrupts */
     asm volatile ("sti");
@@ -0,0 +1,136 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/timer.h>
+#include <sys/cpu.h>
+#include <sys/apic.h>
+#include <lib/lock.h>
+#include <lib/cio.h>
+#include <lib/time.h>
+#include <lib/rbtree.h>
+
+/* Each CPU keeps the timers armed on it in a tree ordered by deadline and
+ * runs the expired ones when its local APIC timer fires. The APIC timer is
+ * one-shot and always points at the earliest deadline, so a CPU without
+ * timers takes no timer interrupts at all. */
+struct timer_queue_t {
+    lock_t lock;
+    struct rb_root tree;
+};
+
+static struct timer_queue_t timer_queues[MAX_CPUS] = {
+    [0 ... MAX_CPUS - 1] = { new_lock, { NULL } }
+};
+
+static int timer_comp(struct rb_node *a, struct rb_node *b, void *arg) {
+    (void)arg;
+    struct timer_t *x = rb_entry(a, struct timer_t, node);
+    struct timer_t *y = rb_entry(b, struct timer_t, node);
+
+    if (x->deadline != y->deadline)
+        return x->deadline < y->deadline ? -1 : 1;
+    /* Equal deadlines, fall back to an arbitrary but stable order */
+    if (x != y)
+        return x < y ? -1 : 1;
+    return 0;
+}
+
+/* Point the local APIC timer at the earliest deadline of the current CPU.
+ * Called with the queue lock held. */
+static void timer_reprogram(struct timer_queue_t *queue) {
+    if (!lapic_timer_ready)
+        return;
+
+    struct rb_node *first = rb_first(&queue->tree);
+    if (first)
+        lapic_timer_arm(rb_entry(first, struct timer_t, node)->deadline);
+    else
+        lapic_timer_stop();
+}
+
+/* Arm a timer on the current CPU. fn(arg) runs from the tick interrupt once
+ * the deadline passes, with the timer already disarmed. The timer must not
+ * be armed already. */
+void timer_arm(struct timer_t *timer, uint64_t deadline,
+               void (*fn)(void *), void *arg) {
+    uint64_t rflags = save_and_disable_interrupts();
+
+    int cpu = current_cpu;
+    struct timer_queue_t *queue = &timer_queues[cpu];
+
+    timer->deadline = deadline;
+    timer->fn = fn;
+    timer->arg = arg;
+
+    spinlock_acquire(&queue->lock);
+    rb_insert(&queue->tree, timer_comp, NULL, &timer->node);
+    locked_write(int, &timer->cpu, cpu);
+    if (rb_first(&queue->tree) == &timer->node)
+        timer_reprogram(queue);
+    spinlock_release(&queue->lock);
+
+    restore_interrupts(rflags);
+}
+
+/* Disarm a timer. Returns 1 if it was still armed, 0 if it already fired or
+ * was never armed. Once this returns the timer is not referenced anymore,
+ * but a callback which already started may still be running. */
+int timer_cancel(struct timer_t *timer) {
+    int ret = 0;
+    uint64_t rflags = save_and_disable_interrupts();
+
+    for (;;) {
+        int cpu = locked_read(int, &timer->cpu);
+        if (cpu == -1)
+            break;
+        struct timer_queue_t *queue = &timer_queues[cpu];
+        spinlock_acquire(&queue->lock);
+        if (timer->cpu == cpu) {
+            int was_first = rb_first(&queue->tree) == &timer->node;
+            rb_delete(&queue->tree, &timer->node);
+            locked_write(int, &timer->cpu, -1);
+            /* Another CPU's timer can't be reached from here, it will just
+             * find nothing to run when it fires */
+            if (was_first && cpu == current_cpu)
+                timer_reprogram(queue);
+            spinlock_release(&queue->lock);
+            ret = 1;
+            break;
+        }
+        spinlock_release(&queue->lock);
+    }
+
+    restore_interrupts(rflags);
+    return ret;
+}
+
+/* Run the expired timers of the current CPU and re-arm the APIC timer for
+ * the next one. Called from the APIC timer interrupt. */
+void timer_handler(void) {
+    struct timer_queue_t *queue = &timer_queues[current_cpu];
+    uint64_t now = get_uptime_ns();
+
+    spinlock_acquire(&queue->lock);
+
+    for (;;) {
+        struct rb_node *first = rb_first(&queue->tree);
+        if (!first)
+            break;
+        struct timer_t *timer = rb_entry(first, struct timer_t, node);
+        if (timer->deadline > now)
+            break;
+
+        rb_delete(&queue->tree, first);
+        void (*fn)(void *) = timer->fn;
+        void *arg = timer->arg;
+        /* The owner may free the timer as soon as this is visible */
+        locked_write(int, &timer->cpu, -1);
+
+        spinlock_release(&queue->lock);
+        fn(arg);
+        spinlock_acquire(&queue->lock);
+    }
+
+    timer_reprogram(queue);
+
+    spinlock_release(&queue->lock);
+}
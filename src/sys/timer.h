@@ -0,0 +1,21 @@
+#ifndef __SYS__TIMER_H__
+#define __SYS__TIMER_H__
+
+#include <stdint.h>
+#include <lib/rbtree.h>
+
+/* One-shot timer. Deadlines are in nanoseconds of get_uptime_ns(). */
+struct timer_t {
+    struct rb_node node;
+    uint64_t deadline;
+    /* CPU whose queue the timer is armed on, -1 if not armed */
+    int cpu;
+    void (*fn)(void *);
+    void *arg;
+};
+
+void timer_arm(struct timer_t *, uint64_t, void (*)(void *), void *);
+int timer_cancel(struct timer_t *);
+void timer_handler(void);
+
+#endif
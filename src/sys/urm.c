@@ -201,6 +201,8 @@ static void exit_receive_request(struct exit_request_t *exit_request) {
 void userspace_request_monitor(void *arg) {
     (void)arg;
 
+    task_pin_kworker();
+
     kprint(KPRN_INFO, "urm: Userspace request monitor launched.");
 
     /* main event loop */
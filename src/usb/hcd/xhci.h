@@ -2,6 +2,7 @@
 #define XHCI_H
 
 #include <lib/lock.h>
+#include <lib/types.h>
 #include <usb/usb.h>
 
 #define BIT(x) (1 << (x))
@@ -145,7 +146,7 @@ struct xhci_event_trb {
 
 struct xhci_event {
     struct xhci_event_trb trb;
-    int event;
+    event_t event;
 };
 
 struct xhci_command_trb {
@@ -324,7 +325,7 @@ struct xhci_hcd {
     struct xhci_port_protocol protocols[255];
 
     int irq_line;
-    int port_events[XHCI_CONFIG_MAX_SLOT + 1];
+    event_t port_events[XHCI_CONFIG_MAX_SLOT + 1];
 };
 
 struct usb_hc_t *usb_init_xhci(void);